@@ -0,0 +1,239 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <atomic>
+#include <cstddef>
+#include <new>
+
+#include <sys/resource.h>
+
+enum class component {
+  TOKENIZER
+  , PARSER
+  , SYMBOLS
+  , GENERATOR
+  , WRITER
+  , OTHER       // the index, the passes and the driver
+  , COUNT
+};
+
+inline const char *componentName(enum::component c) {
+  switch (c) {
+    case component::TOKENIZER: return "tokenizer";
+    case component::PARSER: return "parser";
+    case component::SYMBOLS: return "symbols";
+    case component::GENERATOR: return "generator";
+    case component::WRITER: return "writer";
+    case component::OTHER: return "other";
+    default: return "";
+  }
+}
+
+// What one component allocated
+struct AllocationCounts {
+  uint64_t allocations = 0;     // from the heap, through operator new
+  uint64_t bytes = 0;
+  uint64_t live = 0;            // heap bytes not yet freed
+  uint64_t peak = 0;            // most live at once since resetPeaks()
+  uint64_t highWater = 0;       // most live at once in the run
+  uint64_t arenaAllocations = 0;  // handed out by an Arena, whose chunks are
+  uint64_t arenaBytes = 0;        // heap allocations of their own
+};
+
+/*
+  Heap and arena allocations by component, compiled in with
+  -DTRACK_ALLOCATIONS, e.g. make build ALLOCFLAGS=-DTRACK_ALLOCATIONS.
+
+  The component is a thread local set by ALLOCATION_SCOPE at the entry
+  points of the tokenizer, parser, symbol table, generator and writer, the
+  innermost scope wins. The replaced operator new puts a 16 byte header
+  with the size and component before every block, so a free is taken off
+  the component that allocated it. The counters are relaxed atomics, cheap
+  enough to leave on in CI builds. Without the define every scope is
+  empty and nothing is counted.
+*/
+class Allocations {
+  private:
+    struct Counters {
+      std::atomic<uint64_t> allocations{0};
+      std::atomic<uint64_t> bytes{0};
+      std::atomic<uint64_t> live{0};
+      std::atomic<uint64_t> peak{0};
+      std::atomic<uint64_t> highWater{0};
+      std::atomic<uint64_t> arenaAllocations{0};
+      std::atomic<uint64_t> arenaBytes{0};
+    };
+
+    Counters counters[(int)component::COUNT];
+    static inline thread_local enum::component current = component::OTHER;
+
+    static void raise(std::atomic<uint64_t> &peak, uint64_t live) {
+      uint64_t seen = peak.load(std::memory_order_relaxed);
+      while (live > seen && !peak.compare_exchange_weak(seen, live, std::memory_order_relaxed))
+        ;
+    }
+
+  public:
+    static const size_t HEADER = 16;
+
+    constexpr Allocations() { }
+
+    static enum::component enter(enum::component c) {
+      enum::component outer = current;
+      current = c;
+      return outer;
+    }
+
+    static void leave(enum::component outer) {
+      current = outer;
+    }
+
+    static enum::component active() {
+      return current;
+    }
+
+    void allocated(enum::component c, size_t size) {
+      Counters &n = counters[(int)c];
+      n.allocations.fetch_add(1, std::memory_order_relaxed);
+      n.bytes.fetch_add(size, std::memory_order_relaxed);
+      uint64_t live = n.live.fetch_add(size, std::memory_order_relaxed) + size;
+      raise(n.peak, live);
+      raise(n.highWater, live);
+    }
+
+    void freed(enum::component c, size_t size) {
+      counters[(int)c].live.fetch_sub(size, std::memory_order_relaxed);
+    }
+
+    void arena(size_t size) {
+      Counters &n = counters[(int)current];
+      n.arenaAllocations.fetch_add(1, std::memory_order_relaxed);
+      n.arenaBytes.fetch_add(size, std::memory_order_relaxed);
+    }
+
+    AllocationCounts counts(enum::component c) const {
+      const Counters &n = counters[(int)c];
+      AllocationCounts result;
+      result.allocations = n.allocations.load(std::memory_order_relaxed);
+      result.bytes = n.bytes.load(std::memory_order_relaxed);
+      result.live = n.live.load(std::memory_order_relaxed);
+      result.peak = n.peak.load(std::memory_order_relaxed);
+      result.highWater = n.highWater.load(std::memory_order_relaxed);
+      result.arenaAllocations = n.arenaAllocations.load(std::memory_order_relaxed);
+      result.arenaBytes = n.arenaBytes.load(std::memory_order_relaxed);
+      return result;
+    }
+
+    // From now on the peaks are of what is live from here
+    void resetPeaks() {
+      for (Counters &n: counters)
+        n.peak.store(n.live.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+};
+
+// Constant initialized, so it is there for the first operator new
+inline Allocations allocationCounters;
+
+inline constexpr bool trackingAllocations() {
+#ifdef TRACK_ALLOCATIONS
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Allocations in the enclosing block are charged to c
+class AllocationScope {
+  private:
+    enum::component outer;
+
+  public:
+    AllocationScope(enum::component c) : outer(Allocations::enter(c)) { }
+
+    ~AllocationScope() {
+      Allocations::leave(outer);
+    }
+};
+
+#ifdef TRACK_ALLOCATIONS
+#define ALLOCATION_SCOPE(c) AllocationScope allocationScope(component::c)
+#else
+#define ALLOCATION_SCOPE(c)
+#endif
+
+// High water mark of the resident set of the process, in bytes
+inline uint64_t peakRSS() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss;
+#else
+  return usage.ru_maxrss * 1024;
+#endif
+}
+
+#ifdef TRACK_ALLOCATIONS
+// The replacements, defined once in the one translation unit of a program
+
+inline void *trackedAllocate(size_t size) {
+  enum::component c = Allocations::active();
+  char *block = (char *)malloc(size + Allocations::HEADER);
+  if (!block)
+    return nullptr;
+  ((uint64_t *)block)[0] = size;
+  ((uint64_t *)block)[1] = (uint64_t)c;
+  allocationCounters.allocated(c, size);
+  return block + Allocations::HEADER;
+}
+
+inline void trackedFree(void *p) {
+  if (!p)
+    return;
+  char *block = (char *)p - Allocations::HEADER;
+  allocationCounters.freed((enum::component)((uint64_t *)block)[1], ((uint64_t *)block)[0]);
+  free(block);
+}
+
+void *operator new(size_t size) {
+  if (void *p = trackedAllocate(size))
+    return p;
+  throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) {
+  return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  return trackedAllocate(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  return trackedAllocate(size);
+}
+
+void operator delete(void *p) noexcept {
+  trackedFree(p);
+}
+
+void operator delete[](void *p) noexcept {
+  trackedFree(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+  trackedFree(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+  trackedFree(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+  trackedFree(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+  trackedFree(p);
+}
+#endif
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <cstddef>
+#include <new>
+#include <string_view>
+#include <vector>
+
+#include "Allocations.hh"
+
+/*
+  Bump pointer allocator owned by one compilation. Nothing is freed on its
+  own, every chunk goes at once when the arena is destroyed.
+*/
+class Arena {
+  private:
+    static const size_t CHUNK = 64 * 1024;
+
+    std::vector<char *> chunks;
+    char *next = nullptr;
+    char *end = nullptr;
+
+    static uintptr_t alignUp(const char *p, size_t align) {
+      return ((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1);
+    }
+
+    char *newChunk(size_t size) {
+      char *chunk = (char *)::operator new(size);
+      chunks.push_back(chunk);
+      return chunk;
+    }
+
+  public:
+    uint64_t allocations = 0;   // requests served
+    uint64_t bytes = 0;         // bytes handed out
+
+    Arena() { }
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    ~Arena() {
+      for (char *chunk: chunks)
+        ::operator delete(chunk);
+    }
+
+    void *allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+      ++allocations;
+      bytes += size;
+      if (trackingAllocations())
+        allocationCounters.arena(size);
+      uintptr_t p = alignUp(next, align);
+      if (next && p + size <= (uintptr_t)end) {
+        next = (char *)(p + size);
+        return (void *)p;
+      }
+      // Big requests get a chunk of their own, the current one is kept
+      if (size + align > CHUNK / 4)
+        return (void *)alignUp(newChunk(size + align), align);
+      next = newChunk(CHUNK);
+      end = next + CHUNK;
+      p = alignUp(next, align);
+      next = (char *)(p + size);
+      return (void *)p;
+    }
+
+    std::string_view copy(std::string_view text) {
+      char *p = (char *)allocate(text.size(), 1);
+      std::copy(text.begin(), text.end(), p);
+      return std::string_view(p, text.size());
+    }
+
+    std::string_view join(std::string_view a, std::string_view b,
+                          std::string_view c = std::string_view()) {
+      char *p = (char *)allocate(a.size() + b.size() + c.size(), 1);
+      std::copy(a.begin(), a.end(), p);
+      std::copy(b.begin(), b.end(), p + a.size());
+      std::copy(c.begin(), c.end(), p + a.size() + b.size());
+      return std::string_view(p, a.size() + b.size() + c.size());
+    }
+
+    // prefix followed by the decimal digits of n
+    std::string_view label(std::string_view prefix, uint64_t n) {
+      char digits[20];
+      size_t len = 0;
+      do {
+        digits[len++] = '0' + n % 10;
+        n /= 10;
+      } while (n);
+      char *p = (char *)allocate(prefix.size() + len, 1);
+      std::copy(prefix.begin(), prefix.end(), p);
+      for (size_t i = 0; i < len; ++i)
+        p[prefix.size() + i] = digits[len - 1 - i];
+      return std::string_view(p, prefix.size() + len);
+    }
+
+    // Frees every chunk, nothing handed out before may be used after
+    void clear() {
+      for (char *chunk: chunks)
+        ::operator delete(chunk);
+      chunks.clear();
+      next = end = nullptr;
+    }
+
+    uint64_t chunkCount() const {
+      return chunks.size();
+    }
+};
+
+// Lets standard containers take their memory from an Arena
+template <class T>
+struct ArenaAllocator {
+  typedef T value_type;
+
+  Arena *arena;
+
+  ArenaAllocator(Arena &arena) : arena(&arena) { }
+
+  template <class U>
+  ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) { }
+
+  T *allocate(size_t n) {
+    return (T *)arena->allocate(n * sizeof(T), alignof(T));
+  }
+
+  void deallocate(T *, size_t) { }
+
+  template <class U>
+  bool operator==(const ArenaAllocator<U> &other) const {
+    return arena == other.arena;
+  }
+
+  template <class U>
+  bool operator!=(const ArenaAllocator<U> &other) const {
+    return arena != other.arena;
+  }
+};
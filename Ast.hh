@@ -0,0 +1,194 @@
+#pragma once
+
+#include <stdint.h>
+#include <string_view>
+#include <vector>
+
+#include "Arena.hh"
+#include "Interner.hh"
+#include "JackTokens.hh"
+
+// Index of a node in the pool of its kind
+typedef uint32_t NodeId;
+const NodeId NIL = UINT32_MAX;
+
+// Where a node comes from: byte offsets [begin, end) and its first line.
+// 32 bits keep a node in 64 bytes, so a source must be smaller than 4 GiB,
+// which the tokenizer checks.
+struct Span {
+  uint32_t begin = 0;
+  uint32_t end = 0;
+  uint32_t line = 0;
+};
+
+enum class statementType {
+  LET
+  , IF
+  , WHILE
+  , DO
+  , RETURN
+};
+
+enum class termType {
+  INT_CONST
+  , STR_CONST
+  , KEYWORD
+  , VAR         // varName
+  , INDEX       // varName[left]
+  , CALL        // qualifier.name(args) or name(args)
+  , GROUP       // (left)
+  , UNARY       // op left
+  , BINARY      // left op right
+};
+
+// How a binary operator is parsed and emitted. An ARITHMETIC op is the VM
+// command cmd. A CALL op, for those the VM lacks, calls the two argument
+// function call and leaves cmd unset.
+struct BinaryOp {
+  char symbol;
+  int precedence;
+  enum::vmOp emit;
+  enum::command cmd;
+  const char *call;
+};
+
+// Jack gives every operator the same precedence, so chains go left to right
+const BinaryOp binaryOps[] = {
+  {'+', 1, vmOp::ARITHMETIC, command::ADD, nullptr}
+  , {'-', 1, vmOp::ARITHMETIC, command::SUB, nullptr}
+  , {'*', 1, vmOp::CALL, {}, "Math.multiply"}
+  , {'/', 1, vmOp::CALL, {}, "Math.divide"}
+  , {'&', 1, vmOp::ARITHMETIC, command::AND, nullptr}
+  , {'|', 1, vmOp::ARITHMETIC, command::OR, nullptr}
+  , {'<', 1, vmOp::ARITHMETIC, command::LT, nullptr}
+  , {'>', 1, vmOp::ARITHMETIC, command::GT, nullptr}
+  , {'=', 1, vmOp::ARITHMETIC, command::EQ, nullptr}
+};
+
+// nullptr if symbol is not a binary operator
+inline const BinaryOp *binaryOp(char symbol) {
+  for (const BinaryOp &op: binaryOps)
+    if (op.symbol == symbol)
+      return &op;
+  return nullptr;
+}
+
+// A class variable, parameter or local, one node per name
+struct VarNode {
+  uint32_t name;
+  uint32_t type;              // interned int|char|boolean|className
+  enum::kind kind;
+  NodeId next = NIL;
+  Span span;
+};
+
+struct ExpressionNode {
+  enum::termType type;
+  char op = 0;                // UNARY|BINARY: the operator symbol
+  enum::keyWord keyWord = keyWord::NONE;
+  uint32_t name = Interner::NONE;       // VAR|INDEX|CALL: interned name
+  uint32_t qualifier = Interner::NONE;  // CALL: class or var before '.', NONE if unqualified
+  uint32_t length = 0;        // STR_CONST: bytes, CALL: arguments
+  int64_t value = 0;          // INT_CONST: the value, STR_CONST: offset in Ast::text
+  NodeId left = NIL;          // CALL: first argument
+  NodeId right = NIL;
+  NodeId next = NIL;          // next argument of a call
+  Span span;
+};
+
+struct StatementNode {
+  enum::statementType type;
+  bool hasElse = false;
+  uint32_t name = Interner::NONE;   // LET: the variable
+  NodeId index = NIL;         // LET: subscript, NIL without one
+  NodeId value = NIL;         // LET: value, IF|WHILE: condition, DO: the call, RETURN: NIL if none
+  NodeId body = NIL;          // IF|WHILE: first statement
+  NodeId orElse = NIL;        // IF: first statement of else
+  NodeId next = NIL;
+  Span span;
+};
+
+struct SubroutineNode {
+  enum::keyWord kind;         // CONSTRUCTOR|FUNCTION|METHOD
+  uint32_t name;              // interned Class.subroutine
+  uint32_t returnType;
+  NodeId params = NIL;
+  NodeId locals = NIL;
+  NodeId body = NIL;
+  NodeId next = NIL;
+  Span span;
+};
+
+struct ClassNode {
+  uint32_t name;
+  NodeId vars = NIL;
+  NodeId subroutines = NIL;
+  Span span;
+};
+
+// Memory per node is fixed, whatever the size of the program
+static_assert(sizeof(ExpressionNode) <= 64, "ExpressionNode grew");
+static_assert(sizeof(StatementNode) <= 64, "StatementNode grew");
+static_assert(sizeof(SubroutineNode) <= 64, "SubroutineNode grew");
+
+/*
+  Nodes of one kind in blocks taken from an Arena. A node never moves once
+  added, so references and NodeId* into a pool stay valid while it grows.
+*/
+template <class T>
+class Pool {
+  private:
+    static const uint32_t BLOCK_BITS = 10;
+    static const uint32_t BLOCK = 1 << BLOCK_BITS;
+
+    Arena *arena;
+    std::vector<T *> blocks;
+    uint32_t count = 0;
+
+  public:
+    Pool(Arena &arena) : arena(&arena) { }
+
+    NodeId add(const T &node) {
+      if (count % BLOCK == 0)
+        blocks.push_back((T *)arena->allocate(BLOCK * sizeof(T), alignof(T)));
+      new (&blocks.back()[count % BLOCK]) T(node);
+      return count++;
+    }
+
+    T &operator[](NodeId id) {
+      return blocks[id >> BLOCK_BITS][id & (BLOCK - 1)];
+    }
+
+    const T &operator[](NodeId id) const {
+      return blocks[id >> BLOCK_BITS][id & (BLOCK - 1)];
+    }
+
+    uint32_t size() const {
+      return count;
+    }
+};
+
+/*
+  The parse tree of one class. Nodes link to each other by index, lists are
+  chained through next, and everything lives in the Arena of the compilation.
+*/
+struct Ast {
+  NodeId root = NIL;
+  Pool<ClassNode> classes;
+  Pool<VarNode> vars;
+  Pool<SubroutineNode> subroutines;
+  Pool<StatementNode> statements;
+  Pool<ExpressionNode> expressions;
+  std::vector<char, ArenaAllocator<char> > text;    // string constants
+
+  Ast(Arena &arena)
+    : classes(arena), vars(arena), subroutines(arena), statements(arena),
+      expressions(arena), text(ArenaAllocator<char>(arena)) { }
+
+  Ast(const Ast &) = delete;
+  Ast &operator=(const Ast &) = delete;
+
+  std::string_view string(const ExpressionNode &e) const {
+    return std::string_view(text.data() + e.value, e.length);
+  }
+};
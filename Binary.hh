@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+// Native byte order, the files are caches for the machine that wrote them
+
+inline void writeU32(std::ostream &out, uint32_t value) {
+  out.write((const char *)&value, sizeof value);
+}
+
+inline void writeU64(std::ostream &out, uint64_t value) {
+  out.write((const char *)&value, sizeof value);
+}
+
+inline void writeString(std::ostream &out, std::string_view text) {
+  writeU32(out, text.size());
+  out.write(text.data(), text.size());
+}
+
+inline uint32_t readU32(std::istream &in) {
+  uint32_t value = 0;
+  in.read((char *)&value, sizeof value);
+  return value;
+}
+
+inline uint64_t readU64(std::istream &in) {
+  uint64_t value = 0;
+  in.read((char *)&value, sizeof value);
+  return value;
+}
+
+// Fails the stream rather than read a string longer than max
+inline std::string readString(std::istream &in, uint32_t max = 4096) {
+  uint32_t size = readU32(in);
+  if (!in || size > max) {
+    in.setstate(std::ios::failbit);
+    return std::string();
+  }
+  std::string text(size, '\0');
+  in.read(&text[0], text.size());
+  return text;
+}
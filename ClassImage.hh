@@ -0,0 +1,442 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Ast.hh"
+#include "Hash.hh"
+#include "Interner.hh"
+#include "JackTokenizer.hh"
+#include "SymbolTable.hh"
+
+enum class imageSection {
+  TOKENS          // ImageToken, in source order
+  , NAMES         // ImageName, indexed by the name fields of everything else
+  , STRINGS       // the bytes of the names
+  , TEXT          // Ast::text, the string constants
+  , SYMBOLS       // Symbol of each VarNode, its type a name index
+  , CLASSES       // the Ast pools, nodes as the parser left them with names
+  , VARS          // as indices into NAMES
+  , SUBROUTINES
+  , STATEMENTS
+  , EXPRESSIONS
+  , COUNT
+};
+
+struct ImageSection {
+  uint64_t offset;      // from the start of the file, 8 byte aligned
+  uint64_t count;       // of items
+};
+
+struct ImageToken {
+  uint32_t begin;
+  uint32_t end;
+  uint32_t line;
+  enum::tokenType type;
+};
+
+struct ImageName {
+  uint32_t offset;      // into STRINGS
+  uint32_t length;
+};
+
+struct ImageHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t sourceHash;  // hashWords of the source, also in the file name
+  uint64_t sourceSize;
+  uint64_t size;        // of the file
+  uint64_t checksum;    // hashWords of everything after the header
+  uint32_t layout[8];   // sizes of the records, an image of another build is refused
+  NodeId root;
+  uint32_t unused;
+  ImageSection sections[(int)imageSection::COUNT];
+};
+
+static_assert(std::is_trivially_copyable<ClassNode>::value
+              && std::is_trivially_copyable<VarNode>::value
+              && std::is_trivially_copyable<SubroutineNode>::value
+              && std::is_trivially_copyable<StatementNode>::value
+              && std::is_trivially_copyable<ExpressionNode>::value
+              && std::is_trivially_copyable<Symbol>::value,
+              "image records are written as they are in memory");
+
+/*
+  The tokens, symbols and parse tree of one class in a single file, laid out
+  to be mmapped and read in place: every section is an array of fixed size
+  records and every link is an index, a NodeId into a pool or a name index
+  into NAMES, so nothing needs fixing up after mapping. Files live in a
+  cache directory named by the hash of the source they came from.
+
+  open() trusts an image only after a checksum of the whole file, a word at
+  a time, and a check that every index is in range and every list and
+  subtree runs one way through its pool, so walking one always ends. Both
+  are linear in the image and far cheaper than lexing and parsing again.
+*/
+class ClassImage {
+  private:
+    static const uint32_t MAGIC = 0x49534a4a;   // "JJSI"
+    static const uint32_t VERSION = 1;
+
+    const char *data = nullptr;
+    size_t size = 0;
+    const ImageHeader *header = nullptr;
+
+    static void layout(uint32_t sizes[8]) {
+      uint32_t records[8] = {sizeof(ImageHeader), sizeof(ImageToken), sizeof(Symbol),
+                             sizeof(ClassNode), sizeof(VarNode), sizeof(SubroutineNode),
+                             sizeof(StatementNode), sizeof(ExpressionNode)};
+      memcpy(sizes, records, sizeof records);
+    }
+
+    static size_t recordSize(imageSection s) {
+      switch (s) {
+        case imageSection::TOKENS: return sizeof(ImageToken);
+        case imageSection::NAMES: return sizeof(ImageName);
+        case imageSection::SYMBOLS: return sizeof(Symbol);
+        case imageSection::CLASSES: return sizeof(ClassNode);
+        case imageSection::VARS: return sizeof(VarNode);
+        case imageSection::SUBROUTINES: return sizeof(SubroutineNode);
+        case imageSection::STATEMENTS: return sizeof(StatementNode);
+        case imageSection::EXPRESSIONS: return sizeof(ExpressionNode);
+        default: return 1;
+      }
+    }
+
+    void close() {
+      if (data)
+        munmap((void *)data, size);
+      data = nullptr;
+      header = nullptr;
+      size = 0;
+    }
+
+    // Every index in range, lists only forward and subtrees only backward
+    bool validate() const {
+      uint64_t names = count(imageSection::NAMES);
+      uint64_t nVars = count(imageSection::VARS);
+      uint64_t nSubroutines = count(imageSection::SUBROUTINES);
+      uint64_t nStatements = count(imageSection::STATEMENTS);
+      uint64_t nExpressions = count(imageSection::EXPRESSIONS);
+      auto name = [&](uint32_t i) { return i == Interner::NONE || i < names; };
+      auto in = [](NodeId id, uint64_t n) { return id == NIL || id < n; };
+      auto before = [](NodeId id, NodeId self) { return id == NIL || id < self; };
+      auto after = [](NodeId id, NodeId self, uint64_t n) {
+        return id == NIL || (id > self && id < n);
+      };
+
+      for (uint64_t i = 0; i < names; ++i) {
+        const ImageName &n = section<ImageName>(imageSection::NAMES)[i];
+        if ((uint64_t)n.offset + n.length > count(imageSection::STRINGS))
+          return false;
+      }
+      for (uint64_t i = 0; i < count(imageSection::TOKENS); ++i) {
+        const ImageToken &t = section<ImageToken>(imageSection::TOKENS)[i];
+        if (t.begin > t.end || t.end > header->sourceSize || t.type > tokenType::STR_CONST)
+          return false;
+      }
+      if (count(imageSection::SYMBOLS) != nVars || !in(header->root, count(imageSection::CLASSES))
+          || header->root == NIL)
+        return false;
+      for (uint64_t i = 0; i < nVars; ++i) {
+        const Symbol &s = section<Symbol>(imageSection::SYMBOLS)[i];
+        if (s.kind > kind::ARG || s.seg > segment::TEMP || !name(s.type))
+          return false;
+      }
+      for (uint64_t i = 0; i < count(imageSection::CLASSES); ++i) {
+        const ClassNode &c = section<ClassNode>(imageSection::CLASSES)[i];
+        if (!name(c.name) || !in(c.vars, nVars) || !in(c.subroutines, nSubroutines))
+          return false;
+      }
+      for (NodeId i = 0; i < nVars; ++i) {
+        const VarNode &v = section<VarNode>(imageSection::VARS)[i];
+        if (!name(v.name) || !name(v.type) || v.kind > kind::ARG || !after(v.next, i, nVars))
+          return false;
+      }
+      for (NodeId i = 0; i < nSubroutines; ++i) {
+        const SubroutineNode &s = section<SubroutineNode>(imageSection::SUBROUTINES)[i];
+        if (!name(s.name) || !name(s.returnType)
+            || (s.kind != keyWord::CONSTRUCTOR && s.kind != keyWord::FUNCTION
+                && s.kind != keyWord::METHOD)
+            || !in(s.params, nVars) || !in(s.locals, nVars) || !in(s.body, nStatements)
+            || !after(s.next, i, nSubroutines))
+          return false;
+      }
+      for (NodeId i = 0; i < nStatements; ++i) {
+        const StatementNode &s = section<StatementNode>(imageSection::STATEMENTS)[i];
+        if (s.type > statementType::RETURN || !name(s.name) || !in(s.index, nExpressions)
+            || !in(s.value, nExpressions) || !before(s.body, i) || !before(s.orElse, i)
+            || !after(s.next, i, nStatements))
+          return false;
+      }
+      for (NodeId i = 0; i < nExpressions; ++i) {
+        const ExpressionNode &e = section<ExpressionNode>(imageSection::EXPRESSIONS)[i];
+        if (e.type > termType::BINARY || !name(e.name) || !name(e.qualifier)
+            || !before(e.left, i) || !before(e.right, i) || !after(e.next, i, nExpressions))
+          return false;
+        if ((e.type == termType::BINARY && !binaryOp(e.op))
+            || (e.type == termType::UNARY && e.op != '-' && e.op != '~')
+            || (e.type == termType::STR_CONST
+                && (uint64_t)e.value + e.length > count(imageSection::TEXT)))
+          return false;
+      }
+      return true;
+    }
+
+  public:
+    ClassImage() { }
+    ClassImage(const ClassImage &) = delete;
+    ClassImage &operator=(const ClassImage &) = delete;
+
+    ~ClassImage() {
+      close();
+    }
+
+    // Where the image of the source with sourceHash lives in directory
+    static std::string path(const std::string &directory, uint64_t sourceHash) {
+      char name[32];
+      snprintf(name, sizeof name, "%016llx.jsi", (unsigned long long)sourceHash);
+      return directory + "/" + name;
+    }
+
+    // Maps the image of source from directory, false unless it is intact
+    bool open(const std::string &directory, std::string_view source) {
+      close();
+      uint64_t sourceHash = hashWords(source);
+      int fd = ::open(path(directory, sourceHash).c_str(), O_RDONLY);
+      if (fd < 0)
+        return false;
+      struct stat st;
+      if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ImageHeader)) {
+        void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+          data = (const char *)p;
+          size = st.st_size;
+        }
+      }
+      ::close(fd);
+      if (!data)
+        return false;
+
+      header = (const ImageHeader *)data;
+      uint32_t sizes[8];
+      layout(sizes);
+      bool intact = header->magic == MAGIC && header->version == VERSION
+                    && header->size == size && header->sourceSize == source.size()
+                    && header->sourceHash == sourceHash
+                    && memcmp(header->layout, sizes, sizeof sizes) == 0;
+      for (int s = 0; intact && s < (int)imageSection::COUNT; ++s) {
+        const ImageSection &section = header->sections[s];
+        intact = section.offset % 8 == 0 && section.offset <= size
+                 && section.count <= (size - section.offset) / recordSize((imageSection)s);
+      }
+      intact = intact && header->checksum == hashWords(std::string_view(data + sizeof(ImageHeader),
+                                                                          size - sizeof(ImageHeader)))
+               && validate();
+      if (!intact)
+        close();
+      return intact;
+    }
+
+    template <class T>
+    const T *section(imageSection s) const {
+      return (const T *)(data + header->sections[(int)s].offset);
+    }
+
+    uint64_t count(imageSection s) const {
+      return header->sections[(int)s].count;
+    }
+
+    NodeId root() const {
+      return header->root;
+    }
+
+    std::string_view name(uint32_t index) const {
+      if (index == Interner::NONE)
+        return std::string_view();
+      const ImageName &n = section<ImageName>(imageSection::NAMES)[index];
+      return std::string_view(section<char>(imageSection::STRINGS) + n.offset, n.length);
+    }
+
+    // The interned id of every name, for copying nodes into an Ast
+    std::vector<uint32_t> internNames() const {
+      std::vector<uint32_t> ids(count(imageSection::NAMES));
+      for (uint32_t i = 0; i < ids.size(); ++i)
+        ids[i] = intern(name(i));
+      return ids;
+    }
+
+    // For the code generator, which wants interned names: the nodes are
+    // copied into ast with their names mapped
+    void load(Ast &ast) const {
+      std::vector<uint32_t> ids = internNames();
+      auto id = [&](uint32_t index) {
+        return index == Interner::NONE ? Interner::NONE : ids[index];
+      };
+      for (uint64_t i = 0; i < count(imageSection::CLASSES); ++i) {
+        ClassNode node = section<ClassNode>(imageSection::CLASSES)[i];
+        node.name = id(node.name);
+        ast.classes.add(node);
+      }
+      for (uint64_t i = 0; i < count(imageSection::VARS); ++i) {
+        VarNode node = section<VarNode>(imageSection::VARS)[i];
+        node.name = id(node.name);
+        node.type = id(node.type);
+        ast.vars.add(node);
+      }
+      for (uint64_t i = 0; i < count(imageSection::SUBROUTINES); ++i) {
+        SubroutineNode node = section<SubroutineNode>(imageSection::SUBROUTINES)[i];
+        node.name = id(node.name);
+        node.returnType = id(node.returnType);
+        ast.subroutines.add(node);
+      }
+      for (uint64_t i = 0; i < count(imageSection::STATEMENTS); ++i) {
+        StatementNode node = section<StatementNode>(imageSection::STATEMENTS)[i];
+        node.name = id(node.name);
+        ast.statements.add(node);
+      }
+      for (uint64_t i = 0; i < count(imageSection::EXPRESSIONS); ++i) {
+        ExpressionNode node = section<ExpressionNode>(imageSection::EXPRESSIONS)[i];
+        node.name = id(node.name);
+        node.qualifier = id(node.qualifier);
+        ast.expressions.add(node);
+      }
+      const char *text = section<char>(imageSection::TEXT);
+      ast.text.assign(text, text + count(imageSection::TEXT));
+      ast.root = root();
+    }
+
+    // Writes the image of source, which parsed into ast, to directory. It
+    // is written aside and renamed, so a reader never maps half a file.
+    static void write(const std::string &directory, std::string_view source, const Ast &ast) {
+      std::unordered_map<uint32_t, uint32_t> indices;
+      std::vector<ImageName> names;
+      std::string strings;
+      auto indexOf = [&](uint32_t id) -> uint32_t {
+        if (id == Interner::NONE)
+          return Interner::NONE;
+        auto it = indices.find(id);
+        if (it != indices.end())
+          return it->second;
+        std::string_view text = nameOf(id);
+        names.push_back({(uint32_t)strings.size(), (uint32_t)text.size()});
+        strings += text;
+        return indices[id] = names.size() - 1;
+      };
+
+      std::vector<ImageToken> tokens;
+      {
+        Arena arena;
+        JackTokenizer tokenizer;
+        tokenizer.initSource(source, arena);
+        while (tokenizer.hasMoreTokens()) {
+          tokenizer.advance();
+          tokens.push_back({(uint32_t)tokenizer.tokenBegin(), (uint32_t)tokenizer.tokenEnd(),
+                            (uint32_t)tokenizer.curLine(), tokenizer.tokenType()});
+        }
+      }
+
+      std::vector<ClassNode> classes;
+      for (NodeId i = 0; i < ast.classes.size(); ++i) {
+        classes.push_back(ast.classes[i]);
+        classes.back().name = indexOf(classes.back().name);
+      }
+      std::vector<VarNode> vars;
+      for (NodeId i = 0; i < ast.vars.size(); ++i) {
+        vars.push_back(ast.vars[i]);
+        vars.back().name = indexOf(vars.back().name);
+        vars.back().type = indexOf(vars.back().type);
+      }
+      std::vector<SubroutineNode> subroutines;
+      for (NodeId i = 0; i < ast.subroutines.size(); ++i) {
+        subroutines.push_back(ast.subroutines[i]);
+        subroutines.back().name = indexOf(subroutines.back().name);
+        subroutines.back().returnType = indexOf(subroutines.back().returnType);
+      }
+      std::vector<StatementNode> statements;
+      for (NodeId i = 0; i < ast.statements.size(); ++i) {
+        statements.push_back(ast.statements[i]);
+        statements.back().name = indexOf(statements.back().name);
+      }
+      std::vector<ExpressionNode> expressions;
+      for (NodeId i = 0; i < ast.expressions.size(); ++i) {
+        expressions.push_back(ast.expressions[i]);
+        expressions.back().name = indexOf(expressions.back().name);
+        expressions.back().qualifier = indexOf(expressions.back().qualifier);
+      }
+
+      // Segments and indices as the SymbolTable gives them
+      std::vector<Symbol> symbols(vars.size());
+      Arena arena;
+      SymbolTable scopes(arena);
+      auto define = [&](NodeId var) {
+        for (; var != NIL; var = ast.vars[var].next) {
+          scopes.define(ast.vars[var].name, ast.vars[var].type, ast.vars[var].kind);
+          symbols[var] = *scopes.resolve(ast.vars[var].name);
+          symbols[var].type = indexOf(symbols[var].type);
+        }
+      };
+      const ClassNode &node = ast.classes[ast.root];
+      define(node.vars);
+      for (NodeId sub = node.subroutines; sub != NIL; sub = ast.subroutines[sub].next) {
+        scopes.startSubroutine();
+        if (ast.subroutines[sub].kind == keyWord::METHOD)
+          scopes.define(intern("this"), node.name, kind::ARG);
+        define(ast.subroutines[sub].params);
+        define(ast.subroutines[sub].locals);
+      }
+
+      ImageHeader header;
+      memset(&header, 0, sizeof header);
+      header.magic = MAGIC;
+      header.version = VERSION;
+      header.sourceHash = hashWords(source);
+      header.sourceSize = source.size();
+      layout(header.layout);
+      header.root = ast.root;
+      std::string file(sizeof header, '\0');
+      auto append = [&](imageSection s, const void *items, uint64_t n, size_t itemSize) {
+        file.append((8 - file.size() % 8) % 8, '\0');
+        header.sections[(int)s] = {file.size(), n};
+        file.append((const char *)items, n * itemSize);
+      };
+      append(imageSection::TOKENS, tokens.data(), tokens.size(), sizeof(ImageToken));
+      append(imageSection::NAMES, names.data(), names.size(), sizeof(ImageName));
+      append(imageSection::STRINGS, strings.data(), strings.size(), 1);
+      append(imageSection::TEXT, ast.text.data(), ast.text.size(), 1);
+      append(imageSection::SYMBOLS, symbols.data(), symbols.size(), sizeof(Symbol));
+      append(imageSection::CLASSES, classes.data(), classes.size(), sizeof(ClassNode));
+      append(imageSection::VARS, vars.data(), vars.size(), sizeof(VarNode));
+      append(imageSection::SUBROUTINES, subroutines.data(), subroutines.size(),
+             sizeof(SubroutineNode));
+      append(imageSection::STATEMENTS, statements.data(), statements.size(),
+             sizeof(StatementNode));
+      append(imageSection::EXPRESSIONS, expressions.data(), expressions.size(),
+             sizeof(ExpressionNode));
+      header.size = file.size();
+      header.checksum = hashWords(std::string_view(file).substr(sizeof header));
+      memcpy(&file[0], &header, sizeof header);
+
+      std::string target = path(directory, header.sourceHash);
+      std::string temporary = target + ".tmp";
+      {
+        std::ofstream out(temporary, std::ios::binary);
+        if (!out)
+          throw std::runtime_error(std::string("Failed to open file: ") + temporary);
+        out.write(file.data(), file.size());
+      }
+      rename(temporary.c_str(), target.c_str());
+    }
+};
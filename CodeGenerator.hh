@@ -0,0 +1,436 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Arena.hh"
+#include "Ast.hh"
+#include "CompileError.hh"
+#include "ProgramIndex.hh"
+#include "SymbolTable.hh"
+#include "VMWriter.hh"
+
+// What a frame of the generator's work stack walks
+enum class walk {
+  STATEMENTS    // the statements from id on
+  , STATEMENT
+  , EXPRESSION
+};
+
+/*
+  Walks the Ast of a class and emits its VM code. Names are resolved here,
+  against the SymbolTable, and calls are checked against the ProgramIndex.
+*/
+class CodeGenerator {
+  private:
+    const Ast &ast;
+    SymbolTable &symbols;
+    VMWriter &vmWriter;
+    Arena &arena;
+    const ProgramIndex *programIndex;
+    std::string_view className;
+    const uint32_t thisId = intern("this");
+
+    uint64_t ifCount = 0;
+    uint64_t whileCount = 0;
+
+    /*
+      Like the parse, the walk goes on a work stack on the heap rather than
+      by recursion, so nesting of any depth is generated. A frame is a node
+      whose code is being emitted, state is how far it got before it pushed
+      the frame of a child.
+    */
+    struct Frame {
+      enum::walk walk;
+      int state = 0;
+      NodeId id;
+      NodeId next = NIL;                // CALL: the next argument
+      uint64_t count = 0;               // IF|WHILE: the number of its labels
+      const Symbol *symbol = nullptr;   // LET|INDEX: the variable
+      std::string_view name;            // CALL: Class.subroutine
+      bool isMethod = false;            // CALL: an object was pushed
+    };
+    std::vector<Frame> work;
+
+    // Pushing may move the frame that pushes, so it is the last thing it does
+    void push(enum::walk w, NodeId id) {
+      work.emplace_back();
+      work.back().walk = w;
+      work.back().id = id;
+    }
+
+    void semanticError(const Span &span, std::string_view message) {
+      std::string report = "Semantic Error at " + std::to_string(span.line) + ": "
+                           + std::string(message);
+      if (recover)
+        throw CompileError(std::string(message), span.line, span.begin, span.end, report);
+      std::cerr << report << std::endl;
+      exit(1);
+    }
+
+    const Symbol *lookup(uint32_t name) {
+      ++lookups;
+      return symbols.resolve(name);
+    }
+
+    const Symbol &resolve(const Span &span, uint32_t name) {
+      const Symbol *symbol = lookup(name);
+      if (!symbol)
+        semanticError(span, arena.join("Declared the variable before using it : ",
+                                       nameOf(name)));
+      return *symbol;
+    }
+
+    /*
+      Calls into classes of the program are checked against the ProgramIndex,
+      isMethod tells whether an object was pushed. Calls into anything else,
+      e.g. the OS, are trusted.
+    */
+    void checkCall(const Span &span, std::string_view name, bool isMethod, uint64_t nArgs) {
+      const Signature *signature = programIndex ? programIndex->find(intern(name)) : nullptr;
+      if (!signature)
+        return;
+      if (signature->kind == keyWord::METHOD && !isMethod)
+        semanticError(span, arena.join("method ", name, " called without an object"));
+      if (signature->kind != keyWord::METHOD && isMethod)
+        semanticError(span, arena.join("function ", name, " called on an object"));
+      uint64_t expected = signature->nArgs + (isMethod ? 1 : 0);
+      if (nArgs != expected)
+        semanticError(span, std::string(name) + " expects " + std::to_string(signature->nArgs)
+                      + " arguments, found " + std::to_string(nArgs - (isMethod ? 1 : 0)));
+    }
+
+    // The object is pushed for calls without a class name, unless the
+    // ProgramIndex knows the subroutine is not a method
+    bool isOwnMethod(std::string_view name) {
+      const Signature *signature = programIndex ? programIndex->find(intern(name)) : nullptr;
+      return !signature || signature->kind == keyWord::METHOD;
+    }
+
+    void defineVars(NodeId id) {
+      for (; id != NIL; id = ast.vars[id].next) {
+        const VarNode &var = ast.vars[id];
+        symbols.define(var.name, var.type, var.kind);
+      }
+    }
+
+  public:
+    bool recover = false;       // throw CompileError rather than exit
+    uint64_t lookups = 0;       // of names in the SymbolTable
+
+    CodeGenerator(const Ast &ast, SymbolTable &symbols, VMWriter &vmWriter, Arena &arena,
+                  const ProgramIndex *programIndex)
+      : ast(ast), symbols(symbols), vmWriter(vmWriter), arena(arena),
+        programIndex(programIndex) { }
+
+    void generateClass(NodeId id) {
+      ALLOCATION_SCOPE(GENERATOR);
+      startClass(id);
+      for (NodeId sub = ast.classes[id].subroutines; sub != NIL; sub = ast.subroutines[sub].next)
+        generateSubroutine(sub);
+      symbols.reset();
+    }
+
+    // Defines the class variables, any subroutine of the class may follow
+    void startClass(NodeId id) {
+      startClass(ast, id);
+    }
+
+    // The same, from the class in another Ast
+    void startClass(const Ast &classAst, NodeId id) {
+      ALLOCATION_SCOPE(GENERATOR);
+      const ClassNode &node = classAst.classes[id];
+      className = nameOf(node.name);
+      for (NodeId var = node.vars; var != NIL; var = classAst.vars[var].next)
+        symbols.define(classAst.vars[var].name, classAst.vars[var].type,
+                       classAst.vars[var].kind);
+    }
+
+    // Depends on nothing but the class variables, so subroutines can be
+    // generated in any order by any number of generators
+    void generateSubroutine(NodeId id) {
+      ALLOCATION_SCOPE(GENERATOR);
+      const SubroutineNode &node = ast.subroutines[id];
+      symbols.startSubroutine();
+      ifCount = 0;
+      whileCount = 0;
+      if (node.kind == keyWord::METHOD)
+        symbols.define(thisId, intern(className), kind::ARG);
+      defineVars(node.params);
+      defineVars(node.locals);
+      vmWriter.writeFunction(node.name, symbols.varCount(kind::VAR));
+      switch (node.kind) {
+        case keyWord::CONSTRUCTOR:
+          vmWriter.writePush(segment::CONSTANT, symbols.varCount(kind::FIELD));
+          vmWriter.writeCall("Memory.alloc", 1);
+          vmWriter.writePop(segment::POINTER, 0) ;
+          break;
+        case keyWord::METHOD:
+          vmWriter.writePush(segment::ARGUMENT, 0);
+          vmWriter.writePop(segment::POINTER, 0) ;
+          break;
+        default:
+          break;
+      }
+      generateStatements(node.body);
+    }
+
+    // The statements from id on, chained through next
+    void generateStatements(NodeId id) {
+      work.clear();
+      push(walk::STATEMENTS, id);
+      while (!work.empty()) {
+        Frame &frame = work.back();
+        switch (frame.walk) {
+          case walk::STATEMENTS: generateStatements(frame); break;
+          case walk::STATEMENT: generateStatement(frame); break;
+          case walk::EXPRESSION: generateExpression(frame); break;
+        }
+      }
+    }
+
+    void generateStatements(Frame &frame) {
+      if (frame.id == NIL) {
+        work.pop_back();
+        return;
+      }
+      NodeId id = frame.id;
+      frame.id = ast.statements[id].next;
+      push(walk::STATEMENT, id);
+    }
+
+    void generateStatement(Frame &frame) {
+      const StatementNode &node = ast.statements[frame.id];
+      switch (node.type) {
+        case statementType::LET:
+          switch (frame.state) {
+            case 0:
+              frame.symbol = &resolve(node.span, node.name);
+              frame.state = 1;
+              generateExpression(node.index != NIL ? node.index : node.value);
+              return;
+            case 1:
+              if (node.index != NIL) {
+                vmWriter.writePush(frame.symbol->seg, frame.symbol->index);
+                vmWriter.writeArithmetic(command::ADD);
+                frame.state = 2;
+                generateExpression(node.value);
+                return;
+              }
+              vmWriter.writePop(frame.symbol->seg, frame.symbol->index);
+              break;
+            case 2:
+              vmWriter.writePop(segment::TEMP, 0);
+              vmWriter.writePop(segment::POINTER, 1);
+              vmWriter.writePush(segment::TEMP, 0);
+              vmWriter.writePop(segment::THAT, 0);
+              break;
+          }
+          break;
+        case statementType::IF:
+          switch (frame.state) {
+            case 0:
+              frame.count = ifCount++;
+              frame.state = 1;
+              generateExpression(node.value);
+              return;
+            case 1:
+              vmWriter.writeIf(arena.label("IF_TRUE", frame.count));
+              vmWriter.writeGoto(arena.label("IF_FALSE", frame.count));
+              vmWriter.writeLabel(arena.label("IF_TRUE", frame.count));
+              frame.state = 2;
+              push(walk::STATEMENTS, node.body);
+              return;
+            case 2:
+              if (node.hasElse) {
+                vmWriter.writeGoto(arena.label("IF_END", frame.count));
+                vmWriter.writeLabel(arena.label("IF_FALSE", frame.count));
+                frame.state = 3;
+                push(walk::STATEMENTS, node.orElse);
+                return;
+              }
+              vmWriter.writeLabel(arena.label("IF_FALSE", frame.count));
+              break;
+            case 3:
+              vmWriter.writeLabel(arena.label("IF_END", frame.count));
+              break;
+          }
+          break;
+        case statementType::WHILE:
+          switch (frame.state) {
+            case 0:
+              frame.count = whileCount++;
+              vmWriter.writeLabel(arena.label("WHILE_EXP", frame.count));
+              frame.state = 1;
+              generateExpression(node.value);
+              return;
+            case 1:
+              vmWriter.writeArithmetic(command::NOT);
+              vmWriter.writeIf(arena.label("WHILE_END", frame.count));
+              frame.state = 2;
+              push(walk::STATEMENTS, node.body);
+              return;
+            case 2:
+              vmWriter.writeGoto(arena.label("WHILE_EXP", frame.count));
+              vmWriter.writeLabel(arena.label("WHILE_END", frame.count));
+              break;
+          }
+          break;
+        case statementType::DO:
+          if (frame.state == 0) {
+            frame.state = 1;
+            generateExpression(node.value);
+            return;
+          }
+          vmWriter.writePop(segment::TEMP, 0);
+          break;
+        case statementType::RETURN:
+          if (frame.state == 0) {
+            if (node.value != NIL) {
+              frame.state = 1;
+              generateExpression(node.value);
+              return;
+            }
+            vmWriter.writePush(segment::CONSTANT, 0);
+          }
+          vmWriter.writeReturn();
+          break;
+      }
+      work.pop_back();
+    }
+
+    // Pushes the object of a method, the arguments are generated after it
+    void startCall(Frame &frame, const ExpressionNode &node) {
+      if (node.qualifier == Interner::NONE) {
+        // A subroutine of this class
+        frame.name = arena.join(className, ".", nameOf(node.name));
+        frame.isMethod = isOwnMethod(frame.name);
+        if (frame.isMethod)
+          vmWriter.writePush(segment::POINTER, 0);
+      }
+      else if (const Symbol *symbol = lookup(node.qualifier)) {
+        // The object is the first argument
+        frame.name = arena.join(symbols.typeName(*symbol), ".", nameOf(node.name));
+        frame.isMethod = true;
+        vmWriter.writePush(symbol->seg, symbol->index);
+      }
+      else {
+        frame.name = arena.join(nameOf(node.qualifier), ".", nameOf(node.name));
+        frame.isMethod = false;
+      }
+    }
+
+    // Terms without subexpressions are generated at once, the rest get a frame
+    void generateExpression(NodeId id) {
+      const ExpressionNode &node = ast.expressions[id];
+      switch (node.type) {
+        case termType::INT_CONST:
+          vmWriter.writePush(segment::CONSTANT, node.value);
+          break;
+        case termType::STR_CONST: {
+          std::string_view text = ast.string(node);
+          vmWriter.writePush(segment::CONSTANT, text.length());
+          vmWriter.writeCall("String.new", 1);
+          for (char c: text) {
+            vmWriter.writePush(segment::CONSTANT, (int)c);
+            vmWriter.writeCall("String.appendChar", 2);
+          }
+          break;
+        }
+        case termType::KEYWORD:
+          switch (node.keyWord) {
+            case keyWord::TRUE:
+              vmWriter.writePush(segment::CONSTANT, 0);
+              vmWriter.writeArithmetic(command::NOT);
+              break;
+            case keyWord::THIS:
+              vmWriter.writePush(segment::POINTER, 0);
+              break;
+            default:
+              vmWriter.writePush(segment::CONSTANT, 0);
+          }
+          break;
+        case termType::VAR: {
+          const Symbol &symbol = resolve(node.span, node.name);
+          vmWriter.writePush(symbol.seg, symbol.index);
+          break;
+        }
+        default:
+          push(walk::EXPRESSION, id);
+      }
+    }
+
+    void generateExpression(Frame &frame) {
+      const ExpressionNode &node = ast.expressions[frame.id];
+      switch (node.type) {
+        case termType::INDEX:
+          if (frame.state == 0) {
+            frame.symbol = &resolve(node.span, node.name);
+            frame.state = 1;
+            generateExpression(node.left);
+            return;
+          }
+          vmWriter.writePush(frame.symbol->seg, frame.symbol->index);
+          vmWriter.writeArithmetic(command::ADD);
+          vmWriter.writePop(segment::POINTER, 1);
+          vmWriter.writePush(segment::THAT, 0);
+          break;
+        case termType::CALL: {
+          if (frame.state == 0) {
+            startCall(frame, node);
+            frame.next = node.left;
+            frame.state = 1;
+          }
+          if (frame.next != NIL) {
+            NodeId arg = frame.next;
+            frame.next = ast.expressions[arg].next;
+            generateExpression(arg);
+            return;
+          }
+          uint64_t nArgs = node.length + (frame.isMethod ? 1 : 0);
+          checkCall(node.span, frame.name, frame.isMethod, nArgs);
+          vmWriter.writeCall(frame.name, nArgs);
+          break;
+        }
+        case termType::GROUP:
+          if (frame.state == 0) {
+            frame.state = 1;
+            generateExpression(node.left);
+            return;
+          }
+          break;
+        case termType::UNARY:
+          if (frame.state == 0) {
+            frame.state = 1;
+            generateExpression(node.left);
+            return;
+          }
+          vmWriter.writeArithmetic(node.op == '~' ? command::NOT : command::NEG);
+          break;
+        case termType::BINARY:
+          switch (frame.state) {
+            case 0:
+              frame.state = 1;
+              generateExpression(node.left);
+              return;
+            case 1:
+              frame.state = 2;
+              generateExpression(node.right);
+              return;
+            case 2: {
+              const BinaryOp *op = binaryOp(node.op);
+              if (op->emit == vmOp::CALL)
+                vmWriter.writeCall(op->call, 2);
+              else
+                vmWriter.writeArithmetic(op->cmd);
+              break;
+            }
+          }
+          break;
+        default:    // the terms generated at once
+          break;
+      }
+      work.pop_back();
+    }
+};
@@ -1,57 +1,452 @@
+#pragma once
+
 #include <iostream>
 #include <fstream>
+#include <atomic>
+#include <functional>
+#include <memory>
 #include <stdexcept>
 #include <stdint.h>
+#include <thread>
+#include <vector>
 
+#include "Arena.hh"
+#include "Ast.hh"
+#include "ClassImage.hh"
+#include "CodeGenerator.hh"
 #include "JackTokenizer.hh"
+#include "Prescan.hh"
+#include "SubroutineCache.hh"
+#include "TimeReport.hh"
+#include "TreeWriter.hh"
 #include "VMWriter.hh"
 #include "SymbolTable.hh"
+#include "ProgramIndex.hh"
+
+// What a frame of the engine's work stack is parsing
+enum class construct {
+  STATEMENTS
+  , LET
+  , IF
+  , WHILE
+  , DO
+  , RETURN
+  , EXPRESSION  // the operators after its first term
+  , OPERATORS   // operators of minPrecedence and up, folded into left
+  , TERM        // waiting for what nests in it
+  , CALL        // the rest of a call, after its first identifier
+};
 
+/*
+  The compile functions parse the class into an Ast, the CodeGenerator then
+  walks it to emit the VM code. Anything else that needs the parse, e.g. an
+  alternate output, can walk the same tree.
+*/
 class CompilationEngine {
-  private: 
+  private:
+    // Declared first so it is released last, with everything taken from it
+    Arena arena;
+
     std::string fileName;
-    std::string currentToken;
+    uint32_t classId;
+    std::string_view currentToken;
+    uint32_t currentId = Interner::NONE;   // interned keyword or identifier
+    uint64_t lastEnd = 0;                  // end offset of the last token eaten
 
-    SymbolTable subTable, classTable;
+    Ast ast{arena};
+    SymbolTable symbols{arena};
     JackTokenizer tokenizer;
     VMWriter vmWriter;
+    const ProgramIndex *programIndex;
+    std::vector<TreeWriter *> trees;      // parse trees written while parsing
+    bool recover = false;                 // throw CompileError rather than exit
+    TimeReport *timeReport = nullptr;     // phases are timed into timings if set
+    Timings *timings = nullptr;
+
+    /*
+      Statements and expressions nest without limit, so they are parsed on
+      a work stack on the heap rather than by recursion, and the depth of
+      nesting is bounded by memory only. A frame is a construct being
+      parsed, state is where it carries on once what nests in it has left
+      its node in result. The nodes and the parse trees come out just as a
+      recursive descent makes them.
+    */
+    struct Frame {
+      enum::construct construct;
+      int state = 0;
+      StatementNode statement;    // being parsed
+      ExpressionNode expression;
+      NodeId first = NIL;         // STATEMENTS: of the list
+      NodeId last = NIL;          // STATEMENTS, CALL: of the list so far
+      NodeId left = NIL;          // EXPRESSION, OPERATORS: the operand they fold into
+      int level = 0;              // EXPRESSION, OPERATORS: of the operator being folded
+      int minPrecedence = 0;
+    };
+    std::vector<Frame> work;
+    NodeId result = NIL;          // of the last frame done
 
-    uint64_t ifCount = 0;
-    uint64_t whileCount = 0;
-    keyWord funcType;
-    std::string funcName;
+    // A push is the last thing a step does, it may move the frame that pushed
+    void push(enum::construct c) {
+      work.emplace_back();
+      work.back().construct = c;
+    }
+
+    // An expression waiting for its first term
+    void pushExpression() {
+      open("expression");
+      push(construct::EXPRESSION);
+      work.back().minPrecedence = 1;
+    }
+
+    // A term that carries on at state once what nests in it is done
+    void pushTerm(const ExpressionNode &node, int state) {
+      push(construct::TERM);
+      work.back().state = state;
+      work.back().expression = node;
+    }
 
-    void printError(std::string token) {
-      std::cerr << "Syntax Error at " << tokenizer.curLine() 
-                << ", found token: '" << currentToken 
-                << "', looking for: '" << token << "'" << std::endl;
+    void pushCall(Span span, uint32_t identifier) {
+      push(construct::CALL);
+      work.back().expression.span = span;
+      work.back().expression.name = identifier;
+    }
+
+    void pushOperators(NodeId left, int minPrecedence) {
+      push(construct::OPERATORS);
+      work.back().left = left;
+      work.back().minPrecedence = minPrecedence;
+    }
+
+    void done(NodeId id) {
+      result = id;
+      work.pop_back();
+    }
+
+    void open(const char *tag) {
+      for (TreeWriter *tree: trees)
+        tree->open(tag);
+    }
+
+    void close(const char *tag) {
+      for (TreeWriter *tree: trees)
+        tree->close(tag);
+    }
+
+    void printError(std::string_view token) {
+      std::string message = std::string("found token: '") + std::string(currentToken)
+                            + "', looking for: '" + std::string(token) + "'";
+      std::string report = "Syntax Error at " + std::to_string(tokenizer.curLine()) + ", "
+                           + message;
+      if (recover) {
+        // Past the last token the error is at the end of the last one eaten
+        bool end = currentToken.empty();
+        throw CompileError(message, tokenizer.curLine(),
+                           end ? lastEnd : tokenizer.tokenBegin(),
+                           end ? lastEnd : tokenizer.tokenEnd(), report);
+      }
+      std::cerr << report << std::endl;
+      exit(1);
+    }
+
+    // An error a worker caught, thrown again or reported as printError() does
+    void reportError(const CompileError &error) {
+      if (recover)
+        throw error;
+      std::cerr << error.report << std::endl;
       exit(1);
     }
 
-    bool isOp() {
-      return currentToken == "+" || currentToken == "-"
-              || currentToken == "*" || currentToken == "/"
-              || currentToken == "&" || currentToken == "|"
-              || currentToken == "<" || currentToken == ">"
-              || currentToken == "=";
+    // Of the current token as a binary operator, 0 if it is none
+    int precedence() {
+      if (tokenizer.tokenType() != tokenType::SYMBOL)
+        return 0;
+      const BinaryOp *op = binaryOp(tokenizer.symbol());
+      return op ? op->precedence : 0;
+    }
+
+    double clock() const {
+      return timeReport ? timeReport->now() : 0;
+    }
+
+    void record(enum::phase p, double begin) {
+      if (timeReport)
+        timeReport->record(*timings, p, fileName, begin);
     }
 
+    // Past the last token currentToken is empty, the one passed goes into
+    // the parse trees
     void advance() {
+      if (!currentToken.empty())
+        for (TreeWriter *tree: trees)
+          tree->token(tokenizer.tokenType(), currentToken);
+      lastEnd = tokenizer.tokenEnd();
       if (tokenizer.hasMoreTokens()) {
         currentToken = tokenizer.advance();
+        currentId = tokenizer.tokenId();
+      }
+      else {
+        currentToken = std::string_view();
+        currentId = Interner::NONE;
       }
     }
 
-    void eat(std::string token) {
+    void eat(std::string_view token) {
       if (token != currentToken) {
         printError(token);
       }
       advance();
     }
-     
+
+    // A span starting at the current token, finish() closes it
+    Span start() {
+      Span span;
+      span.begin = tokenizer.tokenBegin();
+      span.line = tokenizer.curLine();
+      return span;
+    }
+
+    Span finish(Span span) {
+      span.end = lastEnd;
+      return span;
+    }
+
+    // Of the tokens in [begin, end), third is set to the id of the third one
+    static uint64_t hashTokens(JackTokenizer &tokenizer, uint64_t begin, uint64_t line,
+                               uint64_t end, uint32_t &third) {
+      tokenizer.seek(begin, line, end);
+      uint64_t hash = hashBytes("");
+      for (int n = 1; tokenizer.hasMoreTokens(); ++n) {
+        std::string_view token = tokenizer.advance();
+        char type = (char)tokenizer.tokenType();
+        hash = hashBytes(std::string_view(&type, 1), hash);
+        hash = hashBytes(token, hash);
+        if (n == 3)
+          third = tokenizer.tokenId();
+      }
+      return hash;
+    }
+
+    /*
+      The prescan splits the source at its subroutines. The class variables
+      are parsed here, then every worker lexes, parses and generates whole
+      subroutines, taken in turn, into a buffer per subroutine. A worker
+      parses from its subroutine up to the next one, so nothing between two
+      subroutines goes unchecked. Joined in source order the buffers are
+      exactly the serial output. Workers catch the errors of a subroutine
+      and carry on, and once all are joined the error the serial run would
+      stop at is reported here.
+
+      With a cache, a subroutine whose tokens, class layout and program
+      signatures hash as they did is taken from it rather than parsed.
+
+      false, with nothing parsed, if the prescan cannot split the source.
+    */
+    bool compileRanges(unsigned jobs, SubroutineCache *cache) {
+      std::vector<SourceRange> ranges;
+      std::string_view source = tokenizer.text();
+      if (!prescan(source, ranges) || ranges.empty())
+        return false;
+
+      SubroutineKey layout = {0, 0, 0};
+      if (cache) {
+        JackTokenizer scanner;
+        scanner.initSource(source, arena);
+        uint32_t third;
+        layout.layout = hashTokens(scanner, 0, 1, ranges.front().begin, third);
+        layout.signatures = cache->signatureHash();
+      }
+
+      double begin = clock();
+      tokenizer.seek(tokenizer.tokenEnd(), tokenizer.curLine(), ranges.front().begin);
+      compileClassHeader();
+      if (!currentToken.empty())
+        printError("constructor|function|method");
+      record(phase::PARSE, begin);
+
+      std::vector<VMCode> parts(ranges.size());
+      std::vector<SubroutineKey> keys(ranges.size(), layout);
+      std::vector<uint32_t> names(ranges.size(), Interner::NONE);
+      std::vector<const char *> reasons(ranges.size(), "new");
+      std::vector<std::vector<std::string> > treeParts(trees.size(),
+                                                       std::vector<std::string>(ranges.size()));
+      // The errors of each subroutine, in its parse or in its code
+      std::vector<std::unique_ptr<CompileError> > syntaxErrors(ranges.size());
+      std::vector<std::unique_ptr<CompileError> > semanticErrors(ranges.size());
+      std::atomic<size_t> next{0};
+      std::mutex timingsMutex;
+      auto worker = [&]() {
+        double workerBegin = clock();
+        Timings workerTimings;
+        CompilationEngine engine(source, fileName, programIndex);
+        engine.recoverErrors();
+        std::vector<TreeWriter> branches;
+        for (TreeWriter *tree: trees)
+          branches.push_back(tree->branch());
+        for (TreeWriter &branch: branches)
+          engine.trees.push_back(&branch);
+        VMWriter writer;
+        CodeGenerator generator(engine.ast, engine.symbols, writer, engine.arena,
+                                programIndex);
+        generator.recover = true;
+        generator.startClass(ast, ast.root);
+        for (size_t i; (i = next++) < ranges.size(); ) {
+          uint64_t end = i + 1 < ranges.size() ? ranges[i + 1].begin : ranges[i].end;
+          bool parsed = false;
+          try {
+            if (cache) {
+              uint32_t third = Interner::NONE;
+              keys[i].body = hashTokens(engine.tokenizer, ranges[i].begin, ranges[i].line,
+                                        end, third);
+              if (third != Interner::NONE) {
+                names[i] = intern(engine.arena.join(fileName, ".", nameOf(third)));
+                if (!trees.empty())
+                  reasons[i] = "parse tree requested";
+                else if (const VMCode *code = cache->find(names[i], keys[i], reasons[i])) {
+                  parts[i] = *code;
+                  reasons[i] = nullptr;
+                  continue;
+                }
+              }
+            }
+            double parseBegin = clock();
+            NodeId sub = engine.parseSubroutine(ranges[i].begin, ranges[i].line, end);
+            parsed = true;
+            double generated = clock();
+            generator.generateSubroutine(sub);
+            if (timeReport) {
+              workerTimings.seconds[(int)phase::PARSE] += generated - parseBegin;
+              workerTimings.seconds[(int)phase::GENERATE] += clock() - generated;
+            }
+          }
+          catch (const CompileError &e) {
+            (parsed ? semanticErrors : syntaxErrors)[i].reset(new CompileError(e));
+            writer.code().code.clear();
+          }
+          parts[i].swap(writer.code().code);
+          for (size_t t = 0; t < branches.size(); ++t)
+            treeParts[t][i] = branches[t].take();
+        }
+        if (timeReport) {
+          workerTimings.lookups = generator.lookups;
+          timeReport->event("parse and generate", fileName, workerBegin, clock());
+          std::lock_guard<std::mutex> lock(timingsMutex);
+          timings->add(workerTimings);
+        }
+      };
+      std::vector<std::thread> workers;
+      for (size_t j = 1; j < jobs && j < ranges.size(); ++j)
+        workers.emplace_back(worker);
+      worker();
+      for (std::thread &thread: workers)
+        thread.join();
+
+      // As the serial run, which parses the whole class before it generates
+      for (const std::unique_ptr<CompileError> &error: syntaxErrors)
+        if (error)
+          reportError(*error);
+      for (size_t t = 0; t < trees.size(); ++t)
+        for (const std::string &part: treeParts[t])
+          trees[t]->append(part);
+      begin = clock();
+      tokenizer.seek(ranges.back().end, ranges.back().endLine);
+      advance();
+      compileClassEnd();
+      record(phase::PARSE, begin);
+      for (const std::unique_ptr<CompileError> &error: semanticErrors)
+        if (error)
+          reportError(*error);
+
+      if (cache)
+        for (size_t i = 0; i < ranges.size(); ++i)
+          if (names[i] != Interner::NONE)
+            cache->store(names[i], keys[i], parts[i], reasons[i]);
+
+      VMCode &code = vmWriter.code().code;
+      for (VMCode &part: parts)
+        code.insert(code.end(), part.begin(), part.end());
+      if (timings)
+        timings->instructions += code.size();
+      return true;
+    }
+
+    /*
+      Each worker generates whole subroutines, taken in turn, with its own
+      Arena, SymbolTable and labels, into a buffer per subroutine. Joined in
+      source order the buffers are exactly the serial output, and the first
+      error in that order is the one reported.
+    */
+    uint64_t generateParallel(unsigned jobs) {
+      std::vector<NodeId> subroutines;
+      for (NodeId sub = ast.classes[ast.root].subroutines; sub != NIL;
+           sub = ast.subroutines[sub].next)
+        subroutines.push_back(sub);
+      std::vector<VMCode> parts(subroutines.size());
+      std::vector<std::unique_ptr<CompileError> > errors(subroutines.size());
+      std::atomic<size_t> next{0};
+      std::atomic<uint64_t> lookups{0};
+
+      auto worker = [&]() {
+        double begin = clock();
+        Arena workerArena;
+        SymbolTable workerSymbols(workerArena);
+        VMWriter writer;
+        CodeGenerator generator(ast, workerSymbols, writer, workerArena, programIndex);
+        generator.recover = true;
+        generator.startClass(ast.root);
+        for (size_t i; (i = next++) < subroutines.size(); ) {
+          try {
+            generator.generateSubroutine(subroutines[i]);
+          }
+          catch (const CompileError &e) {
+            errors[i].reset(new CompileError(e));
+            writer.code().code.clear();
+          }
+          parts[i].swap(writer.code().code);
+        }
+        lookups += generator.lookups;
+        if (timeReport)
+          timeReport->event("generate", fileName, begin, clock());
+      };
+      std::vector<std::thread> workers;
+      for (size_t j = 1; j < jobs && j < subroutines.size(); ++j)
+        workers.emplace_back(worker);
+      worker();
+      for (std::thread &thread: workers)
+        thread.join();
+
+      // The first in source order, as the serial run reports
+      for (const std::unique_ptr<CompileError> &error: errors)
+        if (error)
+          reportError(*error);
+      VMCode &code = vmWriter.code().code;
+      for (VMCode &part: parts)
+        code.insert(code.end(), part.begin(), part.end());
+      return lookups;
+    }
+
+    // Appends a node for each name of a var list, `type name (, name)* ;`
+    void compileVarNames(NodeId *&tail, uint32_t typeOf, kind kindOf) {
+      do {
+        if (currentToken == ",")
+          advance();
+        if (tokenizer.tokenType() != tokenType::IDENTIFIER)
+          printError("varName");
+        VarNode var;
+        var.name = currentId;
+        var.type = typeOf;
+        var.kind = kindOf;
+        var.span = start();
+        advance();
+        var.span = finish(var.span);
+        *tail = ast.vars.add(var);
+        tail = &ast.vars[*tail].next;
+      } while (currentToken == ",");
+    }
+
   public:
-    CompilationEngine(std::string path) {
-      tokenizer.init(path);
+    CompilationEngine(std::string path, const ProgramIndex *programIndex = nullptr)
+      : programIndex(programIndex) {
+      tokenizer.init(path, arena);
       vmWriter.init(path);
 
       advance();
@@ -60,59 +455,262 @@ class CompilationEngine {
       fileName = path.substr(0, path.find_last_of("."));
 
       // Get the file name only
-      fileName = fileName.substr(fileName.find_last_of("/")+1, fileName.length()); 
+      fileName = fileName.substr(fileName.find_last_of("/")+1, fileName.length());
+      classId = intern(fileName);
+    }
+
+    // Parses a class found in source, for a worker or a tool that parses it
+    // a piece at a time
+    CompilationEngine(std::string_view source, const std::string &fileName,
+                      const ProgramIndex *programIndex)
+      : fileName(fileName), classId(intern(fileName)), programIndex(programIndex) {
+      tokenizer.initSource(source, arena);
     }
 
     ~CompilationEngine() { }
 
-    void compileClass() {
+    // The VM code of the compiled class, not yet written
+    VMClass &code() {
+      return vmWriter.code();
+    }
+
+    // Transient front end memory of this compilation
+    const Arena &memory() const {
+      return arena;
+    }
+
+    // The text of the class
+    std::string_view source() {
+      return tokenizer.text();
+    }
+
+    // The phases of the compilation are timed into timings
+    void timeWith(TimeReport *report, Timings *timings) {
+      timeReport = report;
+      this->timings = timings;
+    }
+
+    // The parse of the class, valid after parse()
+    const Ast &tree() const {
+      return ast;
+    }
+
+    // The parse tree is written to tree as the class is parsed, tree must
+    // outlive the compilation
+    void writeTree(TreeWriter *tree) {
+      trees.push_back(tree);
+    }
+
+    // Errors throw CompileError rather than exit
+    void recoverErrors() {
+      recover = true;
+      tokenizer.recover = true;
+    }
+
+    /*
+      For tools that parse a class a piece at a time, with an engine made
+      from the source and the prescan ranges of its subroutines: the class
+      declarations up to end, where the first subroutine starts.
+    */
+    void parseHeader(uint64_t end) {
+      tokenizer.seek(0, 1, end);
+      advance();
+      compileClassHeader();
+      if (!currentToken.empty())
+        printError("constructor|function|method");
+    }
+
+    // The subroutine starting at begin, on line, with nothing else up to end
+    NodeId parseSubroutine(uint64_t begin, uint64_t line, uint64_t end) {
+      tokenizer.seek(begin, line, end);
+      advance();
+      NodeId sub = compileSubroutine();
+      if (!currentToken.empty())
+        printError("}");
+      return sub;
+    }
+
+    // The whole class, when the prescan cannot split it
+    void parseClass() {
+      tokenizer.seek(0, 1);
+      advance();
+      parse();
+    }
+
+    // Resolves the names and checks the calls of a subroutine parsed by this
+    // engine, in the class whose declarations classAst holds
+    void checkSubroutine(const Ast &classAst, NodeId sub) {
+      CodeGenerator generator(ast, symbols, vmWriter, arena, programIndex);
+      generator.recover = recover;
+      generator.startClass(classAst, classAst.root);
+      generator.generateSubroutine(sub);
+      symbols.reset();
+      vmWriter.code().code.clear();
+    }
+
+    // jobs > 1 compiles the subroutines in parallel and a cache reuses the
+    // code of unchanged ones, both with the same output
+    void compileClass(unsigned jobs = 1, SubroutineCache *cache = nullptr) {
+      if ((jobs > 1 || cache) && compileRanges(jobs, cache))
+        return;
+      double begin = clock();
+      parse();
+      record(phase::PARSE, begin);
+      generate(jobs);
+    }
+
+    /*
+      The same, with the parse taken from the image of the source in
+      directory when there is an intact one of this class. Otherwise the
+      class is parsed and its image written for the next time.
+    */
+    void compileClass(const std::string &directory, unsigned jobs = 1) {
+      double begin = clock();
+      ClassImage image;
+      if (image.open(directory, tokenizer.text()) && image.name(image.root()) == fileName)
+        image.load(ast);
+      else {
+        parse();
+        ClassImage::write(directory, tokenizer.text(), ast);
+      }
+      record(phase::PARSE, begin);
+      generate(jobs);
+    }
+
+    /*
+      --stream: the declarations of the class are parsed and kept, then each
+      subroutine is parsed and generated by an engine of its own, its code
+      handed to emit with the offset where the next one starts, and that
+      engine dropped with all it allocated. The parse and the code are those
+      of compileClass(), but a subroutine is generated before the next one is
+      parsed, so its semantic errors come before the syntax errors of those
+      after it.
+    */
+    void compileStream(const std::function<void(VMCode &, uint64_t)> &emit) {
+      double begin = clock();
+      tokenizer.seek(0, 1);
+      advance();
+      compileClassHeader();
+      record(phase::PARSE, begin);
+
+      begin = clock();
+      VMWriter writer;
+      Timings streamTimings;
+      while (currentToken == "constructor" || currentToken == "function"
+              || currentToken == "method") {
+        double parsed = clock();
+        CompilationEngine engine(tokenizer.text(), fileName, programIndex);
+        engine.recover = recover;
+        engine.tokenizer.recover = recover;
+        engine.trees = trees;
+        engine.tokenizer.seek(tokenizer.tokenBegin(), tokenizer.curLine());
+        engine.advance();
+        NodeId sub = engine.compileSubroutine();
+        double generated = clock();
+        CodeGenerator generator(engine.ast, engine.symbols, writer, engine.arena,
+                                programIndex);
+        generator.recover = recover;
+        generator.startClass(ast, ast.root);
+        generator.generateSubroutine(sub);
+        if (timeReport) {
+          streamTimings.seconds[(int)phase::PARSE] += generated - parsed;
+          streamTimings.seconds[(int)phase::GENERATE] += clock() - generated;
+          streamTimings.lookups += generator.lookups;
+          streamTimings.instructions += writer.code().code.size();
+        }
+
+        // The keyword after the subroutine was read, not yet passed
+        uint64_t next = engine.currentToken.empty() ? tokenizer.text().size()
+                                                    : engine.tokenizer.tokenBegin();
+        tokenizer.seek(next, engine.tokenizer.curLine());
+        currentToken = std::string_view();
+        advance();
+        lastEnd = engine.lastEnd;
+        emit(writer.code().code, next);
+        writer.code().code.clear();
+      }
+      if (timeReport) {
+        timeReport->event("parse and generate", fileName, begin, clock());
+        timings->add(streamTimings);
+      }
+
+      begin = clock();
+      compileClassEnd();
+      record(phase::PARSE, begin);
+    }
+
+    void generate(unsigned jobs = 1) {
+      double begin = clock();
+      uint64_t lookups;
+      if (jobs > 1)
+        lookups = generateParallel(jobs);
+      else {
+        CodeGenerator generator(ast, symbols, vmWriter, arena, programIndex);
+        generator.recover = recover;
+        generator.generateClass(ast.root);
+        lookups = generator.lookups;
+      }
+      if (timings) {
+        timings->lookups += lookups;
+        timings->instructions += vmWriter.code().code.size();
+        record(phase::GENERATE, begin);
+      }
+    }
+
+    void parse() {
+      compileClassHeader();
+      NodeId *subroutines = &ast.classes[ast.root].subroutines;
+      while (currentToken == "constructor" || currentToken == "function"
+              || currentToken == "method") {
+        *subroutines = compileSubroutine();
+        subroutines = &ast.subroutines[*subroutines].next;
+      }
+      compileClassEnd();
+    }
+
+    // Up to the first subroutine
+    void compileClassHeader() {
+      ALLOCATION_SCOPE(PARSER);
+      ClassNode node;
+      node.span = start();
+      node.name = classId;
+      ast.root = ast.classes.add(node);
+      open("class");
       eat("class");
       eat(fileName);
       eat("{");
+      NodeId *vars = &ast.classes[ast.root].vars;
       while (currentToken == "static" || currentToken == "field")
-        compileClassVarDec();   
-      while (currentToken == "constructor" || currentToken == "function" 
-              || currentToken == "method") {
-        compileSubroutine();   
-        subTable.reset();
-        ifCount = 0;
-        whileCount = 0;
-      }
-      classTable.reset();
+        compileClassVarDec(vars);
+    }
+
+    void compileClassEnd() {
+      ALLOCATION_SCOPE(PARSER);
       eat("}");
+      close("class");
+      ClassNode &node = ast.classes[ast.root];
+      node.span = finish(node.span);
     }
 
-    void compileClassVarDec() {
-      kind kindOf;
-      std::string typeOf;
+    void compileClassVarDec(NodeId *&tail) {
+      kind kindOf = kind::STATIC;
+      uint32_t typeOf;
+      open("classVarDec");
       if (currentToken == "static") {
         kindOf = kind::STATIC;
         advance();
       }
-      else if (currentToken == "field") { 
+      else if (currentToken == "field") {
         kindOf = kind::FIELD;
         advance();
       }
       else
         printError("static|field");
-      typeOf = currentToken;
+      typeOf = currentId;
       compileType();
-      if (tokenizer.tokenType() == tokenType::IDENTIFIER) {
-        classTable.define(currentToken, typeOf, kindOf);
-        advance();
-      }
-      else
-        printError("varName");
-      while (currentToken == ",") {
-        advance();
-        if (tokenizer.tokenType() == tokenType::IDENTIFIER) {
-          classTable.define(currentToken, typeOf, kindOf);
-          advance();
-        }
-        else
-          printError("varName");
-      }
+      compileVarNames(tail, typeOf, kindOf);
       eat(";");
+      close("classVarDec");
     }
 
     /* Why should I implement this is in the particular*/
@@ -133,7 +731,7 @@ class CompilationEngine {
 
     /* Why should I implement this is in the particular*/
     /* check this */
-    void compileType(std::string eType) {
+    void compileType(std::string_view eType) {
       // fileName should be the className
       if (currentToken == "int")
         advance();
@@ -146,13 +744,19 @@ class CompilationEngine {
       else if (tokenizer.tokenType() == tokenType::IDENTIFIER)
         advance();
       else
-        printError("int|char|boolean|className|" + eType);
+        printError(arena.join("int|char|boolean|className|", eType));
     }
 
-    void compileSubroutine() {
+    NodeId compileSubroutine() {
+      ALLOCATION_SCOPE(PARSER);
+      SubroutineNode node;
+      node.span = start();
+      open("subroutineDec");
+      node.returnType = currentId;
       if (currentToken == "constructor") {
-        funcType = keyWord::CONSTRUCTOR;
+        node.kind = keyWord::CONSTRUCTOR;
         advance();
+        node.returnType = currentId;
         if (currentToken == fileName) {
           advance();
         }
@@ -160,476 +764,479 @@ class CompilationEngine {
           printError(fileName);
       }
       else if (currentToken == "function") {
-        funcType = keyWord::FUNCTION;
+        node.kind = keyWord::FUNCTION;
         advance();
+        node.returnType = currentId;
         // And other class name too will come here.
         compileType("void");
       }
       else if (currentToken == "method") {
-        funcType = keyWord::METHOD;
+        node.kind = keyWord::METHOD;
         advance();
+        node.returnType = currentId;
         // And other class name too will come here.
         compileType("void");
-        subTable.define("this", fileName, kind::ARG);
       }
       if (tokenizer.tokenType() == tokenType::IDENTIFIER) {
-        funcName = "." + currentToken;
+        node.name = intern(arena.join(fileName, ".", currentToken));
         advance();
       }
       else
         printError("subroutineName");
       eat("(");
-      compileParameterList();
+      node.params = compileParameterList();
       eat(")");
-      compileSubroutineBody(); 
+      compileSubroutineBody(node);
+      close("subroutineDec");
+      node.span = finish(node.span);
+      return ast.subroutines.add(node);
     }
 
-    void compileParameterList() {
-      std::string typeOf;
+    NodeId compileParameterList() {
+      NodeId first = NIL;
+      NodeId *tail = &first;
+      open("parameterList");
       if (currentToken != ")") {
-        typeOf = currentToken ; 
-        compileType();
-        if (tokenizer.tokenType() == tokenType::IDENTIFIER) {
-          subTable.define(currentToken, typeOf, kind::ARG);
-          advance();
-        }
-        else
-          printError("varName");
-        while (currentToken == ",") {
-          advance();
-          compileType();
-          if (tokenizer.tokenType() == tokenType::IDENTIFIER) {
-            subTable.define(currentToken, typeOf, kind::ARG);
+        do {
+          if (currentToken == ",")
             advance();
-          }
-          else
+          uint32_t typeOf = currentId;
+          compileType();
+          if (tokenizer.tokenType() != tokenType::IDENTIFIER)
             printError("varName");
-        }
+          VarNode var;
+          var.name = currentId;
+          var.type = typeOf;
+          var.kind = kind::ARG;
+          var.span = start();
+          advance();
+          var.span = finish(var.span);
+          *tail = ast.vars.add(var);
+          tail = &ast.vars[*tail].next;
+        } while (currentToken == ",");
       }
+      close("parameterList");
+      return first;
     }
 
-    void compileSubroutineBody() {
+    void compileSubroutineBody(SubroutineNode &node) {
+      open("subroutineBody");
       eat("{");
+      NodeId *locals = &node.locals;
       while (currentToken == "var")
-        compileVarDec();
-      switch (funcType) {
-        case keyWord::CONSTRUCTOR:
-          vmWriter.writeFunction(fileName + funcName, subTable.varCount(kind::VAR));
-          vmWriter.writePush(segment::CONSTANT, classTable.varCount(kind::FIELD));
-          vmWriter.writeCall("Memory.alloc", 1);
-          vmWriter.writePop(segment::POINTER, 0) ;
-          break;
-        case keyWord::FUNCTION:
-          vmWriter.writeFunction(fileName + funcName, subTable.varCount(kind::VAR));
-          break;
-        case keyWord::METHOD:
-          vmWriter.writeFunction(fileName + funcName, subTable.varCount(kind::VAR));
-          vmWriter.writePush(segment::ARGUMENT, 0);
-          vmWriter.writePop(segment::POINTER, 0) ;
-          break;
-        default: printError("constructor|function|method");
-      }
-      compileStatements();
+        compileVarDec(locals);
+      node.body = compileStatements();
       eat("}");
+      close("subroutineBody");
     }
 
-    void compileVarDec() {
-      std::string typeOf;
+    void compileVarDec(NodeId *&tail) {
+      uint32_t typeOf;
+      open("varDec");
       eat("var");
-      typeOf = currentToken;
+      typeOf = currentId;
       compileType();
-      if (tokenizer.tokenType() == tokenType::IDENTIFIER) {
-        subTable.define(currentToken, typeOf, kind::VAR);
-        advance();
-      }
-      else
-        printError("varName");
-      while (currentToken == ",") {
-        advance();
-        if (tokenizer.tokenType() == tokenType::IDENTIFIER) {
-          subTable.define(currentToken, typeOf, kind::VAR);
-          advance();
-        }
-        else
-          printError("varName");
-      }
+      compileVarNames(tail, typeOf, kind::VAR);
       eat(";");
-    } 
-
-    void compileStatements() {
-      while (currentToken == "let" || currentToken == "do"
-              || currentToken == "while" || currentToken == "return" 
-              || currentToken == "if") {
-        if (currentToken == "let") {
-          compileLet(); 
-        }
-        else if (currentToken == "if") {
-          compileIf();
-        }
-        else if (currentToken == "while") {
-          compileWhile();
-        }
-        else if (currentToken == "do") {
-          compileDo();
-        }
-        else if (currentToken == "return") {
-          compileReturn();
-        }
-        else {
-          printError("let|if|while|do|return");
+      close("varDec");
+    }
+
+    // The first of the statements, chained through next
+    NodeId compileStatements() {
+      work.clear();
+      push(construct::STATEMENTS);
+      while (!work.empty()) {
+        Frame &frame = work.back();
+        switch (frame.construct) {
+          case construct::STATEMENTS: compileStatements(frame); break;
+          case construct::LET: compileLet(frame); break;
+          case construct::IF: compileIf(frame); break;
+          case construct::WHILE: compileWhile(frame); break;
+          case construct::DO: compileDo(frame); break;
+          case construct::RETURN: compileReturn(frame); break;
+          case construct::EXPRESSION:
+          case construct::OPERATORS: compileOperators(frame); break;
+          case construct::TERM: compileTerm(frame); break;
+          case construct::CALL: compileCall(frame); break;
         }
       }
+      return result;
     }
 
-    void compileLet() {
-      eat("let");
-      std::string identifier;
-      enum::segment segmentType;
-      enum::kind kindOf;
-      uint64_t index;
-      bool isArr = false;
-      if (tokenizer.tokenType() == tokenType::IDENTIFIER) {
-        identifier = currentToken;
-        if (subTable.contains(currentToken)) {
-          index = subTable.indexOf(currentToken);
-          kindOf = subTable.kindOf(currentToken);
-        }
-        else if (classTable.contains(currentToken)) {
-          index = classTable.indexOf(currentToken);
-          kindOf = classTable.kindOf(currentToken);
-        }
-        else {
-          printError("Declared the variable before using it : " + identifier);
-        }
-        switch (kindOf) {
-          case kind::VAR: segmentType = segment::LOCAL;
-            break;
-          case kind::STATIC: segmentType = segment::STATIC;
-            break;
-          case kind::FIELD: segmentType = segment::THIS;
-            break;
-          case kind::ARG: segmentType = segment::ARGUMENT;
-            break;
-        }
-        advance();
+    void compileStatements(Frame &frame) {
+      if (frame.state == 0)
+        open("statements");
+      else {
+        if (frame.last == NIL)
+          frame.first = result;
+        else
+          ast.statements[frame.last].next = result;
+        frame.last = result;
       }
-      else
-        printError("varName");
-      if (currentToken == "[") {
-        isArr = true;
-        advance();
-        compileExpression();
-        vmWriter.writePush(segmentType, index);
-        vmWriter.writeArithmetic(command::ADD);
-        eat("]");
+      enum::construct statement;
+      if (currentToken == "let")
+        statement = construct::LET;
+      else if (currentToken == "if")
+        statement = construct::IF;
+      else if (currentToken == "while")
+        statement = construct::WHILE;
+      else if (currentToken == "do")
+        statement = construct::DO;
+      else if (currentToken == "return")
+        statement = construct::RETURN;
+      else {
+        close("statements");
+        done(frame.first);
+        return;
+      }
+      frame.state = 1;
+      push(statement);
+    }
+
+    void compileLet(Frame &frame) {
+      StatementNode &node = frame.statement;
+      switch (frame.state) {
+        case 0:
+          node.type = statementType::LET;
+          node.span = start();
+          open("letStatement");
+          eat("let");
+          if (tokenizer.tokenType() == tokenType::IDENTIFIER) {
+            node.name = currentId;
+            advance();
+          }
+          else
+            printError("varName");
+          if (currentToken == "[") {
+            advance();
+            frame.state = 1;
+            compileExpression();
+            return;
+          }
+          break;
+        case 1:
+          node.index = result;
+          eat("]");
+          break;
+        case 2:
+          node.value = result;
+          eat(";");
+          close("letStatement");
+          node.span = finish(node.span);
+          done(ast.statements.add(node));
+          return;
       }
       eat("=");
+      frame.state = 2;
       compileExpression();
-      if (isArr) {
-        vmWriter.writePop(segment::TEMP, 0);
-        vmWriter.writePop(segment::POINTER, 1);  
-        vmWriter.writePush(segment::TEMP, 0);
-        vmWriter.writePop(segment::THAT, 0);
-      }
-      else {
-        vmWriter.writePop(segmentType, index);
+    }
+
+    void compileIf(Frame &frame) {
+      StatementNode &node = frame.statement;
+      switch (frame.state) {
+        case 0:
+          node.type = statementType::IF;
+          node.span = start();
+          open("ifStatement");
+          eat("if");
+          eat("(");
+          frame.state = 1;
+          compileExpression();
+          return;
+        case 1:
+          node.value = result;
+          eat(")");
+          eat("{");
+          frame.state = 2;
+          push(construct::STATEMENTS);
+          return;
+        case 2:
+          node.body = result;
+          eat("}");
+          if (currentToken == "else") {
+            node.hasElse = true;
+            advance();
+            eat("{");
+            frame.state = 3;
+            push(construct::STATEMENTS);
+            return;
+          }
+          break;
+        case 3:
+          node.orElse = result;
+          eat("}");
+          break;
       }
-      eat(";");
+      close("ifStatement");
+      node.span = finish(node.span);
+      done(ast.statements.add(node));
     }
 
-    void compileIf() {
-      uint64_t count = ifCount++;
-      eat("if");
-      eat("(");
-      compileExpression();
-      vmWriter.writeIf("IF_TRUE" + std::to_string(count));
-      vmWriter.writeGoto("IF_FALSE" + std::to_string(count));
-      vmWriter.writeLabel("IF_TRUE" + std::to_string(count));
-      eat(")");
-      eat("{");
-      compileStatements();
+    void compileWhile(Frame &frame) {
+      StatementNode &node = frame.statement;
+      switch (frame.state) {
+        case 0:
+          node.type = statementType::WHILE;
+          node.span = start();
+          open("whileStatement");
+          eat("while");
+          eat("(");
+          frame.state = 1;
+          compileExpression();
+          return;
+        case 1:
+          node.value = result;
+          eat(")");
+          eat("{");
+          frame.state = 2;
+          push(construct::STATEMENTS);
+          return;
+      }
+      node.body = result;
       eat("}");
-      if (currentToken == "else") {
-        vmWriter.writeGoto("IF_END" + std::to_string(count));
-        vmWriter.writeLabel("IF_FALSE" + std::to_string(count));
+      close("whileStatement");
+      node.span = finish(node.span);
+      done(ast.statements.add(node));
+    }
+
+    void compileDo(Frame &frame) {
+      StatementNode &node = frame.statement;
+      if (frame.state == 0) {
+        node.type = statementType::DO;
+        node.span = start();
+        open("doStatement");
+        eat("do");
+        if (tokenizer.tokenType() != tokenType::IDENTIFIER)
+          printError("subroutineName|className|varName");
+        Span span = start();
+        uint32_t identifier = currentId;
         advance();
-        eat("{");
-        compileStatements();
-        eat("}");
-        vmWriter.writeLabel("IF_END" + std::to_string(count));
-      }
-      else {
-        vmWriter.writeLabel("IF_FALSE" + std::to_string(count));
+        frame.state = 1;
+        pushCall(span, identifier);
+        return;
       }
+      node.value = result;
+      eat(";");
+      close("doStatement");
+      node.span = finish(node.span);
+      done(ast.statements.add(node));
     }
 
-    void compileWhile() {
-      uint64_t count = whileCount++;
-      vmWriter.writeLabel("WHILE_EXP" + std::to_string(count));
-			eat("while");
-			eat("(");
-			compileExpression();
-      vmWriter.writeArithmetic(command::NOT);
-      vmWriter.writeIf("WHILE_END" + std::to_string(count));
-			eat(")");
-      eat("{");
-      compileStatements();
-      eat("}");
-      vmWriter.writeGoto("WHILE_EXP" + std::to_string(count));
-      vmWriter.writeLabel("WHILE_END" + std::to_string(count));
-    }
-
-    void compileDo() {
-      eat("do");
-      std::string identifier;
-      uint64_t nArgs = 0;
-      bool isMethod = false;
-      segment segmentType;
-      kind kindOf;
-      uint64_t index;
-			if (tokenizer.tokenType() == tokenType::IDENTIFIER) {
-        if (subTable.contains(currentToken)) {
-          isMethod = true;
-          identifier = subTable.typeOf(currentToken);
-          kindOf = subTable.kindOf(currentToken);
-          index = subTable.indexOf(currentToken);
-        }
-        else if (classTable.contains(currentToken)) {
-          isMethod = true;
-          identifier = classTable.typeOf(currentToken);
-          kindOf = classTable.kindOf(currentToken);
-          index = classTable.indexOf(currentToken);
-        }
-        else {
-          identifier = currentToken;
+    void compileReturn(Frame &frame) {
+      StatementNode &node = frame.statement;
+      if (frame.state == 0) {
+        node.type = statementType::RETURN;
+        node.span = start();
+        open("returnStatement");
+        eat("return");
+        if (currentToken != ";") {
+          frame.state = 1;
+          compileExpression();
+          return;
         }
-        advance();
       }
       else
-        printError("subroutineName|className|varName");
+        node.value = result;
+      eat(";");
+      close("returnStatement");
+      node.span = finish(node.span);
+      done(ast.statements.add(node));
+    }
 
-      switch (kindOf) {
-        case kind::VAR: segmentType = segment::LOCAL;
-          break;
-        case kind::STATIC: segmentType = segment::STATIC;
+    // The rest of a call, after its first identifier, and its expression list
+    void compileCall(Frame &frame) {
+      ExpressionNode &node = frame.expression;
+      switch (frame.state) {
+        case 0:
+          node.type = termType::CALL;
+          if (currentToken == ".") {
+            advance();
+            if (tokenizer.tokenType() != tokenType::IDENTIFIER)
+              printError("subroutineName");
+            node.qualifier = node.name;
+            node.name = currentId;
+            advance();
+          }
+          eat("(");
+          open("expressionList");
+          if (currentToken != ")") {
+            node.length = 1;
+            frame.state = 1;
+            compileExpression();
+            return;
+          }
           break;
-        case kind::FIELD: segmentType = segment::THIS;
+        case 1:
+          node.left = frame.last = result;
           break;
-        case kind::ARG: segmentType = segment::ARGUMENT;
+        case 2:
+          ast.expressions[frame.last].next = result;
+          frame.last = result;
+          ++node.length;
           break;
       }
-
-      if (currentToken == ".") {
-        advance();
-        if (tokenizer.tokenType() == tokenType::IDENTIFIER) {
-          identifier += "." + currentToken;
-          advance();
-        }
-        else
-          printError("subroutineName");
-      }
-      else {
-        // if call method of same class
-        isMethod = true;
-        // Push the current object
-        segmentType = segment::POINTER;
-        index = 0;
-        identifier = fileName + "." + identifier;
-      }
-      eat("(");
-      if (isMethod) {
-        ++nArgs;
-        vmWriter.writePush(segmentType, index);
+      if (frame.state != 0 && currentToken == ",") {
+        eat(",");
+        frame.state = 2;
+        compileExpression();
+        return;
       }
-      nArgs += compileExpressionList();
+      close("expressionList");
       eat(")");
-      eat(";");
-      vmWriter.writeCall(identifier, nArgs);
-      vmWriter.writePop(segment::TEMP, 0);
-       
+      node.span = finish(node.span);
+      done(ast.expressions.add(node));
     }
 
-    void compileReturn() {
-      eat("return");
-      if (currentToken != ";")
-        compileExpression();
-      else 
-        vmWriter.writePush(segment::CONSTANT, 0);
-      vmWriter.writeReturn();
-      eat(";");
+    // Its frame takes the first term, parsed here, and the operators after it
+    void compileExpression() {
+      pushExpression();
+      compileTerm();
     }
 
-    int compileExpressionList() {
-      uint64_t exprs = 0;
-      if (currentToken != ")") {
-        exprs = 1;
-        compileExpression(); 
-        while (currentToken == ",")  {
-          eat(",");
-          compileExpression(); 
-          ++exprs;
-        }
+    /*
+      Precedence climbing: operators of one level are folded into left in a
+      loop, only a higher level takes a frame of its own. A chain of any
+      length builds a left deep tree on one frame.
+    */
+    void compileOperators(Frame &frame) {
+      ExpressionNode &node = frame.expression;
+      if (frame.state == 0) {
+        if (frame.construct == construct::EXPRESSION)
+          frame.left = result;
       }
-      return exprs;
-    }
-
-    void compileExpression() {
-      char op;
-      compileTerm();
-      if (isOp()) {
-        op = tokenizer.symbol();
-        advance();
-        compileTerm();
-        switch(op) {
-          case '+': vmWriter.writeArithmetic(command::ADD);   
-              break;
-          case '-': vmWriter.writeArithmetic(command::SUB); 
-              break;
-          case '*': vmWriter.writeCall("Math.multiply", 2); 
-              break;
-          case '/': vmWriter.writeCall("Math.divide", 2); 
-              break;
-          case '&': vmWriter.writeArithmetic(command::AND); 
-              break;
-          case '|': vmWriter.writeArithmetic(command::OR); 
-              break;
-          case '!': vmWriter.writeArithmetic(command::NEG); 
-              break;
-          case '<': vmWriter.writeArithmetic(command::LT); 
-              break;
-          case '>': vmWriter.writeArithmetic(command::GT); 
-              break;
-          case '=': vmWriter.writeArithmetic(command::EQ); 
-              break;
+      else {
+        node.right = result;
+        if (precedence() > frame.level) {
+          frame.state = 2;
+          pushOperators(node.right, frame.level + 1);
+          return;
         }
+        node.span = finish(ast.expressions[frame.left].span);
+        frame.left = ast.expressions.add(node);
+      }
+      frame.level = precedence();
+      if (frame.level < frame.minPrecedence) {
+        if (frame.construct == construct::EXPRESSION)
+          close("expression");
+        done(frame.left);
+        return;
       }
+      node = ExpressionNode();
+      node.type = termType::BINARY;
+      node.op = tokenizer.symbol();
+      node.left = frame.left;
+      advance();
+      frame.state = 1;
+      compileTerm();
     }
 
+    /*
+      A term is parsed here up to what nests in it. A term with nothing
+      nested is done at once. Otherwise its frame is pushed to carry on
+      after the nested part, and the loop goes on with the term that starts
+      it: the operand of '-' or '~', or the first term of the expression in
+      '(' or '['. A call has a frame of its own.
+    */
     void compileTerm() {
-      std::string identifier;
-      enum::segment segmentType;
-      enum::kind kindOf;
-      uint64_t index;
-      bool isVar = false;
-      uint64_t nArgs = 0;
-			switch (tokenizer.tokenType()) {
-				case tokenType::KEYWORD: 
-          switch (tokenizer.keyWord()) {
-            case keyWord::TRUE:
-              vmWriter.writePush(segment::CONSTANT, 0);
-              vmWriter.writeArithmetic(command::NOT);
-              break;
-            case keyWord::FALSE:
-            case keyWord::NONE:
-              vmWriter.writePush(segment::CONSTANT, 0);
-              break;
-            case keyWord::THIS:
-              vmWriter.writePush(segment::POINTER, 0);
-              break;
-            default: printError("true|false|null|this");
-          }
-          advance();
-          break;
-				case tokenType::INT_CONST: 
-          vmWriter.writePush(segment::CONSTANT, tokenizer.intVal());
-          advance();
-          break;
-				case tokenType::STR_CONST: 
-          vmWriter.writePush(segment::CONSTANT, currentToken.length()); 
-          vmWriter.writeCall("String.new", 1);
-          for (char c: currentToken) {
-            vmWriter.writePush(segment::CONSTANT, (int)c);
-            vmWriter.writeCall("String.appendChar", 2);
-          }
-          advance();
-					break;	
-				case tokenType::IDENTIFIER:
-          if (tokenizer.tokenType() == tokenType::IDENTIFIER) {
-            if (subTable.contains(currentToken)) {
-              isVar = true;
-              index = subTable.indexOf(currentToken);
-              kindOf = subTable.kindOf(currentToken);
-              identifier = subTable.typeOf(currentToken);
-            }
-            else if (classTable.contains(currentToken)) {
-              isVar = true;
-              index = classTable.indexOf(currentToken);
-              kindOf = classTable.kindOf(currentToken);
-              identifier = classTable.typeOf(currentToken);
-            }
-            else {
-              identifier = currentToken;
-            }
-            advance();
-          }
-          // If identifier is a variable 
-          if (isVar) {
-            switch (kindOf) {
-              case kind::VAR: segmentType = segment::LOCAL;
-                break;
-              case kind::STATIC: segmentType = segment::STATIC;
-                break;
-              case kind::FIELD: segmentType = segment::THIS;
-                break;
-              case kind::ARG: segmentType = segment::ARGUMENT;
+      for (;;) {
+        ExpressionNode node;
+        node.span = start();
+        open("term");
+        switch (tokenizer.tokenType()) {
+          case tokenType::KEYWORD:
+            switch (tokenizer.keyWord()) {
+              case keyWord::TRUE:
+              case keyWord::FALSE:
+              case keyWord::NONE:
+              case keyWord::THIS:
+                node.type = termType::KEYWORD;
+                node.keyWord = tokenizer.keyWord();
                 break;
+              default: printError("true|false|null|this");
             }
-          }
-					if (currentToken == "[") {
-						advance();
-						compileExpression();
-            vmWriter.writePush(segmentType, index);
-            vmWriter.writeArithmetic(command::ADD);
-            vmWriter.writePop(segment::POINTER, 1);
-            vmWriter.writePush(segment::THAT, 0);
-						eat("]");
-					}
-					else if (currentToken == "(") {
-            identifier = fileName + "." + identifier;
-						advance();
-            vmWriter.writePush(segment::POINTER, 0);
-	  				nArgs = compileExpressionList() + 1; 
-            vmWriter.writeCall(identifier, nArgs);
-						eat(")");
-					}
-					else if (currentToken == ".") {
             advance();
-            if (tokenizer.tokenType() == tokenType::IDENTIFIER) {
-              identifier += "." + currentToken;
-            } 
+            break;
+          case tokenType::INT_CONST:
+            node.type = termType::INT_CONST;
+            node.value = tokenizer.intVal();
+            advance();
+            break;
+          case tokenType::STR_CONST:
+            node.type = termType::STR_CONST;
+            node.value = ast.text.size();
+            node.length = currentToken.length();
+            ast.text.insert(ast.text.end(), currentToken.begin(), currentToken.end());
+            advance();
+            break;
+          case tokenType::IDENTIFIER: {
+            uint32_t identifier = currentId;
             advance();
-						eat("(");
-	  				nArgs = compileExpressionList(); 
-            if (isVar) {
-              ++nArgs;
-              vmWriter.writePush(segmentType, index);
+            if (currentToken == "[") {
+              node.type = termType::INDEX;
+              node.name = identifier;
+              advance();
+              pushTerm(node, 1);
+              pushExpression();
+              continue;
+            }
+            else if (currentToken == "(" || currentToken == ".") {
+              pushTerm(node, 2);
+              pushCall(node.span, identifier);
+              return;
             }
-            vmWriter.writeCall(identifier, nArgs);
-						eat(")");
-					}
-          else {
             // Normal variable;
-            vmWriter.writePush(segmentType, index);
-          }
-					break;
-				case tokenType::SYMBOL:
-          switch (tokenizer.symbol()) {
-             case '(':
-              advance();
-              compileExpression();
-              eat(")");
-              break;
-            case '~':
-              advance();
-              compileTerm();
-              vmWriter.writeArithmetic(command::NOT); 
-              break;
-            case '-':
-              advance();
-              compileTerm();
-              vmWriter.writeArithmetic(command::NEG); 
-              break;
+            node.type = termType::VAR;
+            node.name = identifier;
+            break;
           }
-			}
+          case tokenType::SYMBOL:
+            switch (tokenizer.symbol()) {
+              case '(':
+                node.type = termType::GROUP;
+                advance();
+                pushTerm(node, 3);
+                pushExpression();
+                continue;
+              case '~':
+              case '-':
+                node.type = termType::UNARY;
+                node.op = tokenizer.symbol();
+                advance();
+                pushTerm(node, 4);
+                continue;
+              default: printError("(|~|-");
+            }
+        }
+        close("term");
+        node.span = finish(node.span);
+        result = ast.expressions.add(node);
+        return;
+      }
+    }
+
+    // A term whose nested part is done
+    void compileTerm(Frame &frame) {
+      ExpressionNode &node = frame.expression;
+      switch (frame.state) {
+        case 1:
+          node.left = result;
+          eat("]");
+          break;
+        case 2:
+          // The call is the term
+          close("term");
+          done(result);
+          return;
+        case 3:
+          node.left = result;
+          eat(")");
+          break;
+        case 4:
+          node.left = result;
+          break;
+      }
+      close("term");
+      node.span = finish(node.span);
+      done(ast.expressions.add(node));
     }
 };
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdexcept>
+#include <string>
+
+/*
+  An error in the source. The compiler reports errors on std::cerr and
+  exits, a caller that carries on after them, e.g. the language server,
+  sets recover on the tokenizer, engine and generator and gets this thrown.
+  report is the line the compiler prints for it, so an error caught on one
+  thread can be reported on another.
+*/
+struct CompileError : std::runtime_error {
+  uint64_t line;
+  uint64_t begin;     // byte offsets [begin, end) of what it is about
+  uint64_t end;
+  std::string report;
+
+  CompileError(const std::string &message, uint64_t line, uint64_t begin, uint64_t end,
+               const std::string &report)
+    : std::runtime_error(message), line(line), begin(begin), end(end), report(report) { }
+};
@@ -0,0 +1,237 @@
+#pragma once
+
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+#include "VMCode.hh"
+
+/*
+  Runs the VM code of a Jack function at compile time. Only functions that
+  stay away from fields, statics, arrays and the OS (except the pure Math
+  functions) can be run, anything else gives up, as does running out of steps.
+*/
+class ConstEvaluator {
+  private:
+    struct Function {
+      const VMCode *code;
+      size_t begin;
+      size_t end;
+      std::unordered_map<uint32_t, size_t> labels;
+    };
+
+    struct Frame {
+      const Function *function;
+      size_t pc;
+      std::vector<int16_t> args;
+      std::vector<int16_t> locals;
+      size_t stackBase;
+    };
+
+    std::unordered_map<uint32_t, Function> functions;
+    // Every call evaluated so far, false when it could not be
+    std::map<std::pair<uint32_t, std::vector<int16_t> >,
+             std::pair<bool, int16_t> > results;
+    uint64_t budget;
+    uint64_t maxDepth = 256;
+
+    static int16_t wrap(int32_t value) {
+      return (int16_t)(uint16_t)value;
+    }
+
+    // Math functions of the OS that only depend on their arguments
+    static bool callMath(uint32_t name, const std::vector<int16_t> &args,
+                         int16_t &result) {
+      static const uint32_t multiply = intern("Math.multiply"), divide = intern("Math.divide"),
+                            abs = intern("Math.abs"), min = intern("Math.min"),
+                            max = intern("Math.max"), sqrt = intern("Math.sqrt");
+      if (name == multiply && args.size() == 2)
+        result = wrap((int32_t)args[0] * args[1]);
+      else if (name == divide && args.size() == 2 && args[1] != 0
+               && args[0] != -32768 && args[1] != -32768)
+        result = wrap(args[0] / args[1]);
+      else if (name == abs && args.size() == 1)
+        result = wrap(args[0] < 0 ? -(int32_t)args[0] : args[0]);
+      else if (name == min && args.size() == 2)
+        result = args[0] < args[1] ? args[0] : args[1];
+      else if (name == max && args.size() == 2)
+        result = args[0] > args[1] ? args[0] : args[1];
+      else if (name == sqrt && args.size() == 1 && args[0] >= 0) {
+        int16_t root = 0;
+        while ((root + 1) * (root + 1) <= args[0])
+          ++root;
+        result = root;
+      }
+      else
+        return false;
+      return true;
+    }
+
+    bool run(const Function &entry, const std::vector<int16_t> &args, int16_t &result) {
+      std::vector<int16_t> stack;
+      std::vector<Frame> frames;
+      int16_t temp[8] = {0};
+      uint64_t steps = 0;
+
+      frames.push_back({&entry, entry.begin + 1, args,
+                        std::vector<int16_t>((*entry.code)[entry.begin].index, 0), 0});
+      while (++steps <= budget) {
+        Frame &frame = frames.back();
+        if (frame.pc >= frame.function->end)
+          return false;
+        const VMCommand &c = (*frame.function->code)[frame.pc++];
+        switch (c.op) {
+          case vmOp::PUSH:
+            switch (c.seg) {
+              case segment::CONSTANT: stack.push_back(wrap(c.index));
+                break;
+              case segment::ARGUMENT:
+                if ((size_t)c.index >= frame.args.size())
+                  return false;
+                stack.push_back(frame.args[c.index]);
+                break;
+              case segment::LOCAL: stack.push_back(frame.locals[c.index]);
+                break;
+              case segment::TEMP: stack.push_back(temp[c.index]);
+                break;
+              default: return false;
+            }
+            break;
+          case vmOp::POP: {
+            if (stack.size() <= frame.stackBase)
+              return false;
+            int16_t value = stack.back();
+            stack.pop_back();
+            switch (c.seg) {
+              case segment::ARGUMENT:
+                if ((size_t)c.index >= frame.args.size())
+                  return false;
+                frame.args[c.index] = value;
+                break;
+              case segment::LOCAL: frame.locals[c.index] = value;
+                break;
+              case segment::TEMP: temp[c.index] = value;
+                break;
+              default: return false;
+            }
+            break;
+          }
+          case vmOp::ARITHMETIC: {
+            size_t operands = c.cmd == command::NEG || c.cmd == command::NOT ? 1 : 2;
+            if (stack.size() < frame.stackBase + operands)
+              return false;
+            int16_t y = stack.back();
+            if (operands == 1) {
+              stack.back() = wrap(c.cmd == command::NEG ? -(int32_t)y : ~y);
+              break;
+            }
+            stack.pop_back();
+            int16_t x = stack.back();
+            switch (c.cmd) {
+              case command::ADD: stack.back() = wrap((int32_t)x + y);
+                break;
+              case command::SUB: stack.back() = wrap((int32_t)x - y);
+                break;
+              case command::EQ: stack.back() = x == y ? -1 : 0;
+                break;
+              case command::GT: stack.back() = x > y ? -1 : 0;
+                break;
+              case command::LT: stack.back() = x < y ? -1 : 0;
+                break;
+              case command::AND: stack.back() = x & y;
+                break;
+              case command::OR: stack.back() = x | y;
+                break;
+              default: return false;
+            }
+            break;
+          }
+          case vmOp::LABEL:
+            break;
+          case vmOp::GOTO:
+            frame.pc = frame.function->labels.at(c.name);
+            break;
+          case vmOp::IF: {
+            if (stack.size() <= frame.stackBase)
+              return false;
+            int16_t condition = stack.back();
+            stack.pop_back();
+            if (condition)
+              frame.pc = frame.function->labels.at(c.name);
+            break;
+          }
+          case vmOp::CALL: {
+            if (stack.size() < frame.stackBase + c.index)
+              return false;
+            std::vector<int16_t> callArgs(stack.end() - c.index, stack.end());
+            stack.resize(stack.size() - c.index);
+            int16_t value;
+            if (callMath(c.name, callArgs, value)) {
+              stack.push_back(value);
+              break;
+            }
+            auto callee = functions.find(c.name);
+            if (callee == functions.end() || frames.size() >= maxDepth)
+              return false;
+            const Function &f = callee->second;
+            frames.push_back({&f, f.begin + 1, callArgs,
+                              std::vector<int16_t>((*f.code)[f.begin].index, 0),
+                              stack.size()});
+            break;
+          }
+          case vmOp::FUNCTION:
+            return false;
+          case vmOp::RETURN: {
+            if (stack.size() <= frame.stackBase)
+              return false;
+            int16_t value = stack.back();
+            stack.resize(frame.stackBase);
+            frames.pop_back();
+            if (frames.empty()) {
+              result = value;
+              return true;
+            }
+            stack.push_back(value);
+            break;
+          }
+        }
+      }
+      return false;
+    }
+
+  public:
+    uint64_t evaluated = 0;
+
+    ConstEvaluator(const std::vector<VMClass> &program, uint64_t budget)
+      : budget(budget) {
+      for (const VMClass &vmClass: program) {
+        for (VMRange range: functionRanges(vmClass.code)) {
+          Function &f = functions[vmClass.code[range.begin].name];
+          f.code = &vmClass.code;
+          f.begin = range.begin;
+          f.end = range.end;
+          for (size_t i = range.begin; i < range.end; ++i)
+            if (vmClass.code[i].op == vmOp::LABEL)
+              f.labels[vmClass.code[i].name] = i;
+        }
+      }
+    }
+
+    // The value of name(args), false when it can not be known at compile time
+    bool evaluate(uint32_t name, const std::vector<int16_t> &args,
+                  int16_t &result) {
+      if (callMath(name, args, result))
+        return true;
+      auto known = results.find({name, args});
+      if (known != results.end()) {
+        result = known->second.second;
+        return known->second.first;
+      }
+      auto f = functions.find(name);
+      bool constant = f != functions.end() && run(f->second, args, result);
+      if (constant)
+        ++evaluated;
+      results[{name, args}] = {constant, result};
+      return constant;
+    }
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <string_view>
+
+// 64 bit FNV-1a, good enough to tell contents apart in the caches
+inline uint64_t hashBytes(std::string_view bytes, uint64_t hash = 14695981039346656037ull) {
+  for (unsigned char c: bytes) {
+    hash ^= c;
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+/*
+  64 bit hash of four independent lanes of eight bytes, for checksums of
+  large buffers where hashBytes would cost as much as the work the checksum
+  saves.
+*/
+inline uint64_t hashWords(std::string_view bytes, uint64_t hash = 0x9e3779b97f4a7c15ull) {
+  const uint64_t K = 0xff51afd7ed558ccdull, M = 0xc4ceb9fe1a85ec53ull;
+  uint64_t lanes[4] = {hash ^ bytes.size(), hash + K, hash + M, hash - K};
+  size_t i = 0;
+  for (; i + 32 <= bytes.size(); i += 32)
+    for (int k = 0; k < 4; ++k) {
+      uint64_t word;
+      memcpy(&word, bytes.data() + i + 8 * k, 8);
+      lanes[k] = (lanes[k] ^ (word * K)) * M;
+      lanes[k] ^= lanes[k] >> 29;
+    }
+  hash = lanes[0];
+  for (int k = 1; k < 4; ++k)
+    hash = (hash ^ lanes[k]) * M;
+  for (; i < bytes.size(); ++i)
+    hash = (hash ^ (unsigned char)bytes[i]) * K;
+  return hash ^ (hash >> 32);
+}
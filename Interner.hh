@@ -0,0 +1,121 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <string_view>
+#include <unordered_map>
+
+#include "Arena.hh"
+
+/*
+  The one pool of names of the process: identifiers, keywords, call targets
+  and labels. Every distinct name gets a stable 32 bit id and is stored once,
+  the string_view handed out stays valid until exit.
+
+  Lookups are spread over shards, each behind a shared_mutex, so parallel
+  compilations mostly take read locks. Names are kept in fixed blocks that
+  never move, so name(id) takes no lock at all.
+*/
+class Interner {
+  private:
+    static const uint32_t SHARDS = 16;
+    static const uint32_t BLOCK_BITS = 12;
+    static const uint32_t BLOCK = 1 << BLOCK_BITS;
+    static const uint32_t BLOCKS = 1 << 16;
+
+    struct Shard {
+      std::shared_mutex mutex;
+      Arena arena;
+      std::unordered_map<std::string_view, uint32_t> ids;
+    };
+
+    Shard shards[SHARDS];
+    std::atomic<std::string_view *> blocks[BLOCKS];
+    std::atomic<uint32_t> count{0};
+    std::mutex blockMutex;
+
+    Interner() {
+      for (auto &block: blocks)
+        block.store(nullptr, std::memory_order_relaxed);
+    }
+
+    ~Interner() {
+      for (auto &block: blocks)
+        delete[] block.load(std::memory_order_relaxed);
+    }
+
+    Shard &shardOf(std::string_view name) {
+      return shards[std::hash<std::string_view>()(name) % SHARDS];
+    }
+
+    void publish(uint32_t id, std::string_view name) {
+      std::string_view *block = blocks[id >> BLOCK_BITS].load(std::memory_order_acquire);
+      if (!block) {
+        std::lock_guard<std::mutex> lock(blockMutex);
+        block = blocks[id >> BLOCK_BITS].load(std::memory_order_relaxed);
+        if (!block) {
+          block = new std::string_view[BLOCK];
+          blocks[id >> BLOCK_BITS].store(block, std::memory_order_release);
+        }
+      }
+      block[id & (BLOCK - 1)] = name;
+    }
+
+  public:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    Interner(const Interner &) = delete;
+    Interner &operator=(const Interner &) = delete;
+
+    static Interner &global() {
+      static Interner interner;
+      return interner;
+    }
+
+    uint32_t intern(std::string_view name) {
+      Shard &shard = shardOf(name);
+      {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.ids.find(name);
+        if (it != shard.ids.end())
+          return it->second;
+      }
+      std::unique_lock<std::shared_mutex> lock(shard.mutex);
+      auto it = shard.ids.find(name);
+      if (it != shard.ids.end())
+        return it->second;
+      uint32_t id = count++;
+      if (id >= BLOCKS * BLOCK)
+        throw std::runtime_error("Too many distinct names");
+      name = shard.arena.copy(name);
+      publish(id, name);
+      shard.ids.insert({name, id});
+      return id;
+    }
+
+    // Never inserts, NONE if name was never interned
+    uint32_t find(std::string_view name) {
+      Shard &shard = shardOf(name);
+      std::shared_lock<std::shared_mutex> lock(shard.mutex);
+      auto it = shard.ids.find(name);
+      return it == shard.ids.end() ? NONE : it->second;
+    }
+
+    std::string_view name(uint32_t id) const {
+      return blocks[id >> BLOCK_BITS].load(std::memory_order_acquire)[id & (BLOCK - 1)];
+    }
+
+    uint32_t size() const {
+      return count;
+    }
+};
+
+inline uint32_t intern(std::string_view name) {
+  return Interner::global().intern(name);
+}
+
+inline std::string_view nameOf(uint32_t id) {
+  return Interner::global().name(id);
+}
@@ -5,17 +5,28 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <fstream>
+
 #include "CompilationEngine.hh"
 
-// Process each file
+// Process each file, its .xml parse tree is written by the same parse as its .vm
 void processFile(std::string file) {
   std::string fileName = file;
 
   // Only files ending .jack extension
-  if (fileName.substr(fileName.find_last_of(".")) == ".jack") {
+  size_t dot = fileName.find_last_of(".");
+  if (dot != std::string::npos && fileName.substr(dot) == ".jack") {
     CompilationEngine compiler(fileName);
+    std::string xmlPath = fileName.substr(0, dot) + ".xml";
+    std::ofstream xmlFile(xmlPath);
+    if (!xmlFile)
+      throw std::runtime_error("Failed to open file: " + xmlPath);
+    TreeWriter tree(treeFormat::XML, &xmlFile);
+    compiler.writeTree(&tree);
     // Every Jack program is a collection of class
     compiler.compileClass();
+    tree.flush();
+    writeVMFile(compiler.code());
   }
 }
 
@@ -1,4 +1,8 @@
 #include <iostream>
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <vector>
 
 #include <dirent.h>
 #include <sys/types.h>
@@ -6,35 +10,287 @@
 #include <unistd.h>
 
 #include "CompilationEngine.hh"
+#include "LanguageServer.hh"
+#include "MappedFile.hh"
+#include "Optimizer.hh"
+
+// Every class of the program, kept until the whole program is compiled
+std::vector<VMClass> program;
+ProgramIndex programIndex;
+uint64_t signatureHash;
+Options options;
+std::unique_ptr<TimeReport> timeReport;
+std::vector<Timings *> timings;       // of each class of program
+std::vector<std::string> streamed;    // --stream: .vm files written aside until the budget is checked
+
+// What each component allocated since before. The peak is the most live
+// above what was live then, or for the whole run the most live at all.
+void reportAllocations(const std::string &name, const AllocationCounts before[], bool run) {
+  std::cout << "Allocations: " << name << std::endl;
+  for (int c = 0; c < (int)component::COUNT; ++c) {
+    AllocationCounts now = allocationCounters.counts((enum::component)c);
+    std::cout << "  " << componentName((enum::component)c) << ": "
+              << now.allocations - before[c].allocations << " allocations, "
+              << now.bytes - before[c].bytes << " bytes, peak "
+              << (run ? now.highWater : now.peak - std::min(now.peak, before[c].live))
+              << " bytes live, arena "
+              << now.arenaAllocations - before[c].arenaAllocations << " allocations, "
+              << now.arenaBytes - before[c].arenaBytes << " bytes" << std::endl;
+  }
+}
+
+// What the allocations of a file are reported against
+void startAllocations(AllocationCounts before[]) {
+  for (int c = 0; c < (int)component::COUNT; ++c)
+    before[c] = allocationCounters.counts((enum::component)c);
+  allocationCounters.resetPeaks();
+}
+
+// The parse tree of the class compiler compiles, written to path
+std::unique_ptr<TreeWriter> openTree(CompilationEngine &compiler, std::ofstream &file,
+                                     const std::string &path, treeFormat format) {
+  file.open(path);
+  if (!file)
+    throw std::runtime_error("Failed to open file: " + path);
+  std::unique_ptr<TreeWriter> tree(new TreeWriter(format, &file));
+  compiler.writeTree(tree.get());
+  return tree;
+}
 
 // Process each file
 void processFile(std::string file) {
   std::string fileName = file;
 
   // Only files ending .jack extension
-  if (fileName.substr(fileName.find_last_of(".")) == ".jack") {
+  size_t dot = fileName.find_last_of(".");
+  if (dot != std::string::npos && fileName.substr(dot) == ".jack") {
+    AllocationCounts before[(int)component::COUNT];
+    if (trackingAllocations() && options.allocReport)
+      startAllocations(before);
+
     // Initialize the compiler
-    CompilationEngine compiler(fileName);
+    double begin = timeReport ? timeReport->now() : 0;
+    CompilationEngine compiler(fileName, &programIndex);
+    if (timeReport) {
+      Timings &fileTimings = timeReport->file(fileName);
+      timings.push_back(&fileTimings);
+      timeReport->record(fileTimings, phase::READ, fileName, begin);
+      compiler.timeWith(timeReport.get(), &fileTimings);
+
+      // The parser pulls the tokens as it goes, the lexer is timed alone
+      begin = timeReport->now();
+      Arena arena;
+      JackTokenizer tokenizer;
+      tokenizer.initSource(compiler.source(), arena);
+      while (tokenizer.hasMoreTokens()) {
+        tokenizer.advance();
+        ++fileTimings.tokens;
+      }
+      timeReport->record(fileTimings, phase::LEX, fileName, begin);
+    }
+
+    // The parse trees are written as the class is parsed
+    std::string base = fileName.substr(0, dot);
+    std::ofstream xmlFile, jsonFile;
+    std::unique_ptr<TreeWriter> xml, json;
+    if (options.xml)
+      xml = openTree(compiler, xmlFile, base + ".xml", treeFormat::XML);
+    if (options.json)
+      json = openTree(compiler, jsonFile, base + ".json", treeFormat::JSON);
+
+    std::unique_ptr<SubroutineCache> cache;
+    if (!options.incremental.empty())
+      cache.reset(new SubroutineCache(options.incremental, fileName, signatureHash));
 
     // Every Jack program is a collection of class
-    compiler.compileClass();
+    // The parse trees and the subroutine cache want a parse, the image is
+    // only used without them
+    if (!options.astCache.empty() && !cache && !xml && !json)
+      compiler.compileClass(options.astCache, options.jobs);
+    else
+      compiler.compileClass(options.jobs, cache.get());
+    if (cache) {
+      cache->save();
+      if (options.explain) {
+        for (auto &rebuilt: cache->rebuilt)
+          std::cout << "Incremental: " << nameOf(rebuilt.first) << " rebuilt, "
+                    << rebuilt.second << std::endl;
+        std::cout << "Incremental: " << fileName << " " << cache->rebuilt.size()
+                  << " rebuilt, " << cache->reused << " reused" << std::endl;
+      }
+    }
+    if (options.allocReport) {
+      const Arena &arena = compiler.memory();
+      std::cout << "Arena: " << fileName << " " << arena.allocations
+                << " allocations, " << arena.bytes << " bytes, from "
+                << arena.chunkCount() << " chunks" << std::endl;
+      if (trackingAllocations())
+        reportAllocations(fileName, before, false);
+      std::cout << "Peak RSS: " << peakRSS() << " bytes" << std::endl;
+    }
+    program.push_back(std::move(compiler.code()));
+  }
+}
+
+/*
+  --stream: the file is mapped rather than read, and each subroutine is
+  optimized and written out as soon as it is generated. The source behind
+  it is released, so memory holds the class declarations and one
+  subroutine whatever the length of the file, below the 4 GiB limit on
+  a class.
+*/
+void streamFile(const std::string &fileName, Optimizer &optimizer) {
+  size_t dot = fileName.find_last_of(".");
+  if (dot == std::string::npos || fileName.substr(dot) != ".jack")
+    return;
+  AllocationCounts before[(int)component::COUNT];
+  if (trackingAllocations() && options.allocReport)
+    startAllocations(before);
+
+  double begin = timeReport ? timeReport->now() : 0;
+  MappedFile source;
+  if (!source.open(fileName))
+    throw std::runtime_error("Failed to open file: " + fileName);
+  std::string base = fileName.substr(0, dot);
+  VMClass function;
+  function.name = base.substr(base.find_last_of("/") + 1);
+  function.path = base + ".vm";
+  CompilationEngine compiler(source.text(), function.name, &programIndex);
+  Timings *fileTimings = nullptr;
+  if (timeReport) {
+    fileTimings = &timeReport->file(fileName);
+    timeReport->record(*fileTimings, phase::READ, fileName, begin);
+    compiler.timeWith(timeReport.get(), fileTimings);
+  }
+
+  std::ofstream xmlFile, jsonFile;
+  std::unique_ptr<TreeWriter> xml, json;
+  if (options.xml)
+    xml = openTree(compiler, xmlFile, base + ".xml", treeFormat::XML);
+  if (options.json)
+    json = openTree(compiler, jsonFile, base + ".json", treeFormat::JSON);
+
+  std::ofstream out(function.path + ".tmp");
+  if (!out)
+    throw std::runtime_error("Failed to open file: " + function.path + ".tmp");
+  compiler.compileStream([&](VMCode &code, uint64_t next) {
+    double written = timeReport ? timeReport->now() : 0;
+    function.code.swap(code);
+    optimizer.optimizeFunction(function);
+    for (const VMCommand &c: function.code)
+      writeCommand(out, c);
+    if (fileTimings)
+      fileTimings->seconds[(int)phase::WRITE] += timeReport->now() - written;
+    source.release(next);
+  });
+  streamed.push_back(function.path);
+  if (fileTimings)
+    fileTimings->bytes += out.tellp();
+  if (options.allocReport) {
+    if (trackingAllocations())
+      reportAllocations(fileName, before, false);
+    std::cout << "Peak RSS: " << peakRSS() << " bytes" << std::endl;
   }
 }
 
+void usage() {
+  std::cerr << "Usage: JackCompiler [-O] [--pack-locals] [--pack-statics]"
+            << " [--void-returns] [--prologues]"
+            << " [--eval-budget N]"
+            << " [--static-budget N] [--index-cache FILE] [--alloc-report] [--stats]"
+            << " [--jobs N] [--incremental DIR] [--explain] [--xml] [--json]"
+            << " [--ast-cache DIR] [--time-report] [--trace FILE] [--stream]"
+            << " [file or directory]"
+            << std::endl
+            << "       JackCompiler --lsp [--ast-cache DIR]" << std::endl;
+  exit(1);
+}
+
+// The value N of a switch, usage() unless text is a decimal number that fits
+uint64_t number(const std::string &text) {
+  uint64_t value = 0;
+  if (text.empty() || text.size() > 19)
+    usage();
+  for (char c: text) {
+    if (c < '0' || c > '9')
+      usage();
+    value = value * 10 + (c - '0');
+  }
+  return value;
+}
+
 int main(int argc, char *argv[]) {
-  if (argc < 2 || argc > 3) {
-    std::cerr << "Usage: JackAnalyzer [file or directory]" << std::endl;
-    exit(1);
+  std::string path;
+  std::string indexCache;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "-O") {
+      options.packLocals = true;
+      options.packStatics = true;
+      options.voidReturns = true;
+      options.prologues = true;
+      options.evalBudget = 10000;
+    }
+    else if (arg == "--pack-locals")
+      options.packLocals = true;
+    else if (arg == "--pack-statics")
+      options.packStatics = true;
+    else if (arg == "--void-returns")
+      options.voidReturns = true;
+    else if (arg == "--prologues")
+      options.prologues = true;
+    else if (arg == "--eval-budget" && i + 1 < argc)
+      options.evalBudget = number(argv[++i]);
+    else if (arg == "--static-budget" && i + 1 < argc)
+      options.staticBudget = number(argv[++i]);
+    else if (arg == "--index-cache" && i + 1 < argc)
+      indexCache = argv[++i];
+    else if (arg == "--alloc-report")
+      options.allocReport = true;
+    else if (arg == "--stats")
+      options.stats = true;
+    else if (arg == "--incremental" && i + 1 < argc)
+      options.incremental = argv[++i];
+    else if (arg == "--explain")
+      options.explain = true;
+    else if (arg == "--xml")
+      options.xml = true;
+    else if (arg == "--json")
+      options.json = true;
+    else if (arg == "--time-report")
+      options.timeReport = true;
+    else if (arg == "--trace" && i + 1 < argc) {
+      options.timeReport = true;
+      options.trace = argv[++i];
+    }
+    else if (arg == "--ast-cache" && i + 1 < argc)
+      options.astCache = argv[++i];
+    else if (arg == "--stream")
+      options.stream = true;
+    else if (arg == "--lsp" && (argc == 2 || (argc == 4 && std::string(argv[2]) == "--ast-cache"))) {
+      std::string astCache = argc == 4 ? argv[3] : "";
+      if (!astCache.empty())
+        mkdir(astCache.c_str(), 0777);
+      return LanguageServer(std::cin, std::cout, astCache).run();
+    }
+    else if (arg == "--jobs" && i + 1 < argc)
+      options.jobs = std::clamp<uint64_t>(number(argv[++i]), 1, UINT32_MAX);
+    else if (arg[0] == '-' || !path.empty())
+      usage();
+    else
+      path = arg;
   }
-  /* 
-    check if the file is directory or a single file 
+  if (path.empty())
+    usage();
+  /*
+    check if the file is directory or a single file
     if single file open do xyz things
     if a directory then for each file do xyz things
   */
-  struct stat pathStat; 
-  stat(argv[1], &pathStat);
-  std::string path = argv[1];
-   
+  struct stat pathStat;
+  stat(path.c_str(), &pathStat);
+  std::vector<std::string> files;
+
   // Check if regular file
   if (S_ISREG(pathStat.st_mode)) {
     int i = path.find_last_of("/") + 1;
@@ -43,30 +299,100 @@ int main(int argc, char *argv[]) {
       std::cerr << "File name should be captialized." << std::endl;
       exit(1);
     }
-    //std::cout << "Processing a single file: " << argv[1] << std::endl;
-    processFile(argv[1]);
+    //std::cout << "Processing a single file: " << path << std::endl;
+    files.push_back(path);
   }
   else if (S_ISDIR(pathStat.st_mode)) {
     DIR *dir;
-    dir = opendir(argv[1]);
+    dir = opendir(path.c_str());
 
     if (dir == NULL) {
-      std::cerr << "Failed to open directory: " << argv[1] << std::endl;
+      std::cerr << "Failed to open directory: " << path << std::endl;
       exit(1);
     }
 
-    struct dirent *entry; 
-    // Process each file
+    // Sorted, so whole program passes see the classes in a stable order
+    struct dirent *entry;
     while ((entry=readdir(dir)))
-      processFile(path + "/" + entry -> d_name); 
-     
-    closedir(dir); 
+      files.push_back(path + "/" + entry -> d_name);
+    closedir(dir);
+    std::sort(files.begin(), files.end());
   }
   else {
     std::cerr << "File is invalid" << std::endl;
     exit(1);
   }
-    
+
+  if (options.timeReport)
+    timeReport.reset(new TimeReport);
+  double begin = timeReport ? timeReport->now() : 0;
+
+  // Every signature is known before the first class is compiled
+  if (!indexCache.empty())
+    programIndex.load(indexCache);
+  for (std::string &file: files) {
+    size_t dot = file.find_last_of(".");
+    if (dot != std::string::npos && file.substr(dot) == ".jack")
+      programIndex.addFile(file);
+  }
+  if (!indexCache.empty())
+    programIndex.save(indexCache);
+  signatureHash = programIndex.signatureHash();
+  if (timeReport)
+    timeReport->record("index", begin);
+  if (!options.incremental.empty())
+    mkdir(options.incremental.c_str(), 0777);
+  if (!options.astCache.empty())
+    mkdir(options.astCache.c_str(), 0777);
+  if (options.stats)
+    std::cout << "ProgramIndex: " << programIndex.scanned << " scanned, "
+              << programIndex.loaded << " loaded from cache" << std::endl;
+
+  // Process each file
+  Optimizer optimizer(options, program, programIndex);
+  for (std::string &file: files) {
+    if (options.stream)
+      streamFile(file, optimizer);
+    else
+      processFile(file);
+  }
+
+  begin = timeReport ? timeReport->now() : 0;
+  if (options.stream) {
+    // An old .vm is replaced only once the statics of the program fit
+    bool fits = optimizer.finishFunctions();
+    for (const std::string &path: streamed)
+      if (fits)
+        rename((path + ".tmp").c_str(), path.c_str());
+      else
+        unlink((path + ".tmp").c_str());
+    if (!fits)
+      exit(1);
+  }
+  else
+    optimizer.run();
+  if (timeReport)
+    timeReport->record("optimize", begin);
+
+  for (size_t i = 0; i < program.size(); ++i) {
+    begin = timeReport ? timeReport->now() : 0;
+    uint64_t bytes = writeVMFile(program[i]);
+    if (timeReport) {
+      timings[i]->bytes += bytes;
+      timeReport->record(*timings[i], phase::WRITE, program[i].name, begin);
+    }
+  }
+  if (options.allocReport) {
+    AllocationCounts start[(int)component::COUNT];
+    if (trackingAllocations())
+      reportAllocations("the run", start, true);
+    std::cout << "Peak RSS: " << peakRSS() << " bytes" << std::endl;
+  }
+  if (timeReport) {
+    timeReport->print(std::cout);
+    if (!options.trace.empty())
+      timeReport->writeTrace(options.trace);
+  }
+
   return 0;
 }
-
@@ -1,15 +1,37 @@
+#pragma once
+
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <string>
 
 #include "JackTokens.hh"
+#include "Arena.hh"
+#include "CompileError.hh"
+#include "Interner.hh"
+#include "TreeWriter.hh"
 
 class JackTokenizer {
   private:
-    std::ifstream inFile;
+    std::string buffer;         // the file, when reading one
+    std::string_view whole;     // all of the text
+    std::string_view source;    // the part of it being tokenized, up to its end
     char c;
     std::string token;
+    Arena *arena = nullptr;
+    uint32_t id = Interner::NONE;
     enum::tokenType tType;
     uint64_t line = 1;
+    uint64_t offset = 0;        // of the next unread character
+    uint64_t begin = 0;         // of the current token
+
+    int get() {
+      return offset < source.size() ? (unsigned char)source[offset++] : (++offset, EOF);
+    }
+
+    int peek() {
+      return offset < source.size() ? (unsigned char)source[offset] : EOF;
+    }
 
     // There is no '\' operator
     bool isSymbol(char c) {
@@ -40,44 +62,83 @@ class JackTokenizer {
 	    return c != 33 && c != '\n' && (c >= 32 && c <= 126);
 		}
 
+    // Offsets and lines of the source have to fit the 32 bits of a Span
+    void checkSize(uint64_t size) {
+      if (size >= UINT32_MAX)
+        lexicalError("Source is 4 GiB or more, larger than a class can be", 0);
+    }
+
+    void lexicalError(const char *message, uint64_t end) {
+      std::string report = "Lexical error at " + std::to_string(line) + " " + message;
+      if (recover)
+        throw CompileError(message, line, begin, end, report);
+      std::cerr << report << "\n";
+      exit(1);
+    }
+
   public: 
+    bool recover = false;       // throw CompileError rather than exit
+
     JackTokenizer() { }
-    JackTokenizer(std::string path) {
-      init(path);
+    JackTokenizer(const std::string &path, Arena &arena, bool announce = true) {
+      init(path, arena, announce);
     }
 
-    void init(std::string path) {
-      inFile.open(path);
+    // Keywords and identifiers handed out by advance() live in the global
+    // Interner, every other token in arena
+    void init(const std::string &path, Arena &arena, bool announce = true) {
+      ALLOCATION_SCOPE(TOKENIZER);
+      this->arena = &arena;
+      std::ifstream inFile(path, std::ios::binary);
 
-      std::cout << "JackTokenizer: " << path << std::endl;
+      if (announce)
+        std::cout << "JackTokenizer: " << path << std::endl;
 
       if (!inFile) {
         throw std::runtime_error(std::string("Failed to open file: " + path));
       }
+      inFile.seekg(0, std::ios::end);
+      checkSize(inFile.tellg());
+      buffer.resize(inFile.tellg());
+      inFile.seekg(0);
+      inFile.read(&buffer[0], buffer.size());
+      whole = source = buffer;
+    }
 
-      if (inFile.eof()) {
-        throw std::runtime_error(std::string("Empty file: " + path));
-      }
+    // Tokenizes text, which must outlive the tokenizer, from its start
+    void initSource(std::string_view text, Arena &arena) {
+      checkSize(text.size());
+      this->arena = &arena;
+      whole = source = text;
+      seek(0, 1);
     }
 
-    ~JackTokenizer() {
-      inFile.close(); 
+    // Carries on from offset, on line, up to end
+    void seek(uint64_t offset, uint64_t line, uint64_t end = UINT64_MAX) {
+      this->offset = offset;
+      this->line = line;
+      source = whole.substr(0, std::min<uint64_t>(end, whole.size()));
+    }
+
+    // Everything being tokenized, for a prescan
+    std::string_view text() {
+      return whole;
     }
     
     bool hasMoreTokens() {
-      while ((c = inFile.get()) != EOF) {
+      while ((c = get()) != EOF) {
         switch (c) {
           case '/': 
             // Skip comments
-            if (inFile.peek() == '/') {
-              while ((c=inFile.get()) != EOF && c != '\n') 
+            if (peek() == '/') {
+              while ((c=get()) != EOF && c != '\n') 
                 ;
               ++line;
             }
-            else if (inFile.peek() == '*') {
-              while ((c=inFile.get()) != EOF && !(c == '*' && inFile.peek() == '/'))
+            else if (peek() == '*') {
+              while ((c=get()) != EOF && !(c == '*' && peek() == '/'))
                 if (c == '\n') ++line;
-              inFile.get();
+              get();
             }
             else 
               return true; // If '/' is an operator
@@ -96,26 +157,27 @@ class JackTokenizer {
       return false;
     }
 
-    std::string advance() {
+    std::string_view advance() {
+      ALLOCATION_SCOPE(TOKENIZER);
+      begin = offset - 1;
       token.clear();
+      id = Interner::NONE;
       if (isSymbol(c) || c == '/') {
         token = c; 
         tType = tokenType::SYMBOL;
       }
       else if (c == '"') {
-				while ((c=inFile.get())!=EOF && ((c != '"') || token.back()=='\\')) {
+				while ((c=get())!=EOF && ((c != '"') || (!token.empty() && token.back()=='\\'))) {
           token += c;
 				}
-        if (c != '"') {
-          std::cerr << "Lexical error at " << line << " String is not closed\n";
-          exit(1);
-        }
+        if (c != '"')
+          lexicalError("String is not closed", offset - 1);
         tType = tokenType::STR_CONST;
       }
       else if (isAlpha(c)) {
         token += c; 
         // Longest maximal munch
-        while (isAlphaNumeric(inFile.peek()) && (c=inFile.get()))
+        while (isAlphaNumeric(peek()) && (c=get()))
           token += c;
         if (keyWords.count(token)) {
           tType = tokenType::KEYWORD;
@@ -126,11 +188,17 @@ class JackTokenizer {
       }
       else if (isDigit(c)) {
         token += c; 
-        while (isDigit(inFile.peek()) && (c=inFile.get()))
+        while (isDigit(peek()) && (c=get()))
           token += c;
         tType = tokenType::INT_CONST;
       }
-      return token;
+      else
+        lexicalError("Unexpected character", offset);
+      if (tType == tokenType::KEYWORD || tType == tokenType::IDENTIFIER) {
+        id = intern(token);
+        return nameOf(id);
+      }
+      return arena->copy(token);
     }
 
      
@@ -143,6 +211,11 @@ class JackTokenizer {
       return keyWords.at(token);
     }
 
+    // interned id of a keyword or identifier
+    uint32_t tokenId() {
+      return id;
+    }
+
     // return symbol if tokentype is symbol
     char symbol() {
       return c;
@@ -155,24 +228,30 @@ class JackTokenizer {
 
     // return identifier if tokentype is identifier
     int16_t intVal() {
-      /* check the int range */
+      size_t digits = token.size() - std::min(token.find_first_not_of('0'), token.size());
+      if (digits > 5 || std::stoi(token) > 32767)
+        lexicalError("Integer constant is out of range", offset);
       return std::stoi(token);
     }
 
     // return symbol if tokentype is symbol
+    // The current token as XML text
     std::string stringVal() {
-      switch (c) {
-        case '<': return "&lt;";
-        case '>': return "&gt;";
-        case '&': return "&amp;";
-        case '\\': return "&quot;";
-      }
-      return token;
+      return xmlEscape(token);
     }
 
     // For debugging purposes
     uint64_t curLine() {
       return line;
     }
+
+    // Byte offsets [tokenBegin(), tokenEnd()) of the current token
+    uint64_t tokenBegin() {
+      return begin;
+    }
+
+    uint64_t tokenEnd() {
+      return offset;
+    }
 };
 
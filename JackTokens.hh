@@ -1,3 +1,5 @@
+#pragma once
+
 #include <iostream>
 #include <map>
 
@@ -63,6 +65,18 @@ enum class command {
   , NOT
 };
 
+enum class vmOp {
+  PUSH
+  , POP
+  , ARITHMETIC
+  , LABEL
+  , GOTO
+  , IF
+  , CALL
+  , FUNCTION
+  , RETURN
+};
+
 const std::map<std::string, enum::keyWord> keyWords = {
  {"class",        keyWord::CLASS} 
  , {"method"      , keyWord::METHOD}
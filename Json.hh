@@ -0,0 +1,212 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "TreeWriter.hh"
+
+enum class jsonType {
+  NONE
+  , BOOLEAN
+  , NUMBER
+  , STRING
+  , ARRAY
+  , OBJECT
+};
+
+// A parsed JSON value, enough for the messages of the language server
+struct Json {
+  jsonType type = jsonType::NONE;
+  bool boolean = false;
+  double number = 0;
+  std::string text;
+  std::vector<Json> items;
+  std::vector<std::pair<std::string, Json> > members;
+
+  // The member called key, a null value if there is none
+  const Json &operator[](std::string_view key) const {
+    static const Json none;
+    for (const auto &member: members)
+      if (member.first == key)
+        return member.second;
+    return none;
+  }
+
+  bool has(std::string_view key) const {
+    return (*this)[key].type != jsonType::NONE;
+  }
+
+  int64_t integer() const {
+    return (int64_t)number;
+  }
+};
+
+// Appends text as a JSON string
+inline void appendJsonString(std::string &out, std::string_view text) {
+  out += '"';
+  appendEscaped(out, text, escapes().json);
+  out += '"';
+}
+
+/*
+  Recursive descent over the text of one value, false if it is not JSON.
+  Nesting is limited so a hostile message cannot run the stack out.
+*/
+class JsonParser {
+  private:
+    static const int MAX_DEPTH = 256;
+
+    std::string_view text;
+    size_t pos = 0;
+
+    void blanks() {
+      while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t'
+                                   || text[pos] == '\n' || text[pos] == '\r'))
+        ++pos;
+    }
+
+    bool literal(std::string_view word) {
+      if (text.compare(pos, word.size(), word) != 0)
+        return false;
+      pos += word.size();
+      return true;
+    }
+
+    static void appendUtf8(std::string &out, uint32_t c) {
+      if (c < 0x80)
+        out += (char)c;
+      else if (c < 0x800) {
+        out += (char)(0xc0 | c >> 6);
+        out += (char)(0x80 | (c & 0x3f));
+      }
+      else {
+        out += (char)(0xe0 | c >> 12);
+        out += (char)(0x80 | ((c >> 6) & 0x3f));
+        out += (char)(0x80 | (c & 0x3f));
+      }
+    }
+
+    bool string(std::string &out) {
+      if (pos >= text.size() || text[pos] != '"')
+        return false;
+      ++pos;
+      while (pos < text.size() && text[pos] != '"') {
+        char c = text[pos++];
+        if (c != '\\') {
+          out += c;
+          continue;
+        }
+        if (pos >= text.size())
+          return false;
+        switch (text[pos++]) {
+          case '"': out += '"'; break;
+          case '\\': out += '\\'; break;
+          case '/': out += '/'; break;
+          case 'b': out += '\b'; break;
+          case 'f': out += '\f'; break;
+          case 'n': out += '\n'; break;
+          case 'r': out += '\r'; break;
+          case 't': out += '\t'; break;
+          case 'u': {
+            uint32_t code = 0;
+            for (int k = 0; k < 4; ++k, ++pos) {
+              char h = pos < text.size() ? text[pos] : 0;
+              int digit = h >= '0' && h <= '9' ? h - '0'
+                          : h >= 'a' && h <= 'f' ? h - 'a' + 10
+                          : h >= 'A' && h <= 'F' ? h - 'A' + 10 : -1;
+              if (digit < 0)
+                return false;
+              code = code * 16 + digit;
+            }
+            appendUtf8(out, code);
+            break;
+          }
+          default: return false;
+        }
+      }
+      if (pos >= text.size())
+        return false;
+      ++pos;
+      return true;
+    }
+
+    bool value(Json &out, int depth) {
+      if (depth > MAX_DEPTH)
+        return false;
+      blanks();
+      if (pos >= text.size())
+        return false;
+      char c = text[pos];
+      if (c == '{') {
+        out.type = jsonType::OBJECT;
+        ++pos;
+        blanks();
+        if (pos < text.size() && text[pos] == '}') {
+          ++pos;
+          return true;
+        }
+        do {
+          blanks();
+          std::pair<std::string, Json> member;
+          if (!string(member.first))
+            return false;
+          blanks();
+          if (pos >= text.size() || text[pos++] != ':' || !value(member.second, depth + 1))
+            return false;
+          out.members.push_back(std::move(member));
+          blanks();
+        } while (pos < text.size() && text[pos] == ',' && ++pos);
+        return pos < text.size() && text[pos++] == '}';
+      }
+      if (c == '[') {
+        out.type = jsonType::ARRAY;
+        ++pos;
+        blanks();
+        if (pos < text.size() && text[pos] == ']') {
+          ++pos;
+          return true;
+        }
+        do {
+          out.items.emplace_back();
+          if (!value(out.items.back(), depth + 1))
+            return false;
+          blanks();
+        } while (pos < text.size() && text[pos] == ',' && ++pos);
+        return pos < text.size() && text[pos++] == ']';
+      }
+      if (c == '"') {
+        out.type = jsonType::STRING;
+        return string(out.text);
+      }
+      if ((out.boolean = literal("true")) || literal("false")) {
+        out.type = jsonType::BOOLEAN;
+        return true;
+      }
+      if (literal("null"))
+        return true;
+      size_t begin = pos;
+      while (pos < text.size() && (text[pos] == '-' || text[pos] == '+' || text[pos] == '.'
+                                   || text[pos] == 'e' || text[pos] == 'E'
+                                   || (text[pos] >= '0' && text[pos] <= '9')))
+        ++pos;
+      if (pos == begin)
+        return false;
+      out.type = jsonType::NUMBER;
+      out.number = std::strtod(std::string(text.substr(begin, pos - begin)).c_str(), nullptr);
+      return true;
+    }
+
+  public:
+    static bool parse(std::string_view text, Json &out) {
+      JsonParser parser;
+      parser.text = text;
+      if (!parser.value(out, 0))
+        return false;
+      parser.blanks();
+      return parser.pos == text.size();
+    }
+};
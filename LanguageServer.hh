@@ -0,0 +1,814 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <dirent.h>
+
+#include "ClassImage.hh"
+#include "CompilationEngine.hh"
+#include "Json.hh"
+#include "Prescan.hh"
+#include "ProgramIndex.hh"
+
+// A variable the server can jump to, offsets [begin, end) of its name
+struct Declaration {
+  uint32_t name;
+  uint32_t type;
+  enum::kind kind;
+  uint64_t begin;
+  uint64_t end;
+};
+
+// An error in a document, offsets [begin, end)
+struct Diagnostic {
+  uint64_t begin;
+  uint64_t end;
+  std::string message;
+};
+
+/*
+  What one subroutine of a document declares and what is wrong with it.
+  Offsets are relative to the start of its range, an edit before it only
+  moves the range.
+*/
+struct SubroutineInfo {
+  SourceRange range;
+  uint32_t name = Interner::NONE;         // without the class name
+  enum::keyWord kind = keyWord::FUNCTION;
+  uint64_t nArgs = 0;
+  uint64_t nameBegin = 0;
+  uint64_t nameEnd = 0;
+  std::vector<Declaration> vars;          // parameters and locals
+  std::vector<Diagnostic> diagnostics;
+};
+
+// The text of a class and what the server knows about it
+struct Document {
+  std::string uri;
+  std::string path;
+  std::string className;                  // from the file name, as the compiler has it
+  std::string text;
+  bool open = false;                      // by the editor, else read from disk
+  bool split = false;                     // by the prescan, else edits analyze it whole
+  uint64_t nameBegin = 0;                 // of the class name
+  uint64_t nameEnd = 0;
+  uint64_t closing = 0;                   // of the brace closing the class
+  std::vector<Declaration> fields;        // statics and fields
+  std::vector<Diagnostic> diagnostics;    // outside the subroutines
+  std::vector<SubroutineInfo> subroutines;
+  std::unique_ptr<CompilationEngine> header;  // parse of the class declarations
+};
+
+/*
+  Language Server Protocol over stdio: diagnostics, go-to-definition and
+  completion, from the tokenizer, parser and code generator with errors
+  thrown rather than exiting.
+
+  A document is split by the prescan into its subroutines. An edit inside
+  one subroutine scans the braces of that subroutine again and, if they
+  still close it, parses and resolves that subroutine alone and moves the
+  ones after it. Anything else, an edit of the class declarations or one
+  that changes where subroutines start or end, analyzes the class whole.
+*/
+class LanguageServer {
+  private:
+    static const uint64_t MAX_MESSAGE = 64 << 20;   // bytes of a message body
+
+    std::istream &in;
+    std::ostream &out;
+    ProgramIndex index;
+    std::set<std::string> scanned;          // directories in the index
+    std::set<std::string> classNames;       // of every class seen
+    std::map<std::string, std::unique_ptr<Document> > documents;   // by uri
+    std::string astCache;                   // images of the classes read from disk
+    bool shutdown = false;
+
+    // The value of a Content-Length header, false unless it is a decimal
+    // number of at most MAX_MESSAGE
+    static bool contentLength(std::string_view value, uint64_t &length) {
+      while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+        value.remove_prefix(1);
+      while (!value.empty() && (value.back() == ' ' || value.back() == '\r'))
+        value.remove_suffix(1);
+      if (value.empty() || value.size() > 19)
+        return false;
+      length = 0;
+      for (char c: value) {
+        if (c < '0' || c > '9')
+          return false;
+        length = length * 10 + (c - '0');
+      }
+      return length <= MAX_MESSAGE;
+    }
+
+    static bool isWord(char c) {
+      return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+             || c == '_';
+    }
+
+    static std::string pathOf(std::string_view uri) {
+      if (uri.substr(0, 7) == "file://")
+        uri.remove_prefix(7);
+      std::string path;
+      for (size_t i = 0; i < uri.size(); ++i) {
+        if (uri[i] == '%' && i + 2 < uri.size()
+            && isxdigit(uri[i + 1]) && isxdigit(uri[i + 2])) {
+          path += (char)std::stoi(std::string(uri.substr(i + 1, 2)), nullptr, 16);
+          i += 2;
+        }
+        else
+          path += uri[i];
+      }
+      return path;
+    }
+
+    static std::string directoryOf(const std::string &path) {
+      size_t slash = path.find_last_of("/");
+      return slash == std::string::npos ? "." : path.substr(0, slash);
+    }
+
+    // Positions
+
+    // The nearest point before offset whose line is known
+    static void anchor(const Document &doc, uint64_t offset, uint64_t &at, uint64_t &line) {
+      auto it = std::upper_bound(doc.subroutines.begin(), doc.subroutines.end(), offset,
+                                 [](uint64_t o, const SubroutineInfo &s) {
+                                   return o < s.range.begin;
+                                 });
+      at = it == doc.subroutines.begin() ? 0 : (it - 1)->range.begin;
+      line = it == doc.subroutines.begin() ? 1 : (it - 1)->range.line;
+    }
+
+    // LSP lines and characters count from 0, Jack is ASCII so a character is a byte
+    static void position(const Document &doc, uint64_t offset, uint64_t &line,
+                         uint64_t &character) {
+      offset = std::min<uint64_t>(offset, doc.text.size());
+      uint64_t at;
+      anchor(doc, offset, at, line);
+      line += std::count(doc.text.begin() + at, doc.text.begin() + offset, '\n') - 1;
+      uint64_t start = offset;
+      while (start > 0 && doc.text[start - 1] != '\n')
+        --start;
+      character = offset - start;
+    }
+
+    static uint64_t offsetOf(const Document &doc, const Json &position) {
+      uint64_t target = position["line"].integer() + 1;
+      uint64_t character = position["character"].integer();
+      auto it = std::upper_bound(doc.subroutines.begin(), doc.subroutines.end(), target,
+                                 [](uint64_t l, const SubroutineInfo &s) {
+                                   return l < s.range.line;
+                                 });
+      uint64_t p = it == doc.subroutines.begin() ? 0 : (it - 1)->range.begin;
+      uint64_t line = it == doc.subroutines.begin() ? 1 : (it - 1)->range.line;
+      const char *s = doc.text.data();
+      size_t n = doc.text.size();
+      if (line == target) {
+        while (p > 0 && s[p - 1] != '\n')
+          --p;
+      }
+      for (; line < target; ++line) {
+        const char *eol = (const char *)memchr(s + p, '\n', n - p);
+        if (!eol)
+          return n;
+        p = eol - s + 1;
+      }
+      const char *eol = (const char *)memchr(s + p, '\n', n - p);
+      return std::min<uint64_t>(p + character, eol ? eol - s : n);
+    }
+
+    void appendRange(std::string &json, const Document &doc, uint64_t begin, uint64_t end) {
+      uint64_t line, character;
+      position(doc, begin, line, character);
+      json += "{\"start\":{\"line\":" + std::to_string(line)
+              + ",\"character\":" + std::to_string(character) + "},";
+      position(doc, end, line, character);
+      json += "\"end\":{\"line\":" + std::to_string(line)
+              + ",\"character\":" + std::to_string(character) + "}}";
+    }
+
+    // Analysis
+
+    void scanDirectory(const std::string &directory) {
+      if (!scanned.insert(directory).second)
+        return;
+      DIR *dir = opendir(directory.c_str());
+      if (!dir)
+        return;
+      while (struct dirent *entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        size_t dot = name.find_last_of(".");
+        if (dot != std::string::npos && name.substr(dot) == ".jack") {
+          index.addFile(directory + "/" + name);
+          classNames.insert(name.substr(0, dot));
+        }
+      }
+      closedir(dir);
+    }
+
+    // The tokens of text from offset on line, up to end, each with its offsets
+    template <class F>
+    static void tokens(std::string_view text, uint64_t offset, uint64_t line, uint64_t end,
+                       F &&each) {
+      Arena arena;
+      JackTokenizer tokenizer;
+      tokenizer.recover = true;
+      tokenizer.initSource(text, arena);
+      tokenizer.seek(offset, line, end);
+      while (tokenizer.hasMoreTokens()) {
+        std::string_view token = tokenizer.advance();
+        if (!each(token, tokenizer.tokenBegin(), tokenizer.tokenEnd()))
+          return;
+      }
+    }
+
+    // The brace closing the class has to come after the last subroutine
+    // and nothing after it
+    void checkClassEnd(Document &doc, uint64_t from, uint64_t line) {
+      doc.closing = doc.text.size();
+      int n = 0;
+      try {
+        tokens(doc.text, from, line, UINT64_MAX,
+               [&](std::string_view token, uint64_t begin, uint64_t end) {
+          if (n++ == 0) {
+            doc.closing = begin;
+            if (token != "}")
+              doc.diagnostics.push_back({begin, end, "found token: '" + std::string(token)
+                                                     + "', looking for: '}'"});
+            return token == "}";
+          }
+          doc.diagnostics.push_back({begin, end, "found token: '" + std::string(token)
+                                                 + "', looking for: 'end of file'"});
+          return false;
+        });
+      }
+      catch (const CompileError &e) {
+        doc.diagnostics.push_back({e.begin, e.end, e.what()});
+      }
+      if (n == 0)
+        doc.diagnostics.push_back({doc.closing, doc.closing,
+                                   "found token: '', looking for: '}'"});
+    }
+
+    void analyzeSubroutine(Document &doc, size_t i) {
+      SubroutineInfo &sub = doc.subroutines[i];
+      uint64_t base = sub.range.begin;
+      uint64_t end = i + 1 < doc.subroutines.size() ? doc.subroutines[i + 1].range.begin
+                                                     : doc.closing;
+      sub.diagnostics.clear();
+      try {
+        int n = 0;
+        tokens(doc.text, base, sub.range.line, end,
+               [&](std::string_view, uint64_t from, uint64_t to) {
+          if (++n < 3)
+            return true;
+          sub.nameBegin = from - base;
+          sub.nameEnd = to - base;
+          return false;
+        });
+        CompilationEngine engine(doc.text, doc.className, &index);
+        engine.recoverErrors();
+        NodeId id = engine.parseSubroutine(base, sub.range.line, end);
+        const Ast &ast = engine.tree();
+        const SubroutineNode &node = ast.subroutines[id];
+        std::string_view name = nameOf(node.name);
+        sub.name = intern(name.substr(name.find('.') + 1));
+        sub.kind = node.kind;
+        sub.nArgs = 0;
+        sub.vars.clear();
+        for (NodeId var = node.params; var != NIL; var = ast.vars[var].next, ++sub.nArgs)
+          sub.vars.push_back({ast.vars[var].name, ast.vars[var].type, kind::ARG,
+                              ast.vars[var].span.begin - base, ast.vars[var].span.end - base});
+        for (NodeId var = node.locals; var != NIL; var = ast.vars[var].next)
+          sub.vars.push_back({ast.vars[var].name, ast.vars[var].type, kind::VAR,
+                              ast.vars[var].span.begin - base, ast.vars[var].span.end - base});
+        if (doc.header && doc.header->tree().root != NIL)
+          engine.checkSubroutine(doc.header->tree(), id);
+      }
+      catch (const CompileError &e) {
+        // What the last parse that got through declared is kept, for
+        // completion while a statement is half typed
+        sub.diagnostics.push_back({e.begin - base, std::max(e.begin, e.end) - base, e.what()});
+      }
+    }
+
+    void analyze(Document &doc) {
+      doc.subroutines.clear();
+      doc.fields.clear();
+      doc.diagnostics.clear();
+      std::vector<SourceRange> ranges;
+      doc.split = prescan(doc.text, ranges) && !ranges.empty();
+
+      doc.header.reset(new CompilationEngine(doc.text, doc.className, &index));
+      doc.header->recoverErrors();
+      try {
+        if (doc.split)
+          doc.header->parseHeader(ranges.front().begin);
+        else
+          doc.header->parseClass();
+      }
+      catch (const CompileError &e) {
+        doc.diagnostics.push_back({e.begin, std::max(e.begin, e.end), e.what()});
+      }
+      const Ast &ast = doc.header->tree();
+      if (ast.root != NIL)
+        for (NodeId var = ast.classes[ast.root].vars; var != NIL; var = ast.vars[var].next)
+          doc.fields.push_back({ast.vars[var].name, ast.vars[var].type, ast.vars[var].kind,
+                                ast.vars[var].span.begin, ast.vars[var].span.end});
+      int n = 0;
+      try {
+        tokens(doc.text, 0, 1, UINT64_MAX, [&](std::string_view, uint64_t begin, uint64_t end) {
+          doc.nameBegin = begin;
+          doc.nameEnd = end;
+          return ++n < 2;
+        });
+      }
+      catch (const CompileError &) { }
+
+      if (!doc.split)
+        return;
+      checkClassEnd(doc, ranges.back().end, ranges.back().endLine);
+      for (const SourceRange &range: ranges) {
+        doc.subroutines.emplace_back();
+        doc.subroutines.back().range = range;
+      }
+      for (size_t i = 0; i < doc.subroutines.size(); ++i)
+        analyzeSubroutine(doc, i);
+    }
+
+    // After text[begin, end) became inserted. False if only analyzing the
+    // whole class will do.
+    bool analyzeEdit(Document &doc, uint64_t begin, uint64_t end, std::string_view removed,
+                     std::string_view inserted) {
+      if (!doc.split)
+        return false;
+      auto it = std::upper_bound(doc.subroutines.begin(), doc.subroutines.end(), begin,
+                                 [](uint64_t o, const SubroutineInfo &s) {
+                                   return o <= s.range.begin;
+                                 });
+      if (it == doc.subroutines.begin())
+        return false;
+      size_t i = it - doc.subroutines.begin() - 1;
+      bool last = i + 1 == doc.subroutines.size();
+      uint64_t limit = last ? doc.closing : doc.subroutines[i + 1].range.begin;
+      if (end >= limit)
+        return false;
+
+      int64_t delta = (int64_t)inserted.size() - (int64_t)removed.size();
+      int64_t lines = std::count(inserted.begin(), inserted.end(), '\n')
+                      - std::count(removed.begin(), removed.end(), '\n');
+      SubroutineInfo &sub = doc.subroutines[i];
+      std::vector<SourceRange> found;
+      std::string_view piece(doc.text.data() + sub.range.begin,
+                             limit + delta - sub.range.begin);
+      if (!prescan(piece, found, sub.range.line, 1) || found.size() != 1 || found[0].begin != 0)
+        return false;
+      sub.range.end = sub.range.begin + found[0].end;
+      sub.range.endLine = found[0].endLine;
+      for (size_t j = i + 1; j < doc.subroutines.size(); ++j) {
+        SourceRange &range = doc.subroutines[j].range;
+        range.begin += delta;
+        range.end += delta;
+        range.line += lines;
+        range.endLine += lines;
+      }
+      // The class end and its diagnostics are after every subroutine
+      doc.closing += delta;
+      for (Diagnostic &d: doc.diagnostics)
+        if (d.begin >= limit) {
+          d.begin += delta;
+          d.end += delta;
+        }
+
+      uint32_t name = sub.name;
+      enum::keyWord kind = sub.kind;
+      uint64_t nArgs = sub.nArgs;
+      analyzeSubroutine(doc, i);
+      if (name != sub.name || kind != sub.kind || nArgs != sub.nArgs) {
+        // Calls anywhere may have been checked against the old signature
+        index.addSource(doc.text);
+        for (size_t j = 0; j < doc.subroutines.size(); ++j)
+          analyzeSubroutine(doc, j);
+        for (auto &entry: documents)
+          if (entry.second->open && entry.second.get() != &doc) {
+            analyze(*entry.second);
+            publish(*entry.second);
+          }
+      }
+      return true;
+    }
+
+    Document *document(const std::string &uri) {
+      auto it = documents.find(uri);
+      return it == documents.end() ? nullptr : it->second.get();
+    }
+
+    // The document of a class, read from the directory of from if no
+    // document has it
+    Document *classDocument(std::string_view className, const Document &from) {
+      for (auto &entry: documents)
+        if (entry.second->className == className)
+          return entry.second.get();
+      std::string path = directoryOf(from.path) + "/" + std::string(className) + ".jack";
+      std::ifstream file(path, std::ios::binary);
+      if (!file)
+        return nullptr;
+      std::unique_ptr<Document> doc(new Document);
+      doc->uri = "file://" + path;
+      doc->path = path;
+      doc->className = className;
+      doc->text.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+      ClassImage image;
+      if (astCache.empty() || !image.open(astCache, doc->text)
+          || image.name(image.root()) != className || !load(*doc, image)) {
+        analyze(*doc);
+        if (!astCache.empty())
+          writeImage(*doc);
+      }
+      Document *result = doc.get();
+      documents[doc->uri] = std::move(doc);
+      return result;
+    }
+
+    // The index of the token at offset in an image, its count if there is none
+    static uint64_t tokenAt(const ClassImage &image, uint64_t offset) {
+      const ImageToken *tokens = image.section<ImageToken>(imageSection::TOKENS);
+      uint64_t n = image.count(imageSection::TOKENS);
+      const ImageToken *it = std::lower_bound(tokens, tokens + n, offset,
+                                              [](const ImageToken &t, uint64_t o) {
+                                                return t.end <= o;
+                                              });
+      return it - tokens;
+    }
+
+    /*
+      A class read from disk, filled in from its image without a parse.
+      Only classes that parsed get an image, so there is nothing to
+      diagnose and every subroutine is where its span says. False if the
+      image does not hold together with the text, e.g. a class without
+      subroutines, which the prescan does not split.
+    */
+    static bool load(Document &doc, const ClassImage &image) {
+      const ClassNode &node = image.section<ClassNode>(imageSection::CLASSES)[image.root()];
+      const VarNode *vars = image.section<VarNode>(imageSection::VARS);
+      const SubroutineNode *subs = image.section<SubroutineNode>(imageSection::SUBROUTINES);
+      const ImageToken *tokens = image.section<ImageToken>(imageSection::TOKENS);
+      uint64_t nTokens = image.count(imageSection::TOKENS);
+      if (node.subroutines == NIL || nTokens < 2 || node.span.end == 0)
+        return false;
+      auto declaration = [&](const VarNode &var, enum::kind kind, uint64_t base) {
+        return Declaration{intern(image.name(var.name)), intern(image.name(var.type)), kind,
+                           var.span.begin - base, var.span.end - base};
+      };
+      doc.split = true;
+      doc.nameBegin = tokens[1].begin;
+      doc.nameEnd = tokens[1].end;
+      doc.closing = node.span.end - 1;
+      for (NodeId var = node.vars; var != NIL; var = vars[var].next)
+        doc.fields.push_back(declaration(vars[var], vars[var].kind, 0));
+      for (NodeId id = node.subroutines; id != NIL; id = subs[id].next) {
+        const SubroutineNode &sub = subs[id];
+        uint64_t first = tokenAt(image, sub.span.begin), last = tokenAt(image, sub.span.end - 1);
+        if (first + 2 >= nTokens || last >= nTokens || sub.span.end <= sub.span.begin)
+          return false;
+        doc.subroutines.emplace_back();
+        SubroutineInfo &info = doc.subroutines.back();
+        info.range = {sub.span.begin, sub.span.end, sub.span.line, tokens[last].line};
+        std::string_view name = image.name(sub.name);
+        info.name = intern(name.substr(name.find('.') + 1));
+        info.kind = sub.kind;
+        info.nameBegin = tokens[first + 2].begin - sub.span.begin;
+        info.nameEnd = tokens[first + 2].end - sub.span.begin;
+        for (NodeId var = sub.params; var != NIL; var = vars[var].next, ++info.nArgs)
+          info.vars.push_back(declaration(vars[var], kind::ARG, sub.span.begin));
+        for (NodeId var = sub.locals; var != NIL; var = vars[var].next)
+          info.vars.push_back(declaration(vars[var], kind::VAR, sub.span.begin));
+      }
+      return true;
+    }
+
+    // Writes the image of a class that analyzed without errors
+    void writeImage(const Document &doc) {
+      if (!doc.diagnostics.empty())
+        return;
+      for (const SubroutineInfo &sub: doc.subroutines)
+        if (!sub.diagnostics.empty())
+          return;
+      try {
+        CompilationEngine engine(doc.text, doc.className, &index);
+        engine.recoverErrors();
+        engine.parseClass();
+        ClassImage::write(astCache, doc.text, engine.tree());
+      }
+      catch (const std::runtime_error &) {
+        // No image, the class is analyzed again next time
+      }
+    }
+
+    // Lookups
+
+    static const SubroutineInfo *enclosing(const Document &doc, uint64_t offset) {
+      auto it = std::upper_bound(doc.subroutines.begin(), doc.subroutines.end(), offset,
+                                 [](uint64_t o, const SubroutineInfo &s) {
+                                   return o < s.range.begin;
+                                 });
+      if (it == doc.subroutines.begin() || offset > (it - 1)->range.end)
+        return nullptr;
+      return &*(it - 1);
+    }
+
+    // Of a variable visible at offset, with its offsets made absolute
+    static const Declaration *variable(const Document &doc, uint64_t offset, uint32_t name,
+                                       Declaration &found) {
+      if (const SubroutineInfo *sub = enclosing(doc, offset))
+        for (const Declaration &var: sub->vars)
+          if (var.name == name) {
+            found = var;
+            found.begin += sub->range.begin;
+            found.end += sub->range.begin;
+            return &found;
+          }
+      for (const Declaration &field: doc.fields)
+        if (field.name == name)
+          return &(found = field);
+      return nullptr;
+    }
+
+    static const SubroutineInfo *subroutine(const Document &doc, uint32_t name) {
+      for (const SubroutineInfo &sub: doc.subroutines)
+        if (sub.name == name)
+          return &sub;
+      return nullptr;
+    }
+
+    // The word around offset and the one before a '.' ahead of it
+    static void wordAt(const Document &doc, uint64_t offset, uint64_t &begin, uint64_t &end,
+                       std::string_view &qualifier) {
+      const std::string &s = doc.text;
+      begin = end = std::min<uint64_t>(offset, s.size());
+      while (begin > 0 && isWord(s[begin - 1]))
+        --begin;
+      while (end < s.size() && isWord(s[end]))
+        ++end;
+      qualifier = std::string_view();
+      uint64_t p = begin;
+      while (p > 0 && (s[p - 1] == ' ' || s[p - 1] == '\t'))
+        --p;
+      if (p > 0 && s[p - 1] == '.') {
+        uint64_t q = --p;
+        while (q > 0 && isWord(s[q - 1]))
+          --q;
+        qualifier = std::string_view(s).substr(q, p - q);
+      }
+    }
+
+    // The class a qualifier names, or the type of the variable it names
+    std::string_view classOf(const Document &doc, uint64_t offset, std::string_view qualifier,
+                             bool &isObject) {
+      Declaration var;
+      isObject = variable(doc, offset, intern(qualifier), var) != nullptr;
+      return isObject ? nameOf(var.type) : qualifier;
+    }
+
+    // Messages
+
+    void send(const std::string &body) {
+      out << "Content-Length: " << body.size() << "\r\n\r\n" << body;
+      out.flush();
+    }
+
+    // The start of the reply to the request id
+    static std::string reply(const Json &id) {
+      std::string body = "{\"jsonrpc\":\"2.0\",\"id\":";
+      if (id.type == jsonType::STRING)
+        appendJsonString(body, id.text);
+      else
+        body += std::to_string(id.integer());
+      return body;
+    }
+
+    void respond(const Json &id, const std::string &result) {
+      send(reply(id) + ",\"result\":" + result + "}");
+    }
+
+    void publish(const Document &doc) {
+      std::string body = "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/publishDiagnostics\","
+                         "\"params\":{\"uri\":";
+      appendJsonString(body, doc.uri);
+      body += ",\"diagnostics\":[";
+      bool first = true;
+      auto add = [&](const Diagnostic &d, uint64_t base) {
+        body += first ? "{\"range\":" : ",{\"range\":";
+        first = false;
+        appendRange(body, doc, base + d.begin, base + d.end);
+        body += ",\"severity\":1,\"source\":\"jack\",\"message\":";
+        appendJsonString(body, d.message);
+        body += "}";
+      };
+      for (const Diagnostic &d: doc.diagnostics)
+        add(d, 0);
+      for (const SubroutineInfo &sub: doc.subroutines)
+        for (const Diagnostic &d: sub.diagnostics)
+          add(d, sub.range.begin);
+      send(body + "]}}");
+    }
+
+    std::string location(const Document &doc, uint64_t begin, uint64_t end) {
+      std::string json = "{\"uri\":";
+      appendJsonString(json, doc.uri);
+      json += ",\"range\":";
+      appendRange(json, doc, begin, end);
+      return json + "}";
+    }
+
+    std::string definition(Document &doc, uint64_t offset) {
+      uint64_t begin, end;
+      std::string_view qualifier;
+      wordAt(doc, offset, begin, end, qualifier);
+      if (begin == end)
+        return "null";
+      std::string_view word = std::string_view(doc.text).substr(begin, end - begin);
+      uint32_t name = intern(word);
+
+      if (!qualifier.empty()) {
+        bool isObject;
+        std::string_view className = classOf(doc, begin, qualifier, isObject);
+        Document *target = classDocument(className, doc);
+        const SubroutineInfo *sub = target ? subroutine(*target, name) : nullptr;
+        return sub ? location(*target, sub->range.begin + sub->nameBegin,
+                              sub->range.begin + sub->nameEnd) : "null";
+      }
+      Declaration var;
+      if (variable(doc, begin, name, var))
+        return location(doc, var.begin, var.end);
+      if (const SubroutineInfo *sub = subroutine(doc, name))
+        return location(doc, sub->range.begin + sub->nameBegin,
+                        sub->range.begin + sub->nameEnd);
+      if (Document *target = classDocument(word, doc))
+        return location(*target, target->nameBegin, target->nameEnd);
+      return "null";
+    }
+
+    std::string completion(Document &doc, uint64_t offset) {
+      uint64_t begin, end;
+      std::string_view qualifier;
+      wordAt(doc, offset, begin, end, qualifier);
+      std::string_view prefix = std::string_view(doc.text).substr(begin, offset - begin);
+      std::string items;
+      auto add = [&](std::string_view label, int kind, std::string_view detail) {
+        if (label.substr(0, prefix.size()) != prefix)
+          return;
+        items += items.empty() ? "{\"label\":" : ",{\"label\":";
+        appendJsonString(items, label);
+        items += ",\"kind\":" + std::to_string(kind) + ",\"detail\":";
+        appendJsonString(items, detail);
+        items += "}";
+      };
+      // LSP CompletionItemKind
+      auto kindOf = [](enum::keyWord kind) {
+        return kind == keyWord::METHOD ? 2 : kind == keyWord::FUNCTION ? 3 : 4;
+      };
+
+      if (!qualifier.empty()) {
+        bool isObject;
+        std::string_view className = classOf(doc, begin, qualifier, isObject);
+        if (Document *target = classDocument(className, doc))
+          for (const SubroutineInfo &sub: target->subroutines)
+            if ((sub.kind == keyWord::METHOD) == isObject)
+              add(nameOf(sub.name), kindOf(sub.kind), className);
+      }
+      else {
+        if (const SubroutineInfo *sub = enclosing(doc, offset))
+          for (const Declaration &var: sub->vars)
+            add(nameOf(var.name), 6, nameOf(var.type));
+        for (const Declaration &field: doc.fields)
+          add(nameOf(field.name), 5, nameOf(field.type));
+        for (const SubroutineInfo &sub: doc.subroutines)
+          add(nameOf(sub.name), kindOf(sub.kind), doc.className);
+        for (const std::string &className: classNames)
+          add(className, 7, "class");
+      }
+      return "{\"isIncomplete\":false,\"items\":[" + items + "]}";
+    }
+
+    void didOpen(const Json &item) {
+      std::unique_ptr<Document> doc(new Document);
+      doc->uri = item["uri"].text;
+      doc->path = pathOf(doc->uri);
+      std::string file = doc->path.substr(doc->path.find_last_of("/") + 1);
+      doc->className = file.substr(0, file.find_last_of("."));
+      doc->text = item["text"].text;
+      doc->open = true;
+      // A copy read from disk is out of date now
+      for (auto it = documents.begin(); it != documents.end(); )
+        it = it->second->className == doc->className ? documents.erase(it) : ++it;
+      scanDirectory(directoryOf(doc->path));
+      classNames.insert(doc->className);
+      index.addSource(doc->text);
+      analyze(*doc);
+      publish(*doc);
+      documents[doc->uri] = std::move(doc);
+    }
+
+    void didChange(Document &doc, const Json &changes) {
+      for (const Json &change: changes.items) {
+        if (!change.has("range")) {
+          doc.text = change["text"].text;
+          analyze(doc);
+          continue;
+        }
+        uint64_t begin = offsetOf(doc, change["range"]["start"]);
+        uint64_t end = std::max(begin, offsetOf(doc, change["range"]["end"]));
+        std::string removed = doc.text.substr(begin, end - begin);
+        const std::string &inserted = change["text"].text;
+        doc.text.replace(begin, end - begin, inserted);
+        if (!analyzeEdit(doc, begin, end, removed, inserted))
+          analyze(doc);
+      }
+      publish(doc);
+    }
+
+  public:
+    // Classes read from disk are kept as images in astCache, unless it is empty
+    LanguageServer(std::istream &in, std::ostream &out, const std::string &astCache = "")
+      : in(in), out(out), astCache(astCache) { }
+
+    // One message from the client
+    void handle(const Json &message) {
+      const std::string &method = message["method"].text;
+      const Json &params = message["params"];
+      const Json &id = message["id"];
+      Document *doc = document(params["textDocument"]["uri"].text);
+
+      if (method == "initialize")
+        respond(id, "{\"capabilities\":{\"textDocumentSync\":{\"openClose\":true,\"change\":2},"
+                    "\"definitionProvider\":true,"
+                    "\"completionProvider\":{\"triggerCharacters\":[\".\"]}},"
+                    "\"serverInfo\":{\"name\":\"JackCompiler\"}}");
+      else if (method == "shutdown") {
+        shutdown = true;
+        respond(id, "null");
+      }
+      else if (method == "textDocument/didOpen")
+        didOpen(params["textDocument"]);
+      else if (method == "textDocument/didChange" && doc)
+        didChange(*doc, params["contentChanges"]);
+      else if (method == "textDocument/didClose" && doc) {
+        std::string uri = doc->uri;
+        doc->diagnostics.clear();
+        doc->subroutines.clear();
+        publish(*doc);
+        documents.erase(uri);
+      }
+      else if (method == "textDocument/definition")
+        respond(id, doc ? definition(*doc, offsetOf(*doc, params["position"])) : "null");
+      else if (method == "textDocument/completion")
+        respond(id, doc ? completion(*doc, offsetOf(*doc, params["position"])) : "null");
+      else if (id.type != jsonType::NONE)
+        send(reply(id) + ",\"error\":{\"code\":-32601,\"message\":\"method not found\"}}");
+    }
+
+    /*
+      Until the client says exit, 0 if it asked for a shutdown first. A
+      message whose body is longer than MAX_MESSAGE is skipped unread. The
+      end of one whose Content-Length is not a number cannot be found, so
+      only its header is dropped.
+    */
+    int run() {
+      for (;;) {
+        uint64_t length = 0;
+        bool valid = true;
+        std::string line;
+        while (std::getline(in, line) && line != "\r" && !line.empty())
+          if (line.compare(0, 15, "Content-Length:") == 0)
+            valid = contentLength(std::string_view(line).substr(15), length);
+        if (!in)
+          return 1;
+        if (!valid) {
+          std::cerr << "LanguageServer: bad Content-Length" << std::endl;
+          if (length > MAX_MESSAGE)
+            in.ignore(length);
+          continue;
+        }
+        std::string body(length, '\0');
+        in.read(&body[0], length);
+        Json message;
+        if (!in || !JsonParser::parse(body, message)) {
+          std::cerr << "LanguageServer: bad message" << std::endl;
+          continue;
+        }
+        if (message["method"].text == "exit")
+          return shutdown ? 0 : 1;
+        handle(message);
+      }
+    }
+};
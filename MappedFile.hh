@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <string>
+#include <string_view>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+  A file mapped read only, for a source read front to back that need not
+  fit in memory. Pages the reader is done with can be released: they leave
+  the resident set and are read back in, from the page cache, only if
+  touched again.
+*/
+class MappedFile {
+  private:
+    static const uint64_t STEP = 1 << 20;   // released at least this much at a time
+
+    const char *data = nullptr;
+    uint64_t size = 0;
+    uint64_t released = 0;
+
+  public:
+    MappedFile() { }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+      close();
+    }
+
+    // false if path cannot be read, an empty file maps to empty text
+    bool open(const std::string &path) {
+      close();
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0)
+        return false;
+      struct stat st;
+      bool opened = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+      if (opened && st.st_size > 0) {
+        void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        opened = p != MAP_FAILED;
+        if (opened) {
+          data = (const char *)p;
+          size = st.st_size;
+          madvise(p, size, MADV_SEQUENTIAL);
+        }
+      }
+      ::close(fd);
+      return opened;
+    }
+
+    void close() {
+      if (data)
+        munmap((void *)data, size);
+      data = nullptr;
+      size = 0;
+      released = 0;
+    }
+
+    std::string_view text() const {
+      return std::string_view(data, size);
+    }
+
+    // The whole pages before offset are no longer needed. An offset before
+    // the last one starts another pass over the file.
+    void release(uint64_t offset) {
+      uint64_t page = sysconf(_SC_PAGESIZE);
+      uint64_t end = std::min(offset, size) / page * page;
+      if (end < released)
+        released = 0;
+      if (!data || end < released + STEP)
+        return;
+      madvise((void *)(data + released), end - released, MADV_DONTNEED);
+      released = end;
+    }
+};
@@ -0,0 +1,556 @@
+#pragma once
+
+#include <iostream>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+#include "ConstEvaluator.hh"
+#include "Options.hh"
+#include "ProgramIndex.hh"
+#include "VMCode.hh"
+
+// Passes over the VM code of the whole program, run before anything is written
+class Optimizer {
+  private:
+    typedef std::vector<uint64_t> BitSet;
+
+    Options options;
+    std::vector<VMClass> &program;
+    const ProgramIndex &programIndex;
+
+    uint64_t localsBefore = 0;
+    uint64_t localsAfter = 0;
+    uint64_t staticsRemoved = 0;
+    uint64_t voidPushesRemoved = 0;
+    uint64_t prologueRemoved = 0;
+    uint64_t callsFolded = 0;
+    std::map<std::string, std::set<int64_t> > streamedStatics;   // by class, for --stream
+
+    // A constant computed by the straight line code in [begin, end)
+    struct Constant {
+      size_t begin;
+      size_t end;
+      bool known;
+      int16_t value;
+    };
+
+    struct Fold {
+      size_t end;
+      int16_t value;
+    };
+
+    static bool test(const BitSet &set, uint64_t i) {
+      return (set[i / 64] >> (i % 64)) & 1;
+    }
+
+    static void set(BitSet &set, uint64_t i) {
+      set[i / 64] |= uint64_t(1) << (i % 64);
+    }
+
+    static void reset(BitSet &set, uint64_t i) {
+      set[i / 64] &= ~(uint64_t(1) << (i % 64));
+    }
+
+    static bool isLocal(const VMCommand &c, vmOp op) {
+      return c.op == op && c.seg == segment::LOCAL;
+    }
+
+    /*
+      Liveness over the function's control flow graph, then a greedy colouring
+      of the interference graph. Locals whose lifetimes never overlap share a
+      slot, locals that are never touched get none. Every slot is still zero at
+      entry, so locals read before being written (live at entry) interfere with
+      each other and with every local written while they are live.
+    */
+    void packLocals(VMCode &code, VMRange range) {
+      uint64_t nVars = code[range.begin].index;
+      size_t begin = range.begin + 1, end = range.end;
+      size_t words = (nVars + 63) / 64;
+      if (nVars == 0)
+        return;
+
+      std::unordered_map<uint32_t, size_t> labels;
+      for (size_t i = begin; i < end; ++i)
+        if (code[i].op == vmOp::LABEL)
+          labels[code[i].name] = i;
+
+      std::vector<BitSet> liveIn(end - begin + 1, BitSet(words, 0));
+      auto liveOut = [&](size_t i, BitSet &out) {
+        std::fill(out.begin(), out.end(), 0);
+        auto merge = [&](size_t succ) {
+          for (size_t w = 0; w < words; ++w)
+            out[w] |= liveIn[succ - begin][w];
+        };
+        switch (code[i].op) {
+          case vmOp::RETURN:
+            break;
+          case vmOp::GOTO:
+            merge(labels.at(code[i].name));
+            break;
+          case vmOp::IF:
+            merge(labels.at(code[i].name));
+            merge(i + 1);
+            break;
+          default:
+            merge(i + 1);
+        }
+      };
+
+      BitSet out(words), in(words);
+      bool changed = true;
+      while (changed) {
+        changed = false;
+        for (size_t i = end; i-- > begin; ) {
+          liveOut(i, out);
+          in = out;
+          if (isLocal(code[i], vmOp::POP))
+            reset(in, code[i].index);
+          if (isLocal(code[i], vmOp::PUSH))
+            set(in, code[i].index);
+          if (in != liveIn[i - begin]) {
+            liveIn[i - begin] = in;
+            changed = true;
+          }
+        }
+      }
+
+      std::vector<BitSet> interferes(nVars, BitSet(words, 0));
+      std::vector<bool> used(nVars, false);
+      auto addEdge = [&](uint64_t a, uint64_t b) {
+        if (a != b) {
+          set(interferes[a], b);
+          set(interferes[b], a);
+        }
+      };
+      const BitSet &entry = liveIn[0];
+      for (uint64_t a = 0; a < nVars; ++a)
+        for (uint64_t b = a + 1; test(entry, a) && b < nVars; ++b)
+          if (test(entry, b))
+            addEdge(a, b);
+      for (size_t i = begin; i < end; ++i) {
+        if (code[i].op != vmOp::PUSH && code[i].op != vmOp::POP)
+          continue;
+        if (code[i].seg != segment::LOCAL)
+          continue;
+        used[code[i].index] = true;
+        if (code[i].op == vmOp::POP) {
+          liveOut(i, out);
+          for (uint64_t b = 0; b < nVars; ++b)
+            if (test(out, b))
+              addEdge(code[i].index, b);
+        }
+      }
+
+      std::vector<int64_t> slot(nVars, -1);
+      uint64_t slots = 0;
+      for (uint64_t a = 0; a < nVars; ++a) {
+        if (!used[a])
+          continue;
+        std::vector<bool> taken(slots, false);
+        for (uint64_t b = 0; b < nVars; ++b)
+          if (slot[b] >= 0 && test(interferes[a], b))
+            taken[slot[b]] = true;
+        uint64_t s = 0;
+        while (s < slots && taken[s])
+          ++s;
+        slot[a] = s;
+        if (s == slots)
+          ++slots;
+      }
+
+      for (size_t i = begin; i < end; ++i)
+        if (isLocal(code[i], vmOp::PUSH) || isLocal(code[i], vmOp::POP))
+          code[i].index = slot[code[i].index];
+      code[range.begin].index = slots;
+
+      localsBefore += nVars;
+      localsAfter += slots;
+      if (options.stats)
+        std::cout << "Optimizer: " << nameOf(code[range.begin].name) << " locals "
+                  << nVars << " -> " << slots << std::endl;
+    }
+
+    /*
+      Statics are private to their class, so a static that is never pushed in
+      its own class is never read. Its stores are dropped (with the constant
+      they store) or turned into a pop to temp, and the statics left are
+      renumbered from 0 so the VM translator only maps the ones that are read.
+    */
+    void packStatics(VMClass &vmClass) {
+      VMCode &code = vmClass.code;
+      std::set<int64_t> read, written;
+      for (const VMCommand &c: code) {
+        if (c.seg == segment::STATIC && c.op == vmOp::PUSH)
+          read.insert(c.index);
+        else if (c.seg == segment::STATIC && c.op == vmOp::POP)
+          written.insert(c.index);
+      }
+
+      std::map<int64_t, int64_t> index;
+      for (int64_t i: read) {
+        int64_t next = index.size();
+        index[i] = next;
+      }
+
+      VMCode packed;
+      packed.reserve(code.size());
+      for (const VMCommand &c: code) {
+        if (c.seg == segment::STATIC && (c.op == vmOp::PUSH || c.op == vmOp::POP)) {
+          if (index.count(c.index)) {
+            packed.push_back(c);
+            packed.back().index = index[c.index];
+          }
+          else if (!packed.empty() && packed.back().op == vmOp::PUSH
+                   && packed.back().seg == segment::CONSTANT) {
+            packed.pop_back();
+          }
+          else {
+            packed.push_back(c);
+            packed.back().seg = segment::TEMP;
+            packed.back().index = 0;
+          }
+          continue;
+        }
+        packed.push_back(c);
+      }
+      code.swap(packed);
+
+      for (int64_t i: written)
+        if (!read.count(i)) {
+          ++staticsRemoved;
+          if (options.stats)
+            std::cout << "Optimizer: " << vmClass.name << " static " << i
+                      << " is never read, removed" << std::endl;
+        }
+    }
+
+    static void staticsUsed(const VMCode &code, std::set<int64_t> &used) {
+      for (const VMCommand &c: code)
+        if (c.seg == segment::STATIC && (c.op == vmOp::PUSH || c.op == vmOp::POP))
+          used.insert(c.index);
+    }
+
+    // The VM translator maps every static of the program into RAM[16..255],
+    // used holds the static words of each class. false if they overflow it.
+    bool checkStaticBudget(const std::vector<std::pair<std::string, uint64_t> > &used) {
+      uint64_t total = 0;
+      for (const auto &vmClass: used)
+        total += vmClass.second;
+      if (options.stats || total > options.staticBudget) {
+        std::ostream &out = total > options.staticBudget ? std::cerr : std::cout;
+        for (const auto &vmClass: used)
+          out << "Optimizer: " << vmClass.first << " uses "
+              << vmClass.second << " static words" << std::endl;
+        out << "Optimizer: statics " << total << " / " << options.staticBudget
+            << " words" << std::endl;
+      }
+      if (total > options.staticBudget) {
+        std::cerr << "Static segment overflow: the program uses " << total
+                  << " static words, only " << options.staticBudget
+                  << " are available" << std::endl;
+        return false;
+      }
+      return true;
+    }
+
+    /*
+      The VM return always hands the top of the stack back to the caller, so a
+      void subroutine only needs its push constant 0 when a caller reads the
+      value. The OS can only call Main.main, and discards it. Callers keep their
+      pop temp 0: return always leaves one word on the caller's stack.
+    */
+    void elideVoidReturns() {
+      std::set<uint32_t> valueUsed;
+      for (const VMClass &vmClass: program) {
+        const VMCode &code = vmClass.code;
+        for (size_t i = 0; i < code.size(); ++i) {
+          if (code[i].op != vmOp::CALL)
+            continue;
+          bool discarded = i + 1 < code.size() && code[i+1].op == vmOp::POP
+                            && code[i+1].seg == segment::TEMP;
+          if (!discarded)
+            valueUsed.insert(code[i].name);
+        }
+      }
+
+      for (VMClass &vmClass: program) {
+        VMCode &code = vmClass.code;
+        std::vector<bool> drop(code.size(), false);
+        for (VMRange range: functionRanges(code)) {
+          const Signature *signature = programIndex.find(code[range.begin].name);
+          if (!signature || signature->returnType != intern("void")
+              || valueUsed.count(signature->name))
+            continue;
+          for (size_t i = range.begin + 1; i + 1 < range.end; ++i) {
+            if (code[i].op == vmOp::PUSH && code[i].seg == segment::CONSTANT
+                && code[i].index == 0 && code[i+1].op == vmOp::RETURN) {
+              drop[i] = true;
+              ++voidPushesRemoved;
+            }
+          }
+        }
+        VMCode elided;
+        elided.reserve(code.size());
+        for (size_t i = 0; i < code.size(); ++i)
+          if (!drop[i])
+            elided.push_back(std::move(code[i]));
+        code.swap(elided);
+      }
+    }
+
+    static bool is(const VMCommand &c, vmOp op, enum::segment seg, int64_t index) {
+      return c.op == op && c.seg == seg && c.index == index;
+    }
+
+    static bool usesThis(const VMCode &code, size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        if (code[i].op != vmOp::PUSH && code[i].op != vmOp::POP)
+          continue;
+        if (code[i].seg == segment::THIS
+            || (code[i].seg == segment::POINTER && code[i].index == 0))
+          return true;
+      }
+      return false;
+    }
+
+    /*
+      A method that never touches a field, this, or a method of its own class
+      does not need pointer 0. A constructor that never does skips the
+      Memory.alloc, one that returns this of a class without fields allocates
+      one word, Memory.alloc(0) is an error in the OS.
+    */
+    void elidePrologues(VMClass &vmClass) {
+      VMCode &code = vmClass.code;
+      std::vector<bool> drop(code.size(), false);
+      for (VMRange range: functionRanges(code)) {
+        const Signature *signature = programIndex.find(code[range.begin].name);
+        size_t b = range.begin;
+        if (!signature)
+          continue;
+        uint64_t removed = 0;
+        if (signature->kind == keyWord::METHOD && b + 2 < range.end
+            && is(code[b+1], vmOp::PUSH, segment::ARGUMENT, 0)
+            && is(code[b+2], vmOp::POP, segment::POINTER, 0)
+            && !usesThis(code, b + 3, range.end)) {
+          drop[b+1] = drop[b+2] = true;
+          removed = 2;
+        }
+        else if (signature->kind == keyWord::CONSTRUCTOR && b + 3 < range.end
+            && code[b+1].op == vmOp::PUSH && code[b+1].seg == segment::CONSTANT
+            && code[b+2].op == vmOp::CALL && code[b+2].name == intern("Memory.alloc")
+            && is(code[b+3], vmOp::POP, segment::POINTER, 0)) {
+          if (!usesThis(code, b + 4, range.end)) {
+            drop[b+1] = drop[b+2] = drop[b+3] = true;
+            removed = 3;
+          }
+          else if (code[b+1].index == 0)
+            code[b+1].index = 1;
+        }
+        prologueRemoved += removed;
+        if (removed && options.stats)
+          std::cout << "Optimizer: " << nameOf(code[b].name) << " does not use this, "
+                    << removed << " prologue commands removed" << std::endl;
+      }
+      VMCode elided;
+      elided.reserve(code.size());
+      for (size_t i = 0; i < code.size(); ++i)
+        if (!drop[i])
+          elided.push_back(std::move(code[i]));
+      code.swap(elided);
+    }
+
+    static void pushConstant(VMCode &code, int16_t value) {
+      VMCommand c;
+      c.op = vmOp::PUSH;
+      c.seg = segment::CONSTANT;
+      c.index = value < 0 ? -(int32_t)value - 1 : value;
+      code.push_back(c);
+      if (value < 0) {
+        // ~x is -x-1, which also reaches -32768
+        c.op = vmOp::ARITHMETIC;
+        c.cmd = command::NOT;
+        code.push_back(c);
+      }
+    }
+
+    /*
+      Tracks which values on the stack are constants between two labels. A
+      call whose arguments are all constants is run by the ConstEvaluator and,
+      when it returns, the call and the code of its arguments are replaced by
+      the result. Nothing is rewritten before every class has been scanned.
+    */
+    std::map<size_t, Fold> findFolds(const VMCode &code, ConstEvaluator &evaluator) {
+      std::map<size_t, Fold> folds;
+      std::vector<Constant> stack;
+      auto pop = [&](size_t n) {
+        stack.resize(stack.size() > n ? stack.size() - n : 0);
+      };
+      for (size_t i = 0; i < code.size(); ++i) {
+        const VMCommand &c = code[i];
+        switch (c.op) {
+          case vmOp::PUSH:
+            stack.push_back({i, i + 1, c.seg == segment::CONSTANT, (int16_t)c.index});
+            break;
+          case vmOp::POP:
+            pop(1);
+            break;
+          case vmOp::ARITHMETIC:
+            if (c.cmd == command::NEG || c.cmd == command::NOT) {
+              if (!stack.empty() && stack.back().known && stack.back().end == i) {
+                int16_t x = stack.back().value;
+                stack.back().value = c.cmd == command::NEG ? -x : ~x;
+                stack.back().end = i + 1;
+              }
+              else {
+                pop(1);
+                stack.push_back({i, i + 1, false, 0});
+              }
+            }
+            else {
+              pop(2);
+              stack.push_back({i, i + 1, false, 0});
+            }
+            break;
+          case vmOp::CALL: {
+            bool constant = stack.size() >= (size_t)c.index;
+            size_t next = i;
+            std::vector<int16_t> args;
+            for (size_t a = stack.size() - c.index; constant && a < stack.size(); ++a) {
+              constant = stack[a].known && (a == stack.size() - c.index
+                                            || stack[a].begin == stack[a-1].end);
+              args.push_back(stack[a].value);
+            }
+            if (constant && c.index > 0)
+              next = stack[stack.size() - c.index].begin;
+            constant = constant && (c.index == 0 || stack.back().end == i);
+            int16_t value;
+            if (constant && evaluator.evaluate(c.name, args, value)) {
+              folds[next] = {i + 1, value};
+              pop(c.index);
+              stack.push_back({next, i + 1, true, value});
+            }
+            else {
+              pop(c.index);
+              stack.push_back({i, i + 1, false, 0});
+            }
+            break;
+          }
+          default:
+            // Labels can be reached from elsewhere, jumps and returns end the line
+            stack.clear();
+        }
+      }
+      return folds;
+    }
+
+    void applyFolds(VMCode &code, const std::map<size_t, Fold> &folds) {
+      VMCode folded;
+      folded.reserve(code.size());
+      for (size_t i = 0; i < code.size(); ) {
+        auto fold = folds.find(i);
+        if (fold == folds.end()) {
+          folded.push_back(std::move(code[i++]));
+          continue;
+        }
+        // The outermost call starting here covers the calls nested in it
+        pushConstant(folded, fold->second.value);
+        i = fold->second.end;
+        ++callsFolded;
+      }
+      code.swap(folded);
+    }
+
+    void reportLocals() {
+      if (options.stats)
+        std::cout << "Optimizer: locals " << localsBefore << " -> " << localsAfter
+                  << ", " << localsBefore - localsAfter
+                  << " fewer stack words pushed per frame" << std::endl;
+    }
+
+    void reportPrologues() {
+      if (options.stats)
+        std::cout << "Optimizer: " << prologueRemoved
+                  << " prologue commands removed" << std::endl;
+    }
+
+  public:
+    Optimizer(const Options &options, std::vector<VMClass> &program,
+              const ProgramIndex &programIndex)
+      : options(options), program(program), programIndex(programIndex) { }
+
+    void run() {
+      if (options.evalBudget) {
+        std::vector<std::map<size_t, Fold> > folds;
+        ConstEvaluator evaluator(program, options.evalBudget);
+        for (VMClass &vmClass: program)
+          folds.push_back(findFolds(vmClass.code, evaluator));
+        for (size_t i = 0; i < program.size(); ++i)
+          applyFolds(program[i].code, folds[i]);
+        if (options.stats)
+          std::cout << "Optimizer: " << callsFolded << " calls folded to constants, "
+                    << evaluator.evaluated << " evaluated at compile time" << std::endl;
+      }
+      if (options.packLocals) {
+        for (VMClass &vmClass: program)
+          for (VMRange range: functionRanges(vmClass.code))
+            packLocals(vmClass.code, range);
+        reportLocals();
+      }
+      if (options.packStatics) {
+        for (VMClass &vmClass: program)
+          packStatics(vmClass);
+        if (options.stats)
+          std::cout << "Optimizer: " << staticsRemoved << " write only statics removed"
+                    << std::endl;
+      }
+      if (options.prologues) {
+        for (VMClass &vmClass: program)
+          elidePrologues(vmClass);
+        reportPrologues();
+      }
+      if (options.voidReturns) {
+        elideVoidReturns();
+        if (options.stats)
+          std::cout << "Optimizer: " << voidPushesRemoved
+                    << " push constant 0 removed from void returns" << std::endl;
+      }
+      std::vector<std::pair<std::string, uint64_t> > used;
+      for (const VMClass &vmClass: program) {
+        std::set<int64_t> statics;
+        staticsUsed(vmClass.code, statics);
+        used.push_back({vmClass.name, statics.size()});
+      }
+      if (!checkStaticBudget(used))
+        exit(1);
+    }
+
+    /*
+      --stream: the passes that see one function at a time, run on each
+      subroutine as soon as it is generated, in place of run(). Constant
+      folding, static packing and void returns need the whole program and
+      are left out. The statics of the function are noted for the budget.
+    */
+    void optimizeFunction(VMClass &function) {
+      if (options.packLocals)
+        for (VMRange range: functionRanges(function.code))
+          packLocals(function.code, range);
+      if (options.prologues)
+        elidePrologues(function);
+      staticsUsed(function.code, streamedStatics[function.name]);
+    }
+
+    // Once every function has been through optimizeFunction(), false if the
+    // statics overflow the budget
+    bool finishFunctions() {
+      if (options.packLocals)
+        reportLocals();
+      if (options.prologues)
+        reportPrologues();
+      std::vector<std::pair<std::string, uint64_t> > used;
+      for (const auto &vmClass: streamedStatics)
+        used.push_back({vmClass.first, vmClass.second.size()});
+      return checkStaticBudget(used);
+    }
+};
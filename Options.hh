@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+// Command line switches shared by the drivers and the passes
+struct Options {
+  bool packLocals = false;   // --pack-locals: share local slots between disjoint lifetimes
+  bool packStatics = false;  // --pack-statics: drop statics that are never read
+  uint64_t staticBudget = 240; // --static-budget N: words of RAM[16..255] the statics may use
+  bool voidReturns = false;  // --void-returns: void subroutines whose callers all discard
+                             // the result return without pushing 0
+  bool prologues = false;    // --prologues: skip the this setup of subroutines not using it
+  uint64_t evalBudget = 0;   // --eval-budget N: steps a constant call may run at compile time,
+                             // 0 never runs them
+  bool allocReport = false;  // --alloc-report: arena allocations against the mallocs behind them
+  bool stats = false;        // --stats: print what every pass changed
+  unsigned jobs = 1;         // --jobs N: workers generating the subroutines of a class
+  std::string incremental;   // --incremental DIR: reuse the code of unchanged subroutines
+                             // cached in DIR
+  bool explain = false;      // --explain: print which subroutines were rebuilt and why
+  bool xml = false;          // --xml: write the parse tree of each class next to its .vm
+  bool json = false;         // --json: the same, as JSON
+  bool timeReport = false;   // --time-report: time and count the phases of each file
+  std::string trace;         // --trace FILE: the phases as Chrome trace JSON, implies
+                             // --time-report
+  std::string astCache;      // --ast-cache DIR: keep the parse of each class in DIR, mapped
+                             // back in rather than parsed when the source is unchanged
+  bool stream = false;       // --stream: compile, optimize and write each class a subroutine
+                             // at a time, in memory bounded by the largest subroutine,
+                             // for classes below 4 GiB.
+                             // Only the passes over one function run, --jobs,
+                             // --incremental and --ast-cache do not apply
+};
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <string.h>
+#include <string_view>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+const size_t PRESCAN_BLOCK = 16;
+
+// One bit per byte of the block at p: stops are '/', '"', '{' and '}'
+inline void prescanBlock(const char *p, uint32_t &stops, uint32_t &newlines) {
+  __m128i v = _mm_loadu_si128((const __m128i *)p);
+  auto equal = [&](char c) { return _mm_cmpeq_epi8(v, _mm_set1_epi8(c)); };
+  stops = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(equal('/'), equal('"')),
+                                         _mm_or_si128(equal('{'), equal('}'))));
+  newlines = _mm_movemask_epi8(equal('\n'));
+}
+#else
+const size_t PRESCAN_BLOCK = 8;
+
+// 0x80 in each byte of word equal to c, 0 in every other byte
+inline uint64_t bytesEqual(uint64_t word, char c) {
+  const uint64_t low7 = 0x7f7f7f7f7f7f7f7full;
+  uint64_t x = word ^ (0x0101010101010101ull * (unsigned char)c);
+  return ~(((x & low7) + low7) | x | low7);
+}
+
+// The 0x80 bits of a little endian word gathered into one bit per byte
+inline uint32_t gatherBytes(uint64_t mask) {
+  return ((mask >> 7) * 0x0102040810204080ull) >> 56;
+}
+
+inline void prescanBlock(const char *p, uint32_t &stops, uint32_t &newlines) {
+  uint64_t word;
+  memcpy(&word, p, 8);
+  stops = gatherBytes(bytesEqual(word, '/') | bytesEqual(word, '"')
+                      | bytesEqual(word, '{') | bytesEqual(word, '}'));
+  newlines = gatherBytes(bytesEqual(word, '\n'));
+}
+#endif
+
+// [begin, end) byte offsets of a piece of source, from line to endLine
+struct SourceRange {
+  uint64_t begin;
+  uint64_t end;
+  uint64_t line;
+  uint64_t endLine;
+};
+
+/*
+  Finds the subroutines of a class without tokenizing it: each starts at a
+  constructor|function|method keyword at brace depth one and ends with the
+  brace that closes its body. Comments and string literals are skipped the
+  way JackTokenizer skips them, so braces inside them do not count. Within
+  a subroutine the source is read a block at a time, nested braces are
+  counted in place, and it stops only at '/', '"' and the brace that ends
+  the body. Newlines are counted by popcount.
+
+  Returns false if the braces do not balance, the caller then parses the
+  class the ordinary way and reports the error.
+
+  A piece of a class body can be scanned too, starting on line at brace
+  depth one, it has to end at the depth it started at.
+*/
+inline bool prescan(std::string_view source, std::vector<SourceRange> &subroutines,
+                    uint64_t line = 1, int64_t depth = 0) {
+  // Bytes that may change the state of the scan
+  static const struct Table {
+    bool special[256] = {};
+    Table() {
+      for (unsigned char c: std::string_view("\n/\"{}"))
+        special[c] = true;
+    }
+  } table;
+  auto isWord = [](char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+           || c == '_';
+  };
+  auto keywordAt = [&](size_t i) -> size_t {
+    if (source[i] != 'c' && source[i] != 'f' && source[i] != 'm')
+      return 0;
+    for (std::string_view word: {"constructor", "function", "method"})
+      if (source.compare(i, word.size(), word) == 0
+          && (i + word.size() == source.size() || !isWord(source[i + word.size()]))
+          && (i == 0 || !isWord(source[i - 1])))
+        return word.size();
+    return 0;
+  };
+
+  const char *s = source.data();
+  size_t n = source.size();
+  const int64_t start = depth;
+  bool inSubroutine = false;
+  SourceRange range = {0, 0, 0, 0};
+  for (size_t i = 0; i < n; ) {
+    if (depth != 1 || inSubroutine) {
+      for (uint32_t stops, newlines; i + PRESCAN_BLOCK <= n; i += PRESCAN_BLOCK) {
+        prescanBlock(s + i, stops, newlines);
+        // Braces that keep the scan inside a body are taken here
+        while (stops) {
+          char c = s[i + __builtin_ctz(stops)];
+          if (c == '{' && depth >= 1)
+            ++depth;
+          else if (c == '}' && depth > 2)
+            --depth;
+          else
+            break;
+          stops &= stops - 1;
+        }
+        if (stops) {
+          int k = __builtin_ctz(stops);
+          line += __builtin_popcount(newlines & ((1u << k) - 1));
+          i += k;
+          break;
+        }
+        line += __builtin_popcount(newlines);
+      }
+      if (i >= n)
+        break;
+    }
+    unsigned char c = s[i];
+    if (!table.special[c]) {
+      size_t length;
+      if (depth == 1 && !inSubroutine && (length = keywordAt(i))) {
+        range = {i, 0, line, 0};
+        inSubroutine = true;
+        i += length;
+      }
+      else
+        ++i;
+      continue;
+    }
+    switch (c) {
+      case '\n':
+        ++line;
+        ++i;
+        break;
+      case '/':
+        if (i + 1 < n && s[i + 1] == '/') {
+          const char *eol = (const char *)memchr(s + i, '\n', n - i);
+          i = eol ? eol - s + 1 : n;
+          ++line;
+        }
+        else if (i + 1 < n && s[i + 1] == '*') {
+          const char *end = s + n;
+          const char *p = s + i + 2;
+          while ((p = (const char *)memchr(p, '*', end - p)) && !(p + 1 < end && p[1] == '/'))
+            ++p;
+          p = p ? p : end;
+          line += std::count(s + i, p, '\n');
+          i = p - s + 2;
+        }
+        else
+          ++i;
+        break;
+      case '"': {
+        // Newlines inside a literal do not count, as in the tokenizer
+        size_t j = i + 1;
+        for (; j < n && (s[j] != '"' || (j > i + 1 && s[j - 1] == '\\')); ++j)
+          ;
+        i = j + 1;
+        break;
+      }
+      case '{':
+        ++depth;
+        ++i;
+        break;
+      case '}':
+        if (--depth < start)
+          return false;
+        ++i;
+        if (depth == 1 && inSubroutine) {
+          range.end = i;
+          range.endLine = line;
+          subroutines.push_back(range);
+          inSubroutine = false;
+        }
+        break;
+    }
+  }
+  return depth == start && !inSubroutine;
+}
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Binary.hh"
+#include "Hash.hh"
+#include "Interner.hh"
+#include "JackTokenizer.hh"
+#include "MappedFile.hh"
+
+// What a caller needs to know about a subroutine of another class
+struct Signature {
+  uint32_t name;          // interned Class.subroutine
+  enum::keyWord kind;     // CONSTRUCTOR|FUNCTION|METHOD
+  uint32_t returnType;    // interned void|int|char|boolean|className
+  uint64_t nArgs;         // declared parameters, this not included
+};
+
+struct Field {
+  uint32_t name;
+  uint32_t type;
+  enum::kind kind;        // STATIC|FIELD
+};
+
+// The declarations of one class, enough to compile calls into it
+struct ClassInfo {
+  uint32_t name;
+  uint64_t hash;          // of the source it was scanned from
+  std::vector<Field> fields;
+  std::vector<Signature> subroutines;
+};
+
+/*
+  Class, field and subroutine signatures of every class in the build,
+  collected by a pre-pass before anything is compiled. Anything not in it,
+  e.g. the OS, is unknown. The classes can be saved to a cache file keyed by
+  the hash of their source, so unchanged classes are not scanned again.
+*/
+class ProgramIndex {
+  private:
+    static const uint32_t MAGIC = 0x5844494a;   // "JIDX"
+    static const uint32_t VERSION = 1;
+
+    std::map<uint64_t, ClassInfo> cached;
+    std::unordered_map<uint32_t, ClassInfo> classes;
+    std::unordered_map<uint32_t, Signature> subroutines;
+
+    static void writeName(std::ostream &out, uint32_t id) {
+      writeString(out, nameOf(id));
+    }
+
+    static uint32_t readName(std::istream &in) {
+      std::string name = readString(in);
+      return in ? intern(name) : Interner::NONE;
+    }
+
+    // Declarations only, subroutine bodies are skipped by counting braces.
+    // A lexical error throws CompileError
+    static bool scan(std::string_view source, ClassInfo &info,
+                     const std::function<void(uint64_t)> &done) {
+      Arena arena;
+      JackTokenizer tokenizer;
+      tokenizer.recover = true;
+      tokenizer.initSource(source, arena);
+      auto next = [&]() -> std::string_view {
+        return tokenizer.hasMoreTokens() ? tokenizer.advance() : std::string_view();
+      };
+
+      if (next() != "class")
+        return false;
+      next();
+      info.name = tokenizer.tokenId();
+      if (info.name == Interner::NONE || next() != "{")
+        return false;
+      std::string_view className = nameOf(info.name);
+
+      for (std::string_view token = next(); !token.empty() && token != "}"; ) {
+        if (token == "static" || token == "field") {
+          kind akind = token == "static" ? kind::STATIC : kind::FIELD;
+          next();
+          uint32_t type = tokenizer.tokenId();
+          for (token = next(); !token.empty() && token != ";"; token = next()) {
+            if (token == ",")
+              continue;
+            if (type == Interner::NONE || tokenizer.tokenId() == Interner::NONE)
+              return false;
+            info.fields.push_back({tokenizer.tokenId(), type, akind});
+          }
+          token = next();
+        }
+        else if (token == "constructor" || token == "function" || token == "method") {
+          Signature s;
+          s.kind = token == "constructor" ? keyWord::CONSTRUCTOR
+                   : token == "function" ? keyWord::FUNCTION : keyWord::METHOD;
+          next();
+          s.returnType = tokenizer.tokenId();
+          std::string_view name = next();
+          if (s.returnType == Interner::NONE || tokenizer.tokenId() == Interner::NONE)
+            return false;
+          s.name = intern(std::string(className) + "." + std::string(name));
+          if (next() != "(")
+            return false;
+          s.nArgs = 0;
+          for (token = next(); !token.empty() && token != ")"; token = next())
+            if (token == "," || s.nArgs == 0)
+              ++s.nArgs;
+          info.subroutines.push_back(s);
+
+          uint64_t depth = 0;
+          do {
+            token = next();
+            if (token == "{")
+              ++depth;
+            else if (token == "}")
+              --depth;
+          } while (!token.empty() && depth > 0);
+          // Nothing taken from the body is kept
+          arena.clear();
+          if (done)
+            done(tokenizer.tokenEnd());
+          token = next();
+        }
+        else
+          return false;
+      }
+      return true;
+    }
+
+    // Replaces what an earlier version of the class declared
+    void add(const ClassInfo &info) {
+      auto old = classes.find(info.name);
+      if (old != classes.end())
+        for (const Signature &s: old->second.subroutines)
+          subroutines.erase(s.name);
+      classes[info.name] = info;
+      for (const Signature &s: info.subroutines)
+        subroutines[s.name] = s;
+    }
+
+  public:
+    uint64_t scanned = 0;
+    uint64_t loaded = 0;
+
+    // Adds the class in the .jack file at path, from the cache if it is
+    // unchanged. The file is mapped and let go of behind the scan, so even
+    // the largest class is indexed in bounded memory.
+    void addFile(const std::string &path) {
+      MappedFile file;
+      file.open(path);
+      addSource(file.text(), [&](uint64_t offset) { file.release(offset); });
+    }
+
+    // The same, from the text of the class, done is told each offset the
+    // index has finished with
+    void addSource(std::string_view source,
+                   const std::function<void(uint64_t)> &done = nullptr) {
+      const size_t CHUNK = 1 << 20;
+      uint64_t hash = hashBytes("");
+      for (size_t i = 0; i < source.size(); i += CHUNK) {
+        hash = hashBytes(source.substr(i, CHUNK), hash);
+        if (done)
+          done(i + CHUNK);
+      }
+      auto it = cached.find(hash);
+      if (it != cached.end()) {
+        ++loaded;
+        add(it->second);
+        return;
+      }
+      ClassInfo info;
+      info.hash = hash;
+      // A class that does not scan is left to the compiler to report
+      bool declared;
+      try {
+        declared = scan(source, info, done);
+      }
+      catch (const CompileError &) {
+        declared = false;
+      }
+      if (declared) {
+        ++scanned;
+        cached[hash] = info;
+        add(info);
+      }
+    }
+
+    // Cache entries of classes seen in this build
+    void save(const std::string &path) const {
+      std::ofstream out(path, std::ios::binary);
+      if (!out)
+        throw std::runtime_error(std::string("Failed to open file: ") + path);
+      writeU32(out, MAGIC);
+      writeU32(out, VERSION);
+      writeU32(out, classes.size());
+      for (const auto &entry: classes) {
+        const ClassInfo &info = entry.second;
+        writeU64(out, info.hash);
+        writeName(out, info.name);
+        writeU32(out, info.fields.size());
+        for (const Field &f: info.fields) {
+          writeName(out, f.name);
+          writeName(out, f.type);
+          writeU32(out, (uint32_t)f.kind);
+        }
+        writeU32(out, info.subroutines.size());
+        for (const Signature &s: info.subroutines) {
+          writeName(out, s.name);
+          writeU32(out, (uint32_t)s.kind);
+          writeName(out, s.returnType);
+          writeU32(out, s.nArgs);
+        }
+      }
+    }
+
+    // A missing, old or damaged cache is ignored, so is one holding a kind
+    // no declaration has
+    void load(const std::string &path) {
+      std::ifstream in(path, std::ios::binary);
+      if (!in || readU32(in) != MAGIC || readU32(in) != VERSION)
+        return;
+      std::map<uint64_t, ClassInfo> entries;
+      for (uint32_t n = readU32(in); in && n > 0; --n) {
+        ClassInfo info;
+        info.hash = readU64(in);
+        info.name = readName(in);
+        for (uint32_t f = readU32(in); in && f > 0; --f) {
+          Field field;
+          field.name = readName(in);
+          field.type = readName(in);
+          field.kind = (kind)readU32(in);
+          if (field.kind != kind::STATIC && field.kind != kind::FIELD)
+            return;
+          info.fields.push_back(field);
+        }
+        for (uint32_t s = readU32(in); in && s > 0; --s) {
+          Signature signature;
+          signature.name = readName(in);
+          signature.kind = (keyWord)readU32(in);
+          if (signature.kind != keyWord::CONSTRUCTOR && signature.kind != keyWord::FUNCTION
+              && signature.kind != keyWord::METHOD)
+            return;
+          signature.returnType = readName(in);
+          signature.nArgs = readU32(in);
+          info.subroutines.push_back(signature);
+        }
+        entries[info.hash] = info;
+      }
+      if (in)
+        cached.swap(entries);
+    }
+
+    // Of everything a call into the program is checked against, so a change
+    // to any signature changes it
+    uint64_t signatureHash() const {
+      std::vector<std::string_view> names;
+      for (const auto &entry: subroutines)
+        names.push_back(nameOf(entry.first));
+      std::sort(names.begin(), names.end());
+      uint64_t hash = hashBytes("");
+      for (std::string_view name: names) {
+        const Signature &s = subroutines.at(intern(name));
+        uint64_t shape[2] = {(uint64_t)s.kind, s.nArgs};
+        hash = hashBytes(name, hash);
+        hash = hashBytes(std::string_view((const char *)shape, sizeof shape), hash);
+      }
+      return hash;
+    }
+
+    const Signature *find(uint32_t name) const {
+      auto it = subroutines.find(name);
+      return it == subroutines.end() ? nullptr : &it->second;
+    }
+
+    const ClassInfo *findClass(uint32_t name) const {
+      auto it = classes.find(name);
+      return it == classes.end() ? nullptr : &it->second;
+    }
+};
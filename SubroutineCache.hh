@@ -0,0 +1,173 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Binary.hh"
+#include "Hash.hh"
+#include "Interner.hh"
+#include "VMCode.hh"
+
+// What the code of a subroutine was generated from
+struct SubroutineKey {
+  uint64_t body;        // tokens from the subroutine up to the next one
+  uint64_t layout;      // tokens of the class declarations, its fields and statics
+  uint64_t signatures;  // ProgramIndex::signatureHash()
+};
+
+/*
+  The VM code of every subroutine of one class as the CodeGenerator left it,
+  before any whole-program pass, kept in a cache directory between builds.
+  A subroutine is reused only if its body, the class layout and the program
+  signatures all hash the same as when it was generated.
+*/
+class SubroutineCache {
+  private:
+    static const uint32_t MAGIC = 0x434d564a;   // "JVMC"
+    static const uint32_t VERSION = 1;
+    static const uint32_t LIMIT = 1 << 24;      // of names, entries or commands read
+
+    struct Entry {
+      SubroutineKey key;
+      VMCode code;
+    };
+
+    std::string path;
+    uint64_t signatures;
+    std::unordered_map<uint32_t, Entry> entries;    // by interned Class.subroutine
+    std::unordered_map<uint32_t, Entry> next;       // what this build saves
+
+  public:
+    // Why each rebuilt subroutine was rebuilt, in source order
+    std::vector<std::pair<uint32_t, const char *> > rebuilt;
+    uint64_t reused = 0;
+
+    // The cache of the class in the .jack file at sourcePath, inside directory
+    SubroutineCache(const std::string &directory, const std::string &sourcePath,
+                    uint64_t signatures)
+      : signatures(signatures) {
+      std::string name = sourcePath.substr(sourcePath.find_last_of("/") + 1);
+      name = name.substr(0, name.find_last_of("."));
+      path = directory + "/" + name + "-" + std::to_string(hashBytes(sourcePath)) + ".jsc";
+      load();
+    }
+
+    uint64_t signatureHash() const {
+      return signatures;
+    }
+
+    // The cached code, or nullptr and why it has to be generated again
+    const VMCode *find(uint32_t name, const SubroutineKey &key, const char *&reason) const {
+      auto it = entries.find(name);
+      if (it == entries.end())
+        reason = "new";
+      else if (it->second.key.body != key.body)
+        reason = "body changed";
+      else if (it->second.key.layout != key.layout)
+        reason = "class fields or statics changed";
+      else if (it->second.key.signatures != key.signatures)
+        reason = "program signatures changed";
+      else
+        return &it->second.code;
+      return nullptr;
+    }
+
+    // Not thread safe, called once the subroutines of a class are done
+    void store(uint32_t name, const SubroutineKey &key, const VMCode &code,
+               const char *reason) {
+      next[name] = Entry{key, code};
+      if (reason)
+        rebuilt.push_back({name, reason});
+      else
+        ++reused;
+    }
+
+    // A missing, old or damaged cache is as good as an empty one
+    void load() {
+      std::ifstream in(path, std::ios::binary);
+      if (!in || readU32(in) != MAGIC || readU32(in) != VERSION)
+        return;
+      uint32_t count = readU32(in);
+      if (!in || count > LIMIT)
+        return;
+      std::vector<uint32_t> names(count);
+      for (uint32_t &name: names) {
+        std::string text = readString(in);
+        name = intern(text);
+      }
+      std::unordered_map<uint32_t, Entry> loaded;
+      for (uint32_t n = readU32(in); in && n > 0; --n) {
+        uint32_t name = readU32(in);
+        Entry entry;
+        entry.key.body = readU64(in);
+        entry.key.layout = readU64(in);
+        entry.key.signatures = readU64(in);
+        count = readU32(in);
+        if (!in || count > LIMIT)
+          return;
+        entry.code.resize(count);
+        for (VMCommand &c: entry.code) {
+          uint32_t kinds = readU32(in);
+          if ((kinds & 0xff) > (uint32_t)vmOp::RETURN
+              || ((kinds >> 8) & 0xff) > (uint32_t)segment::TEMP
+              || ((kinds >> 16) & 0xff) > (uint32_t)command::NOT)
+            return;
+          c.op = (vmOp)(kinds & 0xff);
+          c.seg = (segment)((kinds >> 8) & 0xff);
+          c.cmd = (command)((kinds >> 16) & 0xff);
+          c.index = (int64_t)readU64(in);
+          uint32_t id = readU32(in);
+          c.name = id < names.size() ? names[id] : Interner::NONE;
+        }
+        if (name < names.size())
+          loaded[names[name]] = std::move(entry);
+      }
+      if (in)
+        entries.swap(loaded);
+    }
+
+    // Names are written once, in a table the commands index
+    void save() const {
+      std::unordered_map<uint32_t, uint32_t> table;
+      std::vector<uint32_t> names;
+      auto indexOf = [&](uint32_t id) -> uint32_t {
+        if (id == Interner::NONE)
+          return UINT32_MAX;
+        auto it = table.find(id);
+        if (it != table.end())
+          return it->second;
+        table[id] = names.size();
+        names.push_back(id);
+        return names.size() - 1;
+      };
+      for (const auto &entry: next) {
+        indexOf(entry.first);
+        for (const VMCommand &c: entry.second.code)
+          indexOf(c.name);
+      }
+
+      std::ofstream out(path, std::ios::binary);
+      if (!out)
+        throw std::runtime_error(std::string("Failed to open file: ") + path);
+      writeU32(out, MAGIC);
+      writeU32(out, VERSION);
+      writeU32(out, names.size());
+      for (uint32_t id: names)
+        writeString(out, nameOf(id));
+      writeU32(out, next.size());
+      for (const auto &entry: next) {
+        writeU32(out, indexOf(entry.first));
+        writeU64(out, entry.second.key.body);
+        writeU64(out, entry.second.key.layout);
+        writeU64(out, entry.second.key.signatures);
+        writeU32(out, entry.second.code.size());
+        for (const VMCommand &c: entry.second.code) {
+          writeU32(out, (uint32_t)c.op | (uint32_t)c.seg << 8 | (uint32_t)c.cmd << 16);
+          writeU64(out, (uint64_t)c.index);
+          writeU32(out, indexOf(c.name));
+        }
+      }
+    }
+};
@@ -1,64 +1,137 @@
+#pragma once
+
 #include <iostream>
-#include <map>
 #include <vector>
 
+#include "Interner.hh"
+#include "JackTokens.hh"
+
+// Everything the code generator needs to know about a variable
+struct Symbol {
+  enum::kind kind;
+  enum::segment seg;
+  uint32_t index;
+  uint32_t type;     // interned type name
+};
+
+/*
+  Class and subroutine scope, each an open addressing hash table keyed by the
+  interned name. A slot is only live if it carries the scope's generation, so
+  leaving a subroutine is a counter increment rather than a clear.
+*/
 class SymbolTable {
   private:
-     uint64_t staticCount = 0;
-     uint64_t fieldCount = 0;
-     uint64_t _varCount = 0;
-     uint64_t argCount = 0;
-     std::map< std::string, 
-     std::tuple<std::string, enum::kind, uint64_t> > table; 
+    struct Slot {
+      uint32_t id;
+      uint32_t generation;
+      Symbol symbol;
+    };
+
+    typedef std::vector<Slot, ArenaAllocator<Slot> > Slots;
+
+    struct Scope {
+      Slots slots;
+      uint32_t generation = 1;
+      uint32_t size = 0;
+      uint64_t counts[2] = {0, 0};
+
+      Scope(Arena &arena) : slots(emptySlots(arena)) { }
+
+      static Slots emptySlots(Arena &arena) {
+        ALLOCATION_SCOPE(SYMBOLS);
+        return Slots(16, Slot{0, 0, Symbol()}, ArenaAllocator<Slot>(arena));
+      }
+    };
+
+    Scope classScope, subScope;
+
+    static size_t slotOf(const Scope &scope, uint32_t id) {
+      size_t mask = scope.slots.size() - 1;
+      size_t i = (id * 2654435761u) & mask;
+      while (scope.slots[i].generation == scope.generation && scope.slots[i].id != id)
+        i = (i + 1) & mask;
+      return i;
+    }
+
+    static const Symbol *lookup(const Scope &scope, uint32_t id) {
+      const Slot &slot = scope.slots[slotOf(scope, id)];
+      return slot.generation == scope.generation ? &slot.symbol : nullptr;
+    }
+
+    static void grow(Scope &scope) {
+      Slots old(scope.slots.size() * 2, Slot{0, 0, Symbol()}, scope.slots.get_allocator());
+      old.swap(scope.slots);
+      for (const Slot &slot: old)
+        if (slot.generation == scope.generation)
+          scope.slots[slotOf(scope, slot.id)] = slot;
+    }
+
+    static void clear(Scope &scope) {
+      ++scope.generation;
+      scope.size = 0;
+      scope.counts[0] = scope.counts[1] = 0;
+    }
+
+    Scope &scopeOf(enum::kind akind) {
+      return akind == kind::STATIC || akind == kind::FIELD ? classScope : subScope;
+    }
+
+    // Position of the kind's counter in its scope
+    static int counterOf(enum::kind akind) {
+      return akind == kind::STATIC || akind == kind::VAR ? 0 : 1;
+    }
 
   public:
-    
-    void define(std::string name, std::string type, enum::kind akind) {
-      uint64_t index;
+    SymbolTable(Arena &arena) : classScope(arena), subScope(arena) { }
+
+    // name and type are interned
+    void define(uint32_t id, uint32_t type, enum::kind akind) {
+      ALLOCATION_SCOPE(SYMBOLS);
+      Scope &scope = scopeOf(akind);
+      if ((scope.size + 1) * 2 > scope.slots.size())
+        grow(scope);
+      Slot &slot = scope.slots[slotOf(scope, id)];
+      if (slot.generation != scope.generation)
+        ++scope.size;
+      segment seg = segment::LOCAL;
       switch (akind) {
-        case kind::STATIC: index = staticCount++; 
+        case kind::VAR: seg = segment::LOCAL;
           break;
-        case kind::FIELD: index = fieldCount++;
+        case kind::STATIC: seg = segment::STATIC;
           break;
-        case kind::VAR: index = _varCount++; 
+        case kind::FIELD: seg = segment::THIS;
           break;
-        case kind::ARG: index = argCount++;
+        case kind::ARG: seg = segment::ARGUMENT;
           break;
       }
-      table[name] = {type, akind, index};
+      uint32_t index = scope.counts[counterOf(akind)]++;
+      slot = Slot{id, scope.generation, Symbol{akind, seg, index, type}};
     }
-    
-    uint64_t varCount(enum::kind kind) {
-      switch (kind) {
-        case kind::STATIC: return staticCount; 
-        case kind::FIELD: return fieldCount; 
-        case kind::VAR: return _varCount; 
-        case kind::ARG: return argCount; 
-      }
-    } 
 
-    enum::kind kindOf(std::string name) {
-      return std::get<1>(table[name]);
+    uint64_t varCount(enum::kind akind) {
+      return scopeOf(akind).counts[counterOf(akind)];
     }
 
-    std::string typeOf(std::string name) {
-      return std::get<0>(table[name]);
+    // The innermost symbol with the interned name id, nullptr if there is none
+    const Symbol *resolve(uint32_t id) const {
+      if (id == Interner::NONE)
+        return nullptr;
+      const Symbol *symbol = lookup(subScope, id);
+      return symbol ? symbol : lookup(classScope, id);
     }
 
-    uint64_t indexOf(std::string name) {
-     return std::get<2>(table[name]);
+    std::string_view typeName(const Symbol &symbol) const {
+      return nameOf(symbol.type);
     }
 
-    bool contains(std::string name) {
-      return table.count(name) > 0;
+    // Leave the subroutine scope
+    void startSubroutine() {
+      clear(subScope);
     }
 
+    // Leave the class scope
     void reset() {
-      table.clear();
-      staticCount = 0; 
-      fieldCount = 0;
-      _varCount = 0;
-      argCount = 0;
+      clear(classScope);
+      clear(subScope);
     }
 };
-
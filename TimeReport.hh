@@ -0,0 +1,183 @@
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Json.hh"
+
+enum class phase {
+  READ          // the source into memory
+  , LEX         // a tokenizer pass of its own over the source
+  , PARSE       // the parse, its lexing included
+  , GENERATE    // resolving names and emitting VM code
+  , WRITE       // the .vm file
+  , COUNT
+};
+
+inline const char *phaseName(enum::phase p) {
+  switch (p) {
+    case phase::READ: return "read";
+    case phase::LEX: return "lex";
+    case phase::PARSE: return "parse";
+    case phase::GENERATE: return "generate";
+    case phase::WRITE: return "write";
+    default: return "";
+  }
+}
+
+// The time in each phase and the counters of one file
+struct Timings {
+  double seconds[(int)phase::COUNT] = {};
+  uint64_t tokens = 0;
+  uint64_t lookups = 0;         // of names in the symbol table
+  uint64_t instructions = 0;    // VM commands emitted
+  uint64_t bytes = 0;           // of VM code written
+
+  void add(const Timings &other) {
+    for (int p = 0; p < (int)phase::COUNT; ++p)
+      seconds[p] += other.seconds[p];
+    tokens += other.tokens;
+    lookups += other.lookups;
+    instructions += other.instructions;
+    bytes += other.bytes;
+  }
+};
+
+/*
+  --time-report: steady clock time per phase and file, taken at the phase
+  boundaries only, so nothing is timed per token or per lookup. Lexing is
+  interleaved with parsing, so the lex column comes from a tokenizer pass
+  of its own and parse includes it. With --jobs the parse and generate of
+  a class run on several workers and their times are summed.
+
+  Every phase is also a complete event of the Chrome trace format, on the
+  thread that ran it, for --trace FILE.
+*/
+class TimeReport {
+  private:
+    struct Event {
+      std::string name;
+      std::string file;
+      uint32_t thread;
+      double begin;
+      double end;
+    };
+
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+    std::mutex mutex;
+    std::deque<std::pair<std::string, Timings> > files;    // never moved once added
+    std::vector<std::pair<std::string, double> > program;   // phases of the whole program
+    std::vector<Event> events;
+    std::map<std::thread::id, uint32_t> threads;
+
+    static void row(std::ostream &out, const std::string &name, const Timings &t) {
+      double total = 0;
+      out << std::left << std::setw(28) << name << std::right;
+      for (int p = 0; p < (int)phase::COUNT; ++p) {
+        out << std::setw(10) << t.seconds[p] * 1000;
+        total += p == (int)phase::LEX ? 0 : t.seconds[p];
+      }
+      out << std::setw(10) << total * 1000 << std::setw(10) << t.tokens << std::setw(10)
+          << t.lookups << std::setw(10) << t.instructions << std::setw(10) << t.bytes
+          << std::endl;
+    }
+
+  public:
+    // Seconds since the report began
+    double now() const {
+      return std::chrono::duration<double>(std::chrono::steady_clock::now() - origin).count();
+    }
+
+    // The timings of a new file, the reference stays valid
+    Timings &file(const std::string &name) {
+      std::lock_guard<std::mutex> lock(mutex);
+      files.emplace_back(name, Timings());
+      return files.back().second;
+    }
+
+    // A span of the trace on the calling thread
+    void event(const std::string &name, const std::string &file, double begin, double end) {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto thread = threads.emplace(std::this_thread::get_id(), threads.size()).first->second;
+      events.push_back({name, file, thread, begin, end});
+    }
+
+    // Of phase p of file, from begin to now
+    void record(Timings &timings, enum::phase p, const std::string &file, double begin) {
+      double end = now();
+      timings.seconds[(int)p] += end - begin;
+      event(phaseName(p), file, begin, end);
+    }
+
+    // Of a pass over the whole program, from begin to now
+    void record(const std::string &name, double begin) {
+      double end = now();
+      event(name, "", begin, end);
+      std::lock_guard<std::mutex> lock(mutex);
+      program.push_back({name, end - begin});
+    }
+
+    void print(std::ostream &out) {
+      std::lock_guard<std::mutex> lock(mutex);
+      out << std::left << std::setw(28) << "Time report (ms)" << std::right;
+      for (int p = 0; p < (int)phase::COUNT; ++p)
+        out << std::setw(10) << phaseName((enum::phase)p);
+      out << std::setw(10) << "total" << std::setw(10) << "tokens" << std::setw(10)
+          << "lookups" << std::setw(10) << "instrs" << std::setw(10) << "bytes" << std::endl;
+      out << std::fixed << std::setprecision(3);
+      Timings all;
+      for (const auto &file: files) {
+        row(out, file.first, file.second);
+        all.add(file.second);
+      }
+      row(out, "all files", all);
+      double elapsed = now(), passes = 0;
+      for (const auto &pass: program) {
+        out << std::left << std::setw(28) << pass.first << std::right << std::setw(10)
+            << pass.second * 1000 << std::endl;
+        passes += pass.second;
+      }
+      out << std::left << std::setw(28) << "elapsed" << std::right << std::setw(10)
+          << elapsed * 1000 << std::endl;
+      double compiling = all.seconds[(int)phase::PARSE] + all.seconds[(int)phase::GENERATE];
+      if (compiling > 0)
+        out << std::setprecision(0) << all.tokens / compiling << " tokens/s, "
+            << all.lookups / compiling << " lookups/s, " << all.instructions / compiling
+            << " instructions/s parsing and generating" << std::endl;
+      out << std::defaultfloat << std::setprecision(6);
+    }
+
+    // The events as Chrome trace JSON, for chrome://tracing or Perfetto
+    void writeTrace(const std::string &path) {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::string json = "{\"traceEvents\":[";
+      for (size_t i = 0; i < events.size(); ++i) {
+        const Event &e = events[i];
+        json += i ? ",\n{\"name\":" : "\n{\"name\":";
+        appendJsonString(json, e.name);
+        json += ",\"cat\":\"compile\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+                + std::to_string(e.thread) + ",\"ts\":" + std::to_string(e.begin * 1e6)
+                + ",\"dur\":" + std::to_string((e.end - e.begin) * 1e6);
+        if (!e.file.empty()) {
+          json += ",\"args\":{\"file\":";
+          appendJsonString(json, e.file);
+          json += "}";
+        }
+        json += "}";
+      }
+      json += "],\"displayTimeUnit\":\"ms\"}\n";
+      std::ofstream file(path);
+      if (!file)
+        throw std::runtime_error("Failed to open file: " + path);
+      file << json;
+    }
+};
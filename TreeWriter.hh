@@ -0,0 +1,211 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "JackTokens.hh"
+
+enum class treeFormat {
+  XML
+  , JSON
+};
+
+/*
+  Text each byte is written as in XML and in JSON text, nullptr for the
+  bytes written as they are. Escaping appends the runs between escaped
+  bytes whole.
+*/
+struct EscapeTable {
+  const char *xml[256] = {};
+  const char *json[256] = {};
+
+  EscapeTable() {
+    xml[(unsigned char)'<'] = "&lt;";
+    xml[(unsigned char)'>'] = "&gt;";
+    xml[(unsigned char)'&'] = "&amp;";
+    xml[(unsigned char)'"'] = "&quot;";
+    static const char *control[32] = {
+      "\\u0000", "\\u0001", "\\u0002", "\\u0003", "\\u0004", "\\u0005", "\\u0006", "\\u0007",
+      "\\b", "\\t", "\\n", "\\u000b", "\\f", "\\r", "\\u000e", "\\u000f",
+      "\\u0010", "\\u0011", "\\u0012", "\\u0013", "\\u0014", "\\u0015", "\\u0016", "\\u0017",
+      "\\u0018", "\\u0019", "\\u001a", "\\u001b", "\\u001c", "\\u001d", "\\u001e", "\\u001f"
+    };
+    for (int c = 0; c < 32; ++c)
+      json[c] = control[c];
+    json[(unsigned char)'"'] = "\\\"";
+    json[(unsigned char)'\\'] = "\\\\";
+  }
+};
+
+inline void appendEscaped(std::string &out, std::string_view text, const char *const table[256]) {
+  size_t run = 0;
+  for (size_t i = 0; i < text.size(); ++i) {
+    if (const char *escaped = table[(unsigned char)text[i]]) {
+      out.append(text.data() + run, i - run);
+      out.append(escaped);
+      run = i + 1;
+    }
+  }
+  out.append(text.data() + run, text.size() - run);
+}
+
+inline const EscapeTable &escapes() {
+  static const EscapeTable table;
+  return table;
+}
+
+inline std::string xmlEscape(std::string_view text) {
+  std::string out;
+  appendEscaped(out, text, escapes().xml);
+  return out;
+}
+
+/*
+  Writes the parse tree as the parser goes, in the nand2tetris XML layout
+  or as JSON with the same elements. Output is buffered and handed to the
+  stream a block at a time, or kept whole with no stream, e.g. for a worker
+  whose piece of the tree is joined later.
+*/
+class TreeWriter {
+  private:
+    static const size_t BLOCK = 64 * 1024;
+
+    treeFormat format;
+    std::ostream *out;
+    std::string buffer;
+    size_t depth;
+    std::vector<bool> siblings;   // JSON: whether each open level has had a child
+
+    void indent() {
+      buffer.append(2 * depth, ' ');
+    }
+
+    // JSON elements are separated by commas
+    void separate() {
+      if (format == treeFormat::JSON) {
+        if (siblings.back())
+          buffer += ",";
+        siblings.back() = true;
+        buffer += "\n";
+      }
+    }
+
+    void spill() {
+      if (out && buffer.size() >= BLOCK) {
+        out->write(buffer.data(), buffer.size());
+        buffer.clear();
+      }
+    }
+
+  public:
+    // depth > 0 continues inside a tree whose open levels have children
+    TreeWriter(treeFormat format, std::ostream *out = nullptr, size_t depth = 0)
+      : format(format), out(out), depth(depth), siblings(depth + 1, depth > 0) { }
+
+    ~TreeWriter() {
+      flush();
+    }
+
+    static const char *tokenTag(enum::tokenType type) {
+      switch (type) {
+        case tokenType::KEYWORD: return "keyword";
+        case tokenType::SYMBOL: return "symbol";
+        case tokenType::IDENTIFIER: return "identifier";
+        case tokenType::INT_CONST: return "integerConstant";
+        case tokenType::STR_CONST: return "stringConstant";
+      }
+      return "";
+    }
+
+    void open(const char *tag) {
+      separate();
+      indent();
+      if (format == treeFormat::XML) {
+        buffer += "<";
+        buffer += tag;
+        buffer += ">\n";
+      }
+      else {
+        buffer += "{\"";
+        buffer += tag;
+        buffer += "\": [";
+      }
+      ++depth;
+      siblings.push_back(false);
+    }
+
+    void close(const char *tag) {
+      --depth;
+      if (format == treeFormat::XML) {
+        indent();
+        buffer += "</";
+        buffer += tag;
+        buffer += ">\n";
+      }
+      else {
+        if (siblings.back()) {
+          buffer += "\n";
+          indent();
+        }
+        buffer += "]}";
+        if (depth == 0)
+          buffer += "\n";
+      }
+      siblings.pop_back();
+      spill();
+    }
+
+    void token(enum::tokenType type, std::string_view text) {
+      const char *tag = tokenTag(type);
+      separate();
+      indent();
+      if (format == treeFormat::XML) {
+        buffer += "<";
+        buffer += tag;
+        buffer += "> ";
+        appendEscaped(buffer, text, escapes().xml);
+        buffer += " </";
+        buffer += tag;
+        buffer += ">\n";
+      }
+      else {
+        buffer += "{\"";
+        buffer += tag;
+        buffer += "\": \"";
+        appendEscaped(buffer, text, escapes().json);
+        buffer += "\"}";
+      }
+      spill();
+    }
+
+    // Text written by another TreeWriter at this depth
+    void append(std::string_view text) {
+      buffer.append(text.data(), text.size());
+      if (!text.empty() && format == treeFormat::JSON)
+        siblings.back() = true;
+      spill();
+    }
+
+    // A writer for a piece of this tree at the current depth, to append later
+    TreeWriter branch() const {
+      return TreeWriter(format, nullptr, depth);
+    }
+
+    // What was written so far, when there is no stream
+    std::string take() {
+      std::string text;
+      text.swap(buffer);
+      return text;
+    }
+
+    void flush() {
+      if (out && !buffer.empty()) {
+        out->write(buffer.data(), buffer.size());
+        buffer.clear();
+      }
+      if (out)
+        out->flush();
+    }
+};
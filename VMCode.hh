@@ -0,0 +1,110 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Interner.hh"
+#include "JackTokens.hh"
+
+// One VM command as emitted by VMWriter
+struct VMCommand {
+  enum::vmOp op;
+  enum::segment seg = segment::CONSTANT;  // push|pop
+  enum::command cmd = command::ADD;       // arithmetic
+  int64_t index = 0;                      // push|pop index, call nArgs, function nVars
+  uint32_t name = Interner::NONE;         // interned label|goto|if-goto|call|function
+};
+
+typedef std::vector<VMCommand> VMCode;
+
+// The buffered VM code of a class, written to <path> once every pass is done
+struct VMClass {
+  std::string name;
+  std::string path;
+  VMCode code;
+};
+
+// [begin, end) of one function inside VMCode, begin is the function command
+struct VMRange {
+  size_t begin;
+  size_t end;
+};
+
+inline std::vector<VMRange> functionRanges(const VMCode &code) {
+  std::vector<VMRange> ranges;
+  for (size_t i = 0; i < code.size(); ++i) {
+    if (code[i].op == vmOp::FUNCTION) {
+      if (!ranges.empty())
+        ranges.back().end = i;
+      ranges.push_back({i, code.size()});
+    }
+  }
+  return ranges;
+}
+
+inline const char *segmentText(enum::segment seg) {
+  switch (seg) {
+    case segment::CONSTANT: return "constant";
+    case segment::ARGUMENT: return "argument";
+    case segment::LOCAL: return "local";
+    case segment::STATIC: return "static";
+    case segment::THIS: return "this";
+    case segment::THAT: return "that";
+    case segment::POINTER: return "pointer";
+    case segment::TEMP: return "temp";
+  }
+  return "";
+}
+
+inline const char *commandText(enum::command cmd) {
+  switch (cmd) {
+    case command::ADD: return "add";
+    case command::SUB: return "sub";
+    case command::NEG: return "neg";
+    case command::EQ: return "eq";
+    case command::GT: return "gt";
+    case command::LT: return "lt";
+    case command::AND: return "and";
+    case command::OR: return "or";
+    case command::NOT: return "not";
+  }
+  return "";
+}
+
+inline void writeCommand(std::ostream &out, const VMCommand &c) {
+  switch (c.op) {
+    case vmOp::PUSH: out << "push " << segmentText(c.seg) << " " << c.index;
+      break;
+    case vmOp::POP: out << "pop " << segmentText(c.seg) << " " << c.index;
+      break;
+    case vmOp::ARITHMETIC: out << commandText(c.cmd);
+      break;
+    case vmOp::LABEL: out << "label " << nameOf(c.name);
+      break;
+    case vmOp::GOTO: out << "goto " << nameOf(c.name);
+      break;
+    case vmOp::IF: out << "if-goto " << nameOf(c.name);
+      break;
+    case vmOp::CALL: out << "call " << nameOf(c.name) << " " << c.index;
+      break;
+    case vmOp::FUNCTION: out << "function " << nameOf(c.name) << " " << c.index;
+      break;
+    case vmOp::RETURN: out << "return";
+      break;
+  }
+  out << '\n';
+}
+
+// The bytes written
+inline uint64_t writeVMFile(const VMClass &vmClass) {
+  ALLOCATION_SCOPE(WRITER);
+  std::ofstream outFile(vmClass.path);
+  if (!outFile)
+    throw std::runtime_error(std::string("Failed to open file: ") + vmClass.path);
+  for (const VMCommand &c: vmClass.code)
+    writeCommand(outFile, c);
+  return outFile.tellp();
+}
@@ -1,13 +1,22 @@
+#pragma once
+
 #include <iostream>
 #include <fstream>
 
+#include "VMCode.hh"
+
+// Buffers the VM code of a class, close() writes it to <fileName>.vm
 class VMWriter {
   private:
-    std::ofstream outFile;
-    std::string fileName;
-
-    void printError() {
-
+    VMClass vmClass;
+
+    void emit(enum::vmOp op, uint32_t name, int64_t index) {
+      ALLOCATION_SCOPE(WRITER);
+      VMCommand c;
+      c.op = op;
+      c.name = name;
+      c.index = index;
+      vmClass.code.push_back(c);
     }
 
   public:
@@ -18,121 +27,78 @@ class VMWriter {
     }
 
     void init(std::string path) {
-        
+
       // Remove file extension
-      fileName = path.substr(0, path.find_last_of("."));
+      std::string fileName = path.substr(0, path.find_last_of("."));
       path = fileName + ".vm";
 
-      outFile.open(path);
+      vmClass.name = fileName.substr(fileName.find_last_of("/")+1);
+      vmClass.path = path;
+      vmClass.code.clear();
 
       std::cout << "VMWriter: " << path << std::endl;
-
-      if (!outFile) 
-        throw std::runtime_error(std::string("Failed to open file: ") + path); 
     }
 
     void close() {
-      outFile.close();
-    } 
+      writeVMFile(vmClass);
+    }
 
-    ~VMWriter() {
-      outFile.close();
+    // The buffered code, passes may rewrite it before it is written
+    VMClass &code() {
+      return vmClass;
     }
-    
 
     void writePush(enum::segment seg, uint64_t index) {
-      std::string _segment;
-      switch (seg) {
-        case segment::CONSTANT: _segment = "constant";
-          break;
-        case segment::ARGUMENT: _segment = "argument";
-          break;
-        case segment::LOCAL: _segment = "local";
-          break;
-        case segment::STATIC: _segment = "static";
-          break;
-        case segment::THIS: _segment = "this";
-          break;
-        case segment::THAT: _segment = "that";
-          break;
-        case segment::POINTER: _segment = "pointer";
-          break;
-        case segment::TEMP: _segment = "temp";
-          break;
-        default: printError();
-      }
-      outFile << "push " << _segment << " " << index << std::endl;;
+      ALLOCATION_SCOPE(WRITER);
+      VMCommand c;
+      c.op = vmOp::PUSH;
+      c.seg = seg;
+      c.index = index;
+      vmClass.code.push_back(c);
     }
 
     void writePop(enum::segment seg, uint64_t index) {
-      std::string _segment;
-      switch (seg) {
-        case segment::CONSTANT: _segment = "constant";
-          break;
-        case segment::ARGUMENT: _segment = "argument";
-          break;
-        case segment::LOCAL: _segment = "local";
-          break;
-        case segment::STATIC: _segment = "static";
-          break;
-        case segment::THIS: _segment = "this";
-          break;
-        case segment::THAT: _segment = "that";
-          break;
-        case segment::POINTER: _segment = "pointer";
-          break;
-        case segment::TEMP: _segment = "temp";
-          break;
-        default: printError();
-      }
-      outFile << "pop " << _segment << " " << index << std::endl;;
+      ALLOCATION_SCOPE(WRITER);
+      VMCommand c;
+      c.op = vmOp::POP;
+      c.seg = seg;
+      c.index = index;
+      vmClass.code.push_back(c);
     }
 
     void writeArithmetic(enum::command _command) {
-      switch (_command) {
-        case command::ADD: outFile << "add";
-          break;
-        case command::SUB: outFile << "sub";
-          break;
-        case command::NEG: outFile << "neg";
-          break;
-        case command::EQ: outFile << "eq";
-          break;
-        case command::GT: outFile << "gt";
-          break;
-        case command::LT: outFile << "lt";
-          break;
-        case command::AND: outFile << "and";
-          break;
-        case command::OR: outFile << "or";
-          break;
-        case command::NOT: outFile << "not";
-      }
-      outFile << std::endl;
+      ALLOCATION_SCOPE(WRITER);
+      VMCommand c;
+      c.op = vmOp::ARITHMETIC;
+      c.cmd = _command;
+      vmClass.code.push_back(c);
     }
 
-    void writeLabel(std::string label) {
-      outFile << "label " << label << std::endl;
+    void writeLabel(std::string_view label) {
+      emit(vmOp::LABEL, intern(label), 0);
     };
 
-    void writeGoto(std::string label) {
-      outFile << "goto " << label << std::endl;
+    void writeGoto(std::string_view label) {
+      emit(vmOp::GOTO, intern(label), 0);
     };
 
-    void writeIf(std::string label) {
-      outFile << "if-goto " << label << std::endl;
+    void writeIf(std::string_view label) {
+      emit(vmOp::IF, intern(label), 0);
     };
 
-    void writeCall(std::string name, uint64_t nArgs) {
-      outFile << "call " << name << " " << nArgs << std::endl;
+    void writeCall(std::string_view name, uint64_t nArgs) {
+      emit(vmOp::CALL, intern(name), nArgs);
     };
 
-    void writeFunction(std::string name, uint64_t nVars) {
-      outFile << "function " << name << " " << nVars << std::endl;
+    void writeCall(uint32_t name, uint64_t nArgs) {
+      emit(vmOp::CALL, name, nArgs);
+    };
+
+    void writeFunction(uint32_t name, uint64_t nVars) {
+      emit(vmOp::FUNCTION, name, nVars);
     };
 
     void writeReturn() {
-      outFile << "return" << std::endl;
+      emit(vmOp::RETURN, Interner::NONE, 0);
     };
 };
-
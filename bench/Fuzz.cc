@@ -0,0 +1,458 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "CompilationEngine.hh"
+
+/*
+  Feeds mutated Jack sources to the tokenizer, the prescan and the engine,
+  in process, with errors thrown as CompileError as the language server
+  gets them. An input is a finding when it crashes, runs past --timeout,
+  or takes more than --time-per-byte or --memory-per-byte of its size,
+  with a floor of 4 KB so small inputs are not judged on fixed costs.
+  Memory is what the engine's arena handed out and the VM code, or the
+  heap peak of every component when built with -DTRACK_ALLOCATIONS.
+
+  Standalone, it mutates the .jack files under the seed directories, 11
+  by default, and keeps the inputs that cost the most per byte to mutate
+  further, so it climbs toward slow and explosive inputs. Findings are
+  written to --out as crash-, timeout-, slow- and memory-<hash>.jack and
+  make it exit 1. Files given to --replay are run once each.
+
+  Usage: Fuzz [--runs N] [--seed N] [--max-len BYTES] [--time-per-byte NS]
+              [--memory-per-byte N] [--timeout S] [--out DIR]
+              [--replay FILE...] [seed directories]
+
+  With libFuzzer, which brings its own main and mutations, a finding aborts:
+    clang++ -std=c++17 -O1 -g -fsanitize=fuzzer,address -DLIBFUZZER -I. \
+      bench/Fuzz.cc -o bench/FuzzLib
+    mkdir -p corpus && find 11 -name '*.jack' -exec cp {} corpus \;
+    ./bench/FuzzLib corpus
+*/
+
+struct Cost {
+  double seconds = 0;
+  uint64_t memory = 0;
+  bool compiled = false;    // no CompileError
+};
+
+struct Limits {
+  double timePerByte = 2000e-9;
+  double memoryPerByte = 256;
+  uint64_t floor = 4096;
+};
+
+Limits limits;
+
+// The name after "class", the engine checks it against the file name
+std::string className(std::string_view source) {
+  size_t at = source.find("class");
+  if (at == std::string_view::npos)
+    return "Main";
+  at += 5;
+  while (at < source.size() && isspace((unsigned char)source[at]))
+    ++at;
+  size_t end = at;
+  while (end < source.size() && (isalnum((unsigned char)source[end]) || source[end] == '_'))
+    ++end;
+  return end > at ? std::string(source.substr(at, end - at)) : "Main";
+}
+
+Cost compile(std::string_view source) {
+  Cost cost;
+  if (trackingAllocations())
+    allocationCounters.resetPeaks();
+  uint64_t live = 0;
+  for (int c = 0; c < (int)component::COUNT; ++c)
+    live += allocationCounters.counts((enum::component)c).live;
+
+  auto begin = std::chrono::steady_clock::now();
+  {
+    Arena arena;
+    JackTokenizer tokenizer;
+    tokenizer.recover = true;
+    tokenizer.initSource(source, arena);
+    try {
+      while (tokenizer.hasMoreTokens())
+        tokenizer.advance();
+    }
+    catch (const CompileError &) { }
+  }
+  std::vector<SourceRange> ranges;
+  prescan(source, ranges);
+  ProgramIndex index;
+  index.addSource(source);
+  CompilationEngine engine(source, className(source), &index);
+  engine.recoverErrors();
+  try {
+    engine.parseClass();
+    engine.generate();
+    cost.compiled = true;
+  }
+  catch (const CompileError &) { }
+  cost.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+  if (trackingAllocations()) {
+    for (int c = 0; c < (int)component::COUNT; ++c)
+      cost.memory += allocationCounters.counts((enum::component)c).peak;
+    cost.memory -= std::min(cost.memory, live);
+  }
+  else
+    cost.memory = engine.memory().bytes
+                  + engine.code().code.size() * sizeof(engine.code().code[0]);
+  return cost;
+}
+
+// How far past the limits, above 1 is a finding
+double timeScore(const Cost &cost, uint64_t size) {
+  return cost.seconds / (limits.timePerByte * std::max(size, limits.floor));
+}
+
+double memoryScore(const Cost &cost, uint64_t size) {
+  return cost.memory / (limits.memoryPerByte * std::max(size, limits.floor));
+}
+
+#ifdef LIBFUZZER
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  std::string_view source((const char *)data, size);
+  Cost cost = compile(source);
+  if (timeScore(cost, size) > 1 || memoryScore(cost, size) > 1) {
+    std::cerr << "Fuzz: " << size << " bytes took " << cost.seconds * 1e3 << " ms and "
+              << cost.memory << " bytes" << std::endl;
+    abort();
+  }
+  return 0;
+}
+#else
+
+// xorshift64*, the same stream for the same --seed
+class Random {
+  private:
+    uint64_t state;
+
+  public:
+    Random(uint64_t seed) : state(seed * 2 + 1) { }
+
+    uint64_t next() {
+      state ^= state >> 12;
+      state ^= state << 25;
+      state ^= state >> 27;
+      return state * 2685821657736338717ull;
+    }
+
+    // In [0, n)
+    size_t below(size_t n) {
+      return n ? next() % n : 0;
+    }
+};
+
+// Pieces of Jack that make the mutants reach past the tokenizer
+const char *dictionary[] = {
+  "class ", "constructor ", "function ", "method ", "field ", "static ", "var ", "int ",
+  "char ", "boolean ", "void ", "true", "false", "null", "this", "let ", "do ", "if ",
+  "else ", "while ", "return ", "(", ")", "[", "]", "{", "}", ",", ";", "=", ".", "+",
+  "-", "*", "/", "&", "|", "<", ">", "~", "\"", "\\\"", "//", "/*", "*/", "\n", " ",
+  "0", "32767", "32768", "99999999999", "x", "Main", "a.b(", "let x = ", "if (x) {",
+  "while (x) {", "} else {", "((", "))", "-~-~",
+};
+
+class Mutator {
+  private:
+    Random &random;
+    size_t maxLength;
+
+    // A range of text, short ones more likely
+    std::pair<size_t, size_t> range(const std::string &text) {
+      size_t begin = random.below(text.size() + 1);
+      size_t length = random.below(std::min<size_t>(text.size() - begin, 1 << random.below(12)) + 1);
+      return {begin, length};
+    }
+
+  public:
+    Mutator(Random &random, size_t maxLength) : random(random), maxLength(maxLength) { }
+
+    std::string mutate(std::string text, const std::vector<std::string> &corpus) {
+      for (size_t n = random.below(4) + 1; n > 0; --n) {
+        auto r = range(text);
+        switch (random.below(8)) {
+          case 0:   // a byte changed
+            if (!text.empty())
+              text[random.below(text.size())] = (char)random.below(256);
+            break;
+          case 1:   // a byte inserted, printable mostly
+            text.insert(text.begin() + r.first,
+                        (char)(random.below(4) ? 32 + random.below(95) : random.below(256)));
+            break;
+          case 2:
+            text.erase(r.first, r.second);
+            break;
+          case 3:
+            text.insert(r.first, dictionary[random.below(sizeof(dictionary) / sizeof(*dictionary))]);
+            break;
+          case 4:   // a range copied elsewhere
+            text.insert(random.below(text.size() + 1), text.substr(r.first, r.second));
+            break;
+          case 5: { // a range repeated, which nests what it opens
+            std::string piece = text.substr(r.first, std::min<size_t>(r.second, 16));
+            for (size_t k = 1 << random.below(10); k > 0 && text.size() < maxLength; --k)
+              text.insert(r.first, piece);
+            break;
+          }
+          case 6: { // spliced with another input
+            const std::string &other = corpus[random.below(corpus.size())];
+            text = text.substr(0, r.first) + other.substr(random.below(other.size() + 1));
+            break;
+          }
+          default: { // something opened many times, then closed as often
+            static const char *pairs[][2] = {
+              {"(", ")"}, {"-", ""}, {"~", ""}, {"a[", "]"}, {"if (x) {", "}"},
+              {"while (x) {", "}"}, {"\"", "\""}, {"/*", "*/"}, {"f(", ")"},
+            };
+            auto &p = pairs[random.below(sizeof(pairs) / sizeof(*pairs))];
+            size_t depth = 1 << random.below(14);
+            std::string open, close;
+            for (size_t k = 0; k < depth && open.size() + close.size() < maxLength / 2; ++k) {
+              open += p[0];
+              close += p[1];
+            }
+            text.insert(r.first + r.second, close);
+            text.insert(r.first, open);
+          }
+        }
+      }
+      if (text.size() > maxLength)
+        text.resize(maxLength);
+      return text;
+    }
+};
+
+// The input being run, for the signal handlers
+const std::string *running = nullptr;
+char crashPath[4096];
+char timeoutPath[4096];
+
+void writeFinding(const char *path, const std::string &input) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd >= 0) {
+    for (size_t done = 0; done < input.size(); ) {
+      ssize_t n = write(fd, input.data() + done, input.size() - done);
+      if (n <= 0)
+        break;
+      done += n;
+    }
+    close(fd);
+  }
+}
+
+// Async signal safe, the input goes where crashPath says and the run ends
+void onSignal(int signal) {
+  if (running) {
+    const char *path = signal == SIGALRM ? timeoutPath : crashPath;
+    writeFinding(path, *running);
+    const char message[] = "Fuzz: input written to ";
+    write(2, message, sizeof(message) - 1);
+    write(2, path, strlen(path));
+    write(2, "\n", 1);
+  }
+  _exit(1);
+}
+
+void handleSignals() {
+  static std::vector<char> stack(1 << 16);
+  stack_t alternate = {};
+  alternate.ss_sp = stack.data();
+  alternate.ss_size = stack.size();
+  sigaltstack(&alternate, nullptr);
+  struct sigaction action = {};
+  action.sa_handler = onSignal;
+  action.sa_flags = SA_ONSTACK;
+  for (int signal: {SIGSEGV, SIGBUS, SIGABRT, SIGFPE, SIGILL, SIGALRM})
+    sigaction(signal, &action, nullptr);
+}
+
+std::string hex(uint64_t hash) {
+  std::ostringstream out;
+  out << std::hex << std::setw(16) << std::setfill('0') << hash;
+  return out.str();
+}
+
+void readSeeds(const std::string &directory, std::vector<std::string> &seeds) {
+  DIR *dir = opendir(directory.c_str());
+  if (!dir)
+    return;
+  std::vector<std::string> names;
+  while (struct dirent *entry = readdir(dir))
+    if (entry->d_name[0] != '.')
+      names.push_back(entry->d_name);
+  closedir(dir);
+  std::sort(names.begin(), names.end());
+  for (const std::string &name: names) {
+    std::string path = directory + "/" + name;
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+      continue;
+    if (S_ISDIR(info.st_mode))
+      readSeeds(path, seeds);
+    else if (name.size() > 5 && name.compare(name.size() - 5, 5, ".jack") == 0) {
+      std::ifstream file(path, std::ios::binary);
+      seeds.emplace_back((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    }
+  }
+}
+
+struct Hot {
+  std::string input;
+  double score;
+};
+
+void usage() {
+  std::cerr << "Usage: Fuzz [--runs N] [--seed N] [--max-len BYTES] [--time-per-byte NS]"
+            << " [--memory-per-byte N] [--timeout S] [--out DIR] [--replay FILE...]"
+            << " [seed directories]" << std::endl;
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t runs = 10000, seed = 1;
+  size_t maxLength = 1 << 16;
+  unsigned timeout = 10;
+  std::string out = "fuzz-findings";
+  std::vector<std::string> directories, replay;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg[0] != '-') {
+      directories.push_back(arg);
+      continue;
+    }
+    if (i + 1 >= argc)
+      usage();
+    if (arg == "--runs")
+      runs = std::stoull(argv[++i]);
+    else if (arg == "--seed")
+      seed = std::stoull(argv[++i]);
+    else if (arg == "--max-len")
+      maxLength = std::max(1ul, std::stoul(argv[++i]));
+    else if (arg == "--time-per-byte")
+      limits.timePerByte = std::stod(argv[++i]) * 1e-9;
+    else if (arg == "--memory-per-byte")
+      limits.memoryPerByte = std::stod(argv[++i]);
+    else if (arg == "--timeout")
+      timeout = std::stoul(argv[++i]);
+    else if (arg == "--out")
+      out = argv[++i];
+    else if (arg == "--replay")
+      while (i + 1 < argc && argv[i + 1][0] != '-')
+        replay.push_back(argv[++i]);
+    else
+      usage();
+  }
+
+  std::vector<std::string> corpus;
+  if (!replay.empty())
+    for (const std::string &path: replay) {
+      std::ifstream file(path, std::ios::binary);
+      if (!file)
+        throw std::runtime_error("Failed to open file: " + path);
+      corpus.emplace_back((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    }
+  else {
+    if (directories.empty())
+      directories.push_back("11");
+    for (const std::string &directory: directories)
+      readSeeds(directory, corpus);
+  }
+  if (corpus.empty()) {
+    std::cerr << "No .jack seeds found" << std::endl;
+    exit(1);
+  }
+  mkdir(out.c_str(), 0777);
+  handleSignals();
+
+  Random random(seed);
+  Mutator mutator(random, maxLength);
+  std::vector<Hot> hot;         // the costliest per byte so far
+  const size_t HOT = 64;
+  uint64_t compiled = 0, findings = 0, bytes = 0, executions = 0;
+  double slowest = 0, largest = 0;
+  auto begin = std::chrono::steady_clock::now();
+
+  size_t total = replay.empty() ? runs : corpus.size();
+  for (uint64_t run = 0; run < total; ++run) {
+    std::string input;
+    if (!replay.empty() || run < corpus.size())
+      input = corpus[run];
+    else {
+      bool fromHot = !hot.empty() && random.below(2);
+      input = mutator.mutate(fromHot ? hot[random.below(hot.size())].input
+                                     : corpus[random.below(corpus.size())], corpus);
+    }
+    std::string name = hex(hashBytes(input)) + ".jack";
+    snprintf(crashPath, sizeof(crashPath), "%s/crash-%s", out.c_str(), name.c_str());
+    snprintf(timeoutPath, sizeof(timeoutPath), "%s/timeout-%s", out.c_str(), name.c_str());
+    running = &input;
+    alarm(timeout);
+    Cost cost = compile(input);
+    alarm(0);
+    running = nullptr;
+    ++executions;
+    bytes += input.size();
+    compiled += cost.compiled;
+
+    double time = timeScore(cost, input.size()), memory = memoryScore(cost, input.size());
+    // A slow one is run again, the quickest run counts, so a preempted run is no finding
+    for (int again = 0; again < 2 && time > 1; ++again) {
+      time = std::min(time, timeScore(compile(input), input.size()));
+      ++executions;
+    }
+    slowest = std::max(slowest, time);
+    largest = std::max(largest, memory);
+    if (!replay.empty())
+      std::cout << replay[run] << ": " << input.size() << " bytes in " << std::fixed
+                << std::setprecision(3) << cost.seconds * 1e3 << " ms, " << cost.memory
+                << " bytes of memory, " << (cost.compiled ? "compiled" : "error")
+                << std::defaultfloat << std::endl;
+    if (time > 1 || memory > 1) {
+      std::string kind = time > 1 ? "slow-" : "memory-";
+      std::cerr << "Fuzz: " << kind << name << ", " << input.size() << " bytes in "
+                << std::fixed << std::setprecision(3) << cost.seconds * 1e3 << " ms, "
+                << cost.memory << " bytes of memory" << std::defaultfloat << std::endl;
+      std::ofstream(out + "/" + kind + name, std::ios::binary) << input;
+      ++findings;
+      continue;
+    }
+    double score = std::max(time, memory);
+    if (hot.size() < HOT)
+      hot.push_back({input, score});
+    else {
+      auto coolest = std::min_element(hot.begin(), hot.end(), [](const Hot &a, const Hot &b) {
+        return a.score < b.score;
+      });
+      if (score > coolest->score)
+        *coolest = {input, score};
+    }
+  }
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  std::cout << "Fuzz: " << total << " inputs, " << executions / seconds << " runs/s, "
+            << bytes / total << " bytes on average, " << compiled << " compiled" << std::endl;
+  std::cout << "Costliest: " << std::setprecision(3) << slowest << " of the time limit, "
+            << largest << " of the memory limit, " << findings << " findings";
+  if (findings)
+    std::cout << " in " << out;
+  std::cout << std::endl;
+  return findings ? 1 : 0;
+}
+#endif
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+// How the generated program is laid out
+struct Shape {
+  uint32_t classes = 4;         // besides Main
+  uint32_t subroutines = 16;    // per class, besides new and dispose
+  uint32_t statements = 6;      // per block
+  uint32_t depth = 2;           // of if and while blocks inside each other
+  uint32_t expression = 4;      // terms of an expression
+  double strings = 0.1;         // share of statements with a string constant
+  uint32_t locals = 4;          // per subroutine
+  uint32_t fields = 4;          // per class, as many statics again
+  uint64_t seed = 1;
+};
+
+/*
+  Valid Jack of a given shape, deterministic for a seed. Class C<k> has a
+  constructor, functions g<j> and methods m<j> of two int arguments that
+  use their arguments, locals, the statics, the fields in methods, and
+  call the functions of every class and the methods of their own. Main
+  makes a C0 and disposes of it. Everything declared is used correctly, so
+  the compiler takes the whole program without an error.
+*/
+class Generator {
+  private:
+    Shape shape;
+    uint64_t state;
+    std::string out;
+    bool inMethod = false;
+
+    // xorshift, so the output is the same with every library
+    uint64_t next() {
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      return state;
+    }
+
+    uint32_t below(uint32_t n) {
+      return n ? next() % n : 0;
+    }
+
+    bool chance(double p) {
+      return (next() >> 11) * (1.0 / 9007199254740992.0) < p;
+    }
+
+    void indent(uint32_t level) {
+      out.append(2 * level, ' ');
+    }
+
+    // An int variable in scope
+    std::string variable() {
+      uint32_t n = 2 + shape.locals + shape.fields + (inMethod ? shape.fields : 0);
+      uint32_t i = below(n);
+      if (i < 2)
+        return i ? "b" : "a";
+      i -= 2;
+      if (i < shape.locals)
+        return "l" + std::to_string(i);
+      i -= shape.locals;
+      if (i < shape.fields)
+        return "s" + std::to_string(i);
+      return "f" + std::to_string(i - shape.fields);
+    }
+
+    // A function of any class, or a method of this one in a method
+    std::string call() {
+      std::string args = "(" + term(2) + ", " + term(2) + ")";
+      if (inMethod && shape.subroutines > 1 && chance(0.5))
+        return "m" + std::to_string(2 * below(shape.subroutines / 2) + 1) + args;
+      return "C" + std::to_string(below(shape.classes)) + ".g"
+             + std::to_string(2 * below((shape.subroutines + 1) / 2)) + args;
+    }
+
+    std::string term(uint32_t level) {
+      switch (below(level < 2 ? 6 : 3)) {
+        case 0: return variable();
+        case 1: return std::to_string(below(32768));
+        case 2: return "-" + variable();
+        case 3: return "(" + expression(level + 1, 2 + below(3)) + ")";
+        case 4: return shape.subroutines ? call() : variable();
+        default: return "~(" + variable() + " = " + std::to_string(below(100)) + ")";
+      }
+    }
+
+    std::string expression(uint32_t level, uint32_t terms) {
+      static const char *ops[] = {" + ", " - ", " * ", " / ", " & ", " | ", " < ", " > ", " = "};
+      std::string e = term(level);
+      for (uint32_t i = 1; i < terms; ++i)
+        e += ops[below(9)] + term(level);
+      return e;
+    }
+
+    std::string literal() {
+      static const char *words[] = {"alpha", "beta", "gamma", "delta", "score", "ball", "{", "}",
+                                    "//", "/*", "x", "42"};
+      std::string s;
+      for (uint32_t i = 0, n = 1 + below(6); i < n; ++i)
+        s += std::string(i ? " " : "") + words[below(12)];
+      return s;
+    }
+
+    void block(uint32_t level, uint32_t depth) {
+      uint32_t nested = depth < shape.depth ? below(shape.statements) : UINT32_MAX;
+      for (uint32_t i = 0; i < shape.statements; ++i) {
+        indent(level);
+        if (i == nested) {
+          bool loop = chance(0.5);
+          out += (loop ? "while (" : "if (") + expression(0, shape.expression) + ") {\n";
+          block(level + 1, depth + 1);
+          indent(level);
+          if (!loop && chance(0.5)) {
+            out += "} else {\n";
+            block(level + 1, depth + 1);
+            indent(level);
+          }
+          out += "}\n";
+        }
+        else if (chance(shape.strings)) {
+          if (chance(0.5))
+            out += "let str = \"" + literal() + "\";\n";
+          else
+            out += "do Output.printString(\"" + literal() + "\");\n";
+        }
+        else if (shape.subroutines && chance(0.2))
+          out += "do " + call() + ";\n";
+        else if (chance(0.1)) {
+          out += "let arr[" + variable() + "] = " + expression(0, shape.expression) + ";\n";
+        }
+        else
+          out += "let " + variable() + " = " + expression(0, shape.expression) + ";\n";
+      }
+    }
+
+    void subroutine(uint32_t j) {
+      inMethod = j % 2 == 1;
+      out += std::string(inMethod ? "  method" : "  function") + " int " + (inMethod ? "m" : "g")
+             + std::to_string(j) + "(int a, int b) {\n";
+      for (uint32_t i = 0; i < shape.locals; ++i)
+        out += "    var int l" + std::to_string(i) + ";\n";
+      out += "    var String str;\n    var Array arr;\n";
+      for (uint32_t i = 0; i < shape.locals; ++i)
+        out += "    let l" + std::to_string(i) + " = " + std::to_string(i) + ";\n";
+      out += "    let arr = Array.new(" + std::to_string(8 + below(8)) + ");\n";
+      block(2, 0);
+      out += "    do arr.dispose();\n    return " + expression(0, shape.expression) + ";\n  }\n\n";
+    }
+
+    void writeClass(uint32_t k) {
+      std::string name = "C" + std::to_string(k);
+      out = "// Generated, class " + std::to_string(k) + " of " + std::to_string(shape.classes)
+            + "\nclass " + name + " {\n";
+      for (uint32_t i = 0; i < shape.fields; ++i)
+        out += "  field int f" + std::to_string(i) + ";\n";
+      for (uint32_t i = 0; i < shape.fields; ++i)
+        out += "  static int s" + std::to_string(i) + ";\n";
+      out += "\n  constructor " + name + " new() {\n";
+      for (uint32_t i = 0; i < shape.fields; ++i)
+        out += "    let f" + std::to_string(i) + " = " + std::to_string(i) + ";\n";
+      out += "    return this;\n  }\n\n";
+      out += "  method void dispose() {\n    do Memory.deAlloc(this);\n    return;\n  }\n\n";
+      for (uint32_t j = 0; j < shape.subroutines; ++j)
+        subroutine(j);
+      out += "}\n";
+    }
+
+  public:
+    Generator(const Shape &shape) : shape(shape), state(shape.seed * 0x9e3779b97f4a7c15ull | 1) {
+      this->shape.classes = std::max(1u, shape.classes);
+    }
+
+    // Every class of the program as (name, source), Main first
+    std::vector<std::pair<std::string, std::string> > program() {
+      std::vector<std::pair<std::string, std::string> > classes;
+      classes.push_back({"Main", "class Main {\n  function void main() {\n    var C0 c;\n"
+                                 "    let c = C0.new();\n    do c.dispose();\n    return;\n"
+                                 "  }\n}\n"});
+      for (uint32_t k = 0; k < shape.classes; ++k) {
+        writeClass(k);
+        classes.push_back({"C" + std::to_string(k), std::move(out)});
+      }
+      return classes;
+    }
+};
@@ -0,0 +1,313 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "JackTokenizer.hh"
+#include "Json.hh"
+
+extern char **environ;
+
+/*
+  Golden output regression and throughput over the programs of a directory,
+  11/ by default, one program per subdirectory.
+
+  check compiles each program with --xml in a scratch copy and compares
+  every .vm and .xml with the ones shipped next to the sources. optimize
+  compiles with -O and compares the .vm written with each .ovm. A program
+  with an expected.err (expected.oerr for optimize) has to fail, print
+  just that on stderr and write no .vm. bench also compiles each program
+  runs times without the parse tree and reports the wall time, with tokens
+  and lines per second. The report is JSON on stdout, the mismatches go to
+  stderr, and the exit status is 1 if anything differs.
+
+  Usage: Harness check|optimize|bench [--runs N] [--compiler PATH] [directory]
+*/
+
+struct Program {
+  std::string name;
+  std::string directory;
+  std::vector<std::string> classes;     // file names without .jack
+  uint64_t bytes = 0;
+  uint64_t lines = 0;
+  uint64_t tokens = 0;
+  std::vector<std::string> mismatches;
+  std::vector<double> times;            // seconds, sorted
+};
+
+std::vector<std::string> entries(const std::string &directory) {
+  std::vector<std::string> names;
+  if (DIR *dir = opendir(directory.c_str())) {
+    while (struct dirent *entry = readdir(dir))
+      if (entry->d_name[0] != '.')
+        names.push_back(entry->d_name);
+    closedir(dir);
+  }
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+bool readFile(const std::string &path, std::string &text) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    return false;
+  text.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  return true;
+}
+
+void copyFile(const std::string &from, const std::string &to) {
+  std::string text;
+  readFile(from, text);
+  std::ofstream(to, std::ios::binary) << text;
+}
+
+// Runs compiler on directory with its output thrown away, or its errors kept
+// in errors, the exit status
+int run(const std::string &compiler, const std::vector<std::string> &options,
+        const std::string &directory, const std::string &errors = "") {
+  std::vector<std::string> args{compiler};
+  args.insert(args.end(), options.begin(), options.end());
+  args.push_back(directory);
+  std::vector<char *> argv;
+  for (std::string &arg: args)
+    argv.push_back(&arg[0]);
+  argv.push_back(nullptr);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+  if (!errors.empty())
+    posix_spawn_file_actions_addopen(&actions, 2, errors.c_str(),
+                                     O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  pid_t pid;
+  int status = -1;
+  if (posix_spawn(&pid, compiler.c_str(), &actions, nullptr, argv.data(), environ) == 0)
+    waitpid(pid, &status, 0);
+  posix_spawn_file_actions_destroy(&actions);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// The line of the first difference, 0 if there is none
+uint64_t firstDifference(const std::string &a, const std::string &b) {
+  auto diff = std::mismatch(a.begin(), a.end(), b.begin(), b.end());
+  if (diff.first == a.end() && diff.second == b.end())
+    return 0;
+  return std::count(a.begin(), diff.first, '\n') + 1;
+}
+
+void compare(Program &program, const std::string &expected, const std::string &actual) {
+  std::string want, got;
+  if (!readFile(expected, want))
+    return;
+  if (!readFile(actual, got)) {
+    program.mismatches.push_back(expected + ": not written");
+    return;
+  }
+  if (uint64_t line = firstDifference(want, got))
+    program.mismatches.push_back(expected + ": differs from line " + std::to_string(line));
+}
+
+void measure(Program &program) {
+  for (const std::string &name: program.classes) {
+    std::string source;
+    readFile(program.directory + "/" + name + ".jack", source);
+    program.bytes += source.size();
+    program.lines += std::count(source.begin(), source.end(), '\n');
+    Arena arena;
+    JackTokenizer tokenizer;
+    tokenizer.initSource(source, arena);
+    while (tokenizer.hasMoreTokens()) {
+      tokenizer.advance();
+      ++program.tokens;
+    }
+  }
+}
+
+// Whether the program is expected to fail when compiled in mode
+bool failing(const Program &program, const std::string &mode) {
+  struct stat st;
+  std::string errors = program.directory + (mode == "optimize" ? "/expected.oerr"
+                                                                 : "/expected.err");
+  return stat(errors.c_str(), &st) == 0;
+}
+
+void check(Program &program, const std::string &compiler, const std::string &scratch,
+           const std::string &mode) {
+  for (const std::string &name: program.classes) {
+    copyFile(program.directory + "/" + name + ".jack", scratch + "/" + name + ".jack");
+    unlink((scratch + "/" + name + ".vm").c_str());
+  }
+  bool optimize = mode == "optimize";
+  std::string errors = scratch + ".err";
+  int status = run(compiler, {optimize ? "-O" : "--xml"}, scratch, errors);
+  if (failing(program, mode)) {
+    if (status != 1)
+      program.mismatches.push_back(program.directory + ": compiler did not fail");
+    compare(program, program.directory + (optimize ? "/expected.oerr" : "/expected.err"),
+            errors);
+    for (const std::string &name: program.classes) {
+      struct stat st;
+      if (stat((scratch + "/" + name + ".vm").c_str(), &st) == 0)
+        program.mismatches.push_back(program.directory + "/" + name + ".vm: written");
+    }
+  }
+  else if (status != 0)
+    program.mismatches.push_back(program.directory + ": compiler failed");
+  else
+    for (const std::string &name: program.classes) {
+      std::string expected = program.directory + "/" + name, actual = scratch + "/" + name;
+      if (optimize)
+        compare(program, expected + ".ovm", actual + ".vm");
+      else {
+        compare(program, expected + ".vm", actual + ".vm");
+        compare(program, expected + ".xml", actual + ".xml");
+      }
+    }
+  unlink(errors.c_str());
+}
+
+void bench(Program &program, const std::string &compiler, const std::string &scratch, int runs) {
+  // The first run warms the page cache and is not counted
+  for (int i = 0; i <= runs; ++i) {
+    auto begin = std::chrono::steady_clock::now();
+    run(compiler, {}, scratch);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()
+                                                   - begin).count();
+    if (i > 0)
+      program.times.push_back(seconds);
+  }
+  std::sort(program.times.begin(), program.times.end());
+}
+
+void appendNumber(std::string &json, const char *key, double value) {
+  json += std::string("\"") + key + "\":" + std::to_string(value);
+}
+
+std::string report(const std::vector<Program> &programs, const std::string &compiler,
+                   bool timed) {
+  std::string json = "{\"compiler\":";
+  appendJsonString(json, compiler);
+  json += ",\"programs\":[";
+  uint64_t failures = 0, lines = 0, tokens = 0;
+  double total = 0;
+  for (size_t i = 0; i < programs.size(); ++i) {
+    const Program &p = programs[i];
+    json += i ? ",\n{" : "\n{";
+    json += "\"name\":";
+    appendJsonString(json, p.name);
+    json += ",\"classes\":" + std::to_string(p.classes.size())
+            + ",\"bytes\":" + std::to_string(p.bytes)
+            + ",\"lines\":" + std::to_string(p.lines)
+            + ",\"tokens\":" + std::to_string(p.tokens)
+            + ",\"ok\":" + (p.mismatches.empty() ? "true" : "false") + ",\"mismatches\":[";
+    for (size_t m = 0; m < p.mismatches.size(); ++m) {
+      json += m ? "," : "";
+      appendJsonString(json, p.mismatches[m]);
+    }
+    json += "]";
+    if (timed && !p.times.empty()) {
+      double median = p.times[p.times.size() / 2];
+      json += ",\"runs\":" + std::to_string(p.times.size()) + ",";
+      appendNumber(json, "wallMsMedian", median * 1000);
+      json += ",";
+      appendNumber(json, "wallMsMin", p.times.front() * 1000);
+      json += ",";
+      appendNumber(json, "wallMsMax", p.times.back() * 1000);
+      json += ",";
+      appendNumber(json, "tokensPerSec", p.tokens / median);
+      json += ",";
+      appendNumber(json, "linesPerSec", p.lines / median);
+      total += median;
+    }
+    json += "}";
+    failures += !p.mismatches.empty();
+    lines += p.lines;
+    tokens += p.tokens;
+  }
+  json += "],\n\"total\":{\"programs\":" + std::to_string(programs.size())
+          + ",\"failures\":" + std::to_string(failures)
+          + ",\"lines\":" + std::to_string(lines) + ",\"tokens\":" + std::to_string(tokens);
+  if (timed && total > 0) {
+    json += ",";
+    appendNumber(json, "wallMsMedian", total * 1000);
+    json += ",";
+    appendNumber(json, "tokensPerSec", tokens / total);
+    json += ",";
+    appendNumber(json, "linesPerSec", lines / total);
+  }
+  return json + "}}";
+}
+
+void usage() {
+  std::cerr << "Usage: Harness check|optimize|bench [--runs N] [--compiler PATH] [directory]"
+            << std::endl;
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2)
+    usage();
+  std::string mode = argv[1];
+  if (mode != "check" && mode != "optimize" && mode != "bench")
+    usage();
+  std::string compiler = "./JackCompiler", root = "11";
+  int runs = 10;
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--runs" && i + 1 < argc)
+      runs = std::max(1, std::stoi(argv[++i]));
+    else if (arg == "--compiler" && i + 1 < argc)
+      compiler = argv[++i];
+    else if (arg[0] == '-')
+      usage();
+    else
+      root = arg;
+  }
+
+  char scratchRoot[] = "/tmp/JackHarnessXXXXXX";
+  if (!mkdtemp(scratchRoot)) {
+    std::cerr << "Failed to create a scratch directory" << std::endl;
+    exit(1);
+  }
+
+  std::vector<Program> programs;
+  for (const std::string &name: entries(root)) {
+    Program program;
+    program.name = name;
+    program.directory = root + "/" + name;
+    for (const std::string &file: entries(program.directory))
+      if (file.size() > 5 && file.substr(file.size() - 5) == ".jack")
+        program.classes.push_back(file.substr(0, file.size() - 5));
+    if (program.classes.empty())
+      continue;
+    std::string scratch = std::string(scratchRoot) + "/" + name;
+    mkdir(scratch.c_str(), 0777);
+    measure(program);
+    check(program, compiler, scratch, mode);
+    if (mode == "bench" && !failing(program, mode))
+      bench(program, compiler, scratch, runs);
+    for (const std::string &mismatch: program.mismatches)
+      std::cerr << "FAIL " << mismatch << std::endl;
+    for (const std::string &file: entries(scratch))
+      unlink((scratch + "/" + file).c_str());
+    rmdir(scratch.c_str());
+    programs.push_back(std::move(program));
+  }
+  rmdir(scratchRoot);
+
+  std::cout << report(programs, compiler, mode == "bench") << std::endl;
+  for (const Program &program: programs)
+    if (!program.mismatches.empty())
+      return 1;
+  return 0;
+}
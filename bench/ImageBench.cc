@@ -0,0 +1,96 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "ClassImage.hh"
+#include "CompilationEngine.hh"
+
+/*
+  What a class image saves: opening and checking the image of a synthetic
+  class of about 100k lines, and loading it into an Ast for the code
+  generator, against parsing the same source again.
+
+  Usage: ImageBench [lines] [directory]
+*/
+
+std::string syntheticClass(uint64_t lines) {
+  std::string source = "class Main {\n  field int x, y;\n  static String s;\n\n";
+  uint64_t n = 4;
+  for (uint64_t f = 0; n < lines; ++f) {
+    source += "  method int f" + std::to_string(f) + "(int a, int b) {\n";
+    source += "    var int i;\n";
+    source += "    let i = 0;\n";
+    source += "    while (i < a) {\n";
+    source += "      if (i > b) { let x = x + i; } else { let y = y - 1; }\n";
+    source += "      let s = \"} not a brace {\"; // nor } this\n";
+    source += "      do f" + std::to_string(f) + "(i, b);\n";
+    source += "      let i = i + 1;\n";
+    source += "    }\n";
+    source += "    return x;\n";
+    source += "  }\n\n";
+    n += 12;
+  }
+  return source + "}\n";
+}
+
+template <class F>
+double medianSeconds(int runs, F f) {
+  std::vector<double> times;
+  for (int i = 0; i < runs; ++i) {
+    auto begin = std::chrono::steady_clock::now();
+    f();
+    times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+  }
+  std::sort(times.begin(), times.end());
+  return times[times.size() / 2];
+}
+
+void report(const char *name, uint64_t bytes, double seconds) {
+  std::cout << name << ": " << seconds * 1000 << " ms, "
+            << bytes / seconds / 1e9 << " GB/s of source" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t lines = argc > 1 ? std::stoull(argv[1]) : 100000;
+  std::string directory = argc > 2 ? argv[2] : "bench/images";
+  mkdir(directory.c_str(), 0777);
+  std::string source = syntheticClass(lines);
+  std::cout << "ImageBench: " << lines << " lines, " << source.size() << " bytes" << std::endl;
+
+  {
+    CompilationEngine engine(source, "Main", nullptr);
+    engine.parseClass();
+    ClassImage::write(directory, source, engine.tree());
+  }
+
+  double parse = medianSeconds(5, [&]() {
+    CompilationEngine engine(source, "Main", nullptr);
+    engine.parseClass();
+  });
+  report("parse", source.size(), parse);
+
+  double open = medianSeconds(5, [&]() {
+    ClassImage image;
+    if (!image.open(directory, source)) {
+      std::cerr << "image rejected" << std::endl;
+      exit(1);
+    }
+  });
+  report("open and check", source.size(), open);
+
+  double load = medianSeconds(5, [&]() {
+    ClassImage image;
+    image.open(directory, source);
+    Arena arena;
+    Ast ast(arena);
+    image.load(ast);
+  });
+  report("open, check and load", source.size(), load);
+  std::cout << "check is " << parse / open << "x, load " << parse / load
+            << "x faster than a parse" << std::endl;
+  return 0;
+}
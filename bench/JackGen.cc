@@ -0,0 +1,77 @@
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include <sys/stat.h>
+
+#include "Generator.hh"
+
+/*
+  Writes a generated Jack program of the given shape into directory, one
+  .jack file per class, for scaling and stress tests.
+
+  Usage: JackGen [--classes N] [--subroutines N] [--statements N] [--depth N]
+                 [--expression N] [--strings P] [--locals N] [--fields N]
+                 [--seed N] directory
+*/
+
+void usage() {
+  std::cerr << "Usage: JackGen [--classes N] [--subroutines N] [--statements N] [--depth N]"
+            << " [--expression N] [--strings P] [--locals N] [--fields N] [--seed N]"
+            << " directory" << std::endl;
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  Shape shape;
+  std::string directory;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg[0] != '-') {
+      if (!directory.empty())
+        usage();
+      directory = arg;
+      continue;
+    }
+    if (i + 1 >= argc)
+      usage();
+    std::string value = argv[++i];
+    if (arg == "--classes")
+      shape.classes = std::stoul(value);
+    else if (arg == "--subroutines")
+      shape.subroutines = std::stoul(value);
+    else if (arg == "--statements")
+      shape.statements = std::stoul(value);
+    else if (arg == "--depth")
+      shape.depth = std::stoul(value);
+    else if (arg == "--expression")
+      shape.expression = std::stoul(value);
+    else if (arg == "--strings")
+      shape.strings = std::stod(value);
+    else if (arg == "--locals")
+      shape.locals = std::stoul(value);
+    else if (arg == "--fields")
+      shape.fields = std::stoul(value);
+    else if (arg == "--seed")
+      shape.seed = std::stoull(value);
+    else
+      usage();
+  }
+  if (directory.empty())
+    usage();
+
+  mkdir(directory.c_str(), 0777);
+  uint64_t bytes = 0;
+  auto program = Generator(shape).program();
+  for (auto &c: program) {
+    std::string path = directory + "/" + c.first + ".jack";
+    std::ofstream file(path, std::ios::binary);
+    if (!file)
+      throw std::runtime_error("Failed to open file: " + path);
+    file << c.second;
+    bytes += c.second.size();
+  }
+  std::cout << "JackGen: " << program.size() << " classes, " << bytes << " bytes in "
+            << directory << std::endl;
+  return 0;
+}
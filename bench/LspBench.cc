@@ -0,0 +1,106 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "LanguageServer.hh"
+
+/*
+  Keystroke to diagnostics latency of the language server on a synthetic
+  class of about 10k lines: the time to handle a didChange of one
+  character inside a subroutine, diagnostics published included, against
+  opening the class, which analyzes it whole.
+
+  Usage: LspBench [lines] [edits]
+*/
+
+std::string syntheticClass(uint64_t lines) {
+  std::string source = "class Main {\n  field int x, y;\n  static String s;\n\n";
+  uint64_t n = 4;
+  for (uint64_t f = 0; n < lines; ++f) {
+    source += "  method int f" + std::to_string(f) + "(int a, int b) {\n";
+    source += "    var int i;\n";
+    source += "    let i = 0;\n";
+    source += "    while (i < a) {\n";
+    source += "      if (i > b) { let x = x + i; } else { let y = y - 1; }\n";
+    source += "      let s = \"} not a brace {\"; // nor } this\n";
+    source += "      do f" + std::to_string(f) + "(i, b);\n";
+    source += "      let i = i + 1;\n";
+    source += "    }\n";
+    source += "    return x;\n";
+    source += "  }\n\n";
+    n += 12;
+  }
+  return source + "}\n";
+}
+
+std::string jsonString(std::string_view text) {
+  std::string json;
+  appendJsonString(json, text);
+  return json;
+}
+
+Json message(const std::string &text) {
+  Json json;
+  if (!JsonParser::parse(text, json)) {
+    std::cerr << "bad message: " << text << std::endl;
+    exit(1);
+  }
+  return json;
+}
+
+// One character inserted or removed at line, character
+Json edit(int version, uint64_t line, uint64_t character, bool insert) {
+  std::string position = "{\"line\":" + std::to_string(line) + ",\"character\":";
+  std::string start = position + std::to_string(character) + "}";
+  std::string end = position + std::to_string(character + (insert ? 0 : 1)) + "}";
+  return message("{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didChange\",\"params\":"
+                 "{\"textDocument\":{\"uri\":\"file:///bench/Main.jack\",\"version\":"
+                 + std::to_string(version) + "},\"contentChanges\":[{\"range\":{\"start\":"
+                 + start + ",\"end\":" + end + "},\"text\":\"" + (insert ? "+" : "") + "\"}]}}");
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t lines = argc > 1 ? std::stoull(argv[1]) : 10000;
+  int edits = argc > 2 ? std::stoi(argv[2]) : 2000;
+  std::string source = syntheticClass(lines);
+
+  std::istringstream in;
+  std::ostringstream out;
+  LanguageServer server(in, out);
+  Json open = message("{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didOpen\",\"params\":"
+                      "{\"textDocument\":{\"uri\":\"file:///bench/Main.jack\","
+                      "\"languageId\":\"jack\",\"version\":1,\"text\":" + jsonString(source) + "}}}");
+  auto begin = std::chrono::steady_clock::now();
+  server.handle(open);
+  double opened = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  std::cout << "LspBench: " << lines << " lines, " << source.size() << " bytes, open "
+            << opened * 1000 << " ms" << std::endl;
+
+  // Every other edit breaks the expression "i + 1" of the middle subroutine,
+  // the next one mends it
+  uint64_t middle = 4 + (lines - 4) / 24 * 12;
+  uint64_t line = middle + 7, character = 16;
+  std::vector<double> times;
+  for (int k = 0; k < edits; ++k) {
+    Json change = edit(k + 2, line, character, k % 2 == 0);
+    out.str("");
+    begin = std::chrono::steady_clock::now();
+    server.handle(change);
+    times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now()
+                                                  - begin).count());
+    bool broken = out.str().find("\"message\"") != std::string::npos;
+    if (broken != (k % 2 == 0)) {
+      std::cerr << "edit " << k << ": unexpected diagnostics " << out.str() << std::endl;
+      return 1;
+    }
+  }
+  std::sort(times.begin(), times.end());
+  std::cout << "didChange over " << edits << " edits: median "
+            << times[times.size() / 2] * 1e6 << " us, p99 "
+            << times[times.size() * 99 / 100] * 1e6 << " us, max "
+            << times.back() * 1e6 << " us" << std::endl;
+  return 0;
+}
@@ -0,0 +1,328 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "CompilationEngine.hh"
+#include "Json.hh"
+
+/*
+  Microbenchmarks of the components in isolation: the tokenizer on sources
+  of one token class each, SymbolTable define and resolve at scope sizes
+  from 8 to 4096, VMWriter emitting commands and rendering them as text,
+  and a whole class parsed and generated.
+
+  Each benchmark runs warmup iterations, then iterations timed one by one,
+  and reports the median and p99 per iteration with the rate of its items.
+  The process is pinned to one core so runs compare. --save writes the
+  results as JSON, --baseline compares against such a file and fails if a
+  median is slower by more than --threshold percent.
+
+  Usage: MicroBench [--iterations N] [--warmup N] [--cpu K|-1] [--filter TEXT]
+                    [--save FILE] [--baseline FILE] [--threshold PERCENT]
+*/
+
+struct Result {
+  std::string name;
+  const char *unit;         // what items counts
+  uint64_t items;           // per iteration
+  double median;            // seconds per iteration
+  double p99;
+};
+
+struct Settings {
+  int iterations = 30;
+  int warmup = 3;
+  std::string filter;
+};
+
+Settings settings;
+std::vector<Result> results;
+
+template <class F>
+void measure(const std::string &name, const char *unit, uint64_t items, F f) {
+  if (name.find(settings.filter) == std::string::npos)
+    return;
+  for (int i = 0; i < settings.warmup; ++i)
+    f();
+  std::vector<double> times;
+  for (int i = 0; i < settings.iterations; ++i) {
+    auto begin = std::chrono::steady_clock::now();
+    f();
+    times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+  }
+  std::sort(times.begin(), times.end());
+  Result result{name, unit, items, times[times.size() / 2],
+                times[std::min(times.size() - 1, times.size() * 99 / 100)]};
+  std::cout << std::left << std::setw(28) << name << std::right << std::fixed
+            << std::setprecision(3) << std::setw(12) << result.median * 1e6 << " us"
+            << std::setw(12) << result.p99 * 1e6 << " us p99"
+            << std::setw(10) << std::setprecision(1) << items / result.median / 1e6
+            << " M" << unit << "/s" << std::endl;
+  results.push_back(result);
+}
+
+// Stops the optimizer dropping a result
+template <class T>
+void keep(const T &value) {
+  asm volatile("" : : "g"(&value) : "memory");
+}
+
+std::string repeat(std::string_view piece, size_t bytes) {
+  std::string text;
+  while (text.size() < bytes)
+    text += piece;
+  return text;
+}
+
+std::string syntheticClass(uint64_t lines) {
+  std::string source = "class Main {\n  field int x, y;\n  static String s;\n\n";
+  uint64_t n = 4;
+  for (uint64_t f = 0; n < lines; ++f) {
+    source += "  method int f" + std::to_string(f) + "(int a, int b) {\n";
+    source += "    var int i;\n";
+    source += "    let i = 0;\n";
+    source += "    while (i < a) {\n";
+    source += "      if (i > b) { let x = x + i; } else { let y = y - 1; }\n";
+    source += "      let s = \"} not a brace {\"; // nor } this\n";
+    source += "      do f" + std::to_string(f) + "(i, b);\n";
+    source += "      let i = i + 1;\n";
+    source += "    }\n";
+    source += "    return x;\n";
+    source += "  }\n\n";
+    n += 12;
+  }
+  return source + "}\n";
+}
+
+uint64_t countTokens(std::string_view source) {
+  Arena arena;
+  JackTokenizer tokenizer;
+  tokenizer.initSource(source, arena);
+  uint64_t tokens = 0;
+  while (tokenizer.hasMoreTokens()) {
+    tokenizer.advance();
+    ++tokens;
+  }
+  return tokens;
+}
+
+void tokenizerBenchmarks() {
+  const size_t BYTES = 256 << 10;
+  struct { const char *name; std::string source; } classes[] = {
+    {"tokenizer/keyword", repeat("class method function constructor int boolean char void "
+                                 "var static field let do if else while return true false "
+                                 "null this\n", BYTES)},
+    {"tokenizer/symbol", repeat("{ } ( ) [ ] . , ; + - * / & | < > = ~\n", BYTES)},
+    {"tokenizer/identifier", repeat("alpha beta_2 gammaDelta x1 _tmp counterOfThings\n", BYTES)},
+    {"tokenizer/int", repeat("0 7 12 345 6789 32767\n", BYTES)},
+    {"tokenizer/string", repeat("\"hello world\" \"\" \"a somewhat longer string constant\"\n",
+                                BYTES)},
+    {"tokenizer/comment", repeat("// a line comment\n/* a block\n   comment */ x\n", BYTES)},
+  };
+  for (auto &c: classes) {
+    uint64_t tokens = countTokens(c.source);
+    measure(c.name, "tokens", tokens, [&]() { keep(countTokens(c.source)); });
+  }
+}
+
+void symbolTableBenchmarks() {
+  for (uint32_t size: {8u, 64u, 512u, 4096u}) {
+    std::vector<uint32_t> names;
+    for (uint32_t i = 0; i < size; ++i)
+      names.push_back(intern("local" + std::to_string(i)));
+    uint32_t type = intern("int");
+
+    // Fresh tables, so the growth of the scope is in the time
+    const uint32_t TABLES = std::max(1u, 65536 / size);
+    measure("symbols/define/" + std::to_string(size), "defines", (uint64_t)TABLES * size, [&]() {
+      for (uint32_t t = 0; t < TABLES; ++t) {
+        Arena arena;
+        SymbolTable table(arena);
+        table.startSubroutine();
+        for (uint32_t name: names)
+          table.define(name, type, kind::VAR);
+        keep(table);
+      }
+    });
+
+    Arena arena;
+    SymbolTable table(arena);
+    std::vector<uint32_t> fields;
+    for (uint32_t i = 0; i < 16; ++i) {
+      fields.push_back(intern("field" + std::to_string(i)));
+      table.define(fields.back(), type, kind::FIELD);
+    }
+    table.startSubroutine();
+    for (uint32_t name: names)
+      table.define(name, type, kind::VAR);
+    const uint64_t LOOKUPS = 1 << 18;
+    measure("symbols/resolve/" + std::to_string(size), "lookups", LOOKUPS, [&]() {
+      uint64_t sum = 0;
+      for (uint64_t i = 0; i < LOOKUPS; ++i)
+        sum += table.resolve(names[i % size])->index;
+      keep(sum);
+    });
+    // Through the subroutine scope to the class scope
+    measure("symbols/resolve-outer/" + std::to_string(size), "lookups", LOOKUPS, [&]() {
+      uint64_t sum = 0;
+      for (uint64_t i = 0; i < LOOKUPS; ++i)
+        sum += table.resolve(fields[i % fields.size()])->index;
+      keep(sum);
+    });
+  }
+}
+
+// A mix like the generator's output: pushes and pops, arithmetic, calls, labels
+void emit(VMWriter &writer, uint32_t function, uint32_t callee, uint64_t commands) {
+  for (uint64_t i = 0; i < commands; i += 8) {
+    writer.writePush(segment::LOCAL, i & 7);
+    writer.writePush(segment::CONSTANT, i & 255);
+    writer.writeArithmetic(command::ADD);
+    writer.writePop(segment::THIS, 1);
+    writer.writeCall(callee, 2);
+    writer.writeIf("WHILE_END0");
+    writer.writeGoto("WHILE_EXP0");
+    if (i % 512 == 0)
+      writer.writeFunction(function, 3);
+    else
+      writer.writeReturn();
+  }
+}
+
+void writerBenchmarks() {
+  const uint64_t COMMANDS = 1 << 16;
+  uint32_t function = intern("Main.f"), callee = intern("Math.multiply");
+  measure("vmwriter/emit", "commands", COMMANDS, [&]() {
+    VMWriter writer;
+    emit(writer, function, callee, COMMANDS);
+    keep(writer.code().code.size());
+  });
+  VMWriter writer;
+  emit(writer, function, callee, COMMANDS);
+  measure("vmwriter/render", "commands", COMMANDS, [&]() {
+    std::ostringstream out;
+    for (const VMCommand &c: writer.code().code)
+      writeCommand(out, c);
+    keep(out.tellp());
+  });
+}
+
+// compileClass without the file: the same parse and generation
+void engineBenchmarks() {
+  for (uint64_t lines: {1000ull, 10000ull}) {
+    std::string source = syntheticClass(lines);
+    ProgramIndex index;
+    index.addSource(source);
+    measure("engine/compileClass/" + std::to_string(lines), "lines", lines, [&]() {
+      CompilationEngine engine(source, "Main", &index);
+      engine.parseClass();
+      engine.generate();
+      keep(engine.code().code.size());
+    });
+  }
+}
+
+void save(const std::string &path) {
+  std::string json = "{\"benchmarks\":[";
+  for (size_t i = 0; i < results.size(); ++i) {
+    json += i ? ",\n{\"name\":" : "\n{\"name\":";
+    appendJsonString(json, results[i].name);
+    json += ",\"medianNs\":" + std::to_string(results[i].median * 1e9)
+            + ",\"p99Ns\":" + std::to_string(results[i].p99 * 1e9)
+            + ",\"items\":" + std::to_string(results[i].items) + "}";
+  }
+  std::ofstream file(path);
+  if (!file)
+    throw std::runtime_error("Failed to open file: " + path);
+  file << json << "]}" << std::endl;
+}
+
+// False if a benchmark got slower than the baseline by more than threshold percent
+bool compare(const std::string &path, double threshold) {
+  std::ifstream file(path);
+  std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  Json baseline;
+  if (!file || !JsonParser::parse(text, baseline)) {
+    std::cerr << "Failed to read baseline: " << path << std::endl;
+    exit(1);
+  }
+  bool ok = true;
+  std::cout << std::endl << "against " << path << std::endl;
+  for (const Result &result: results)
+    for (const Json &entry: baseline["benchmarks"].items) {
+      if (entry["name"].text != result.name)
+        continue;
+      double change = (result.median * 1e9 / entry["medianNs"].number - 1) * 100;
+      bool slower = change > threshold;
+      ok = ok && !slower;
+      std::cout << std::left << std::setw(28) << result.name << std::right << std::fixed
+                << std::setprecision(1) << std::setw(8) << std::showpos << change
+                << std::noshowpos << " %" << (slower ? "  SLOWER" : "") << std::endl;
+    }
+  return ok;
+}
+
+void usage() {
+  std::cerr << "Usage: MicroBench [--iterations N] [--warmup N] [--cpu K|-1] [--filter TEXT]"
+            << " [--save FILE] [--baseline FILE] [--threshold PERCENT]" << std::endl;
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  int cpu = 0;
+  double threshold = 10;
+  std::string savePath, baselinePath;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc)
+      usage();
+    else if (arg == "--iterations")
+      settings.iterations = std::max(1, std::stoi(argv[++i]));
+    else if (arg == "--warmup")
+      settings.warmup = std::max(0, std::stoi(argv[++i]));
+    else if (arg == "--cpu")
+      cpu = std::stoi(argv[++i]);
+    else if (arg == "--filter")
+      settings.filter = argv[++i];
+    else if (arg == "--save")
+      savePath = argv[++i];
+    else if (arg == "--baseline")
+      baselinePath = argv[++i];
+    else if (arg == "--threshold")
+      threshold = std::stod(argv[++i]);
+    else
+      usage();
+  }
+
+  if (cpu >= 0) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof set, &set) != 0)
+      std::cerr << "Failed to pin to cpu " << cpu << ", running unpinned" << std::endl;
+#else
+    std::cerr << "Pinning is not supported here, running unpinned" << std::endl;
+#endif
+  }
+
+  tokenizerBenchmarks();
+  symbolTableBenchmarks();
+  writerBenchmarks();
+  engineBenchmarks();
+
+  if (!savePath.empty())
+    save(savePath);
+  if (!baselinePath.empty() && !compare(baselinePath, threshold))
+    return 1;
+  return 0;
+}
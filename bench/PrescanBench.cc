@@ -0,0 +1,94 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <string.h>
+#include <vector>
+
+#include "Prescan.hh"
+#include "JackTokenizer.hh"
+
+/*
+  Times the prescan over a synthetic class of about a million lines against
+  two baselines over the same bytes: memchr counting newlines, which runs at
+  about memory bandwidth, and a full JackTokenizer pass.
+
+  Usage: PrescanBench [lines]
+*/
+
+// A class of subroutines with nested blocks, comments and string literals
+std::string syntheticClass(uint64_t lines) {
+  std::string source = "class Main {\n  field int x, y;\n  static String s;\n\n";
+  uint64_t n = 4;
+  for (uint64_t f = 0; n < lines; ++f) {
+    source += "  /** subroutine " + std::to_string(f) + " { */\n";
+    source += "  method int f" + std::to_string(f) + "(int a, int b) {\n";
+    source += "    var int i;\n";
+    source += "    let i = 0;\n";
+    source += "    while (i < a) {\n";
+    source += "      if (i > b) { let x = x + i; } else { let y = y - 1; }\n";
+    source += "      let s = \"} not a brace {\"; // nor } this\n";
+    source += "      let i = i + 1;\n";
+    source += "    }\n";
+    source += "    return x;\n";
+    source += "  }\n\n";
+    n += 12;
+  }
+  return source + "}\n";
+}
+
+template <class F>
+double medianSeconds(int runs, F f) {
+  std::vector<double> times;
+  for (int i = 0; i < runs; ++i) {
+    auto begin = std::chrono::steady_clock::now();
+    f();
+    times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+  }
+  std::sort(times.begin(), times.end());
+  return times[times.size() / 2];
+}
+
+void report(const char *name, uint64_t bytes, double seconds) {
+  std::cout << name << ": " << seconds * 1000 << " ms, "
+            << bytes / seconds / 1e9 << " GB/s" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t lines = argc > 1 ? std::stoull(argv[1]) : 1000000;
+  std::string source = syntheticClass(lines);
+  std::cout << "PrescanBench: " << lines << " lines, " << source.size() << " bytes" << std::endl;
+
+  uint64_t newlines = 0;
+  report("memchr", source.size(), medianSeconds(9, [&]() {
+    newlines = 0;
+    for (const char *p = source.data(), *end = p + source.size();
+         (p = (const char *)memchr(p, '\n', end - p)); ++p)
+      ++newlines;
+  }));
+
+  std::vector<SourceRange> ranges;
+  report("prescan", source.size(), medianSeconds(9, [&]() {
+    ranges.clear();
+    if (!prescan(source, ranges)) {
+      std::cerr << "prescan failed" << std::endl;
+      exit(1);
+    }
+  }));
+
+  uint64_t tokens = 0;
+  report("tokenizer", source.size(), medianSeconds(3, [&]() {
+    Arena arena;
+    JackTokenizer tokenizer;
+    tokenizer.initSource(source, arena);
+    tokens = 0;
+    while (tokenizer.hasMoreTokens()) {
+      tokenizer.advance();
+      ++tokens;
+    }
+  }));
+
+  std::cout << ranges.size() << " subroutines, " << tokens << " tokens, "
+            << newlines << " newlines" << std::endl;
+  return 0;
+}
@@ -0,0 +1,248 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Generator.hh"
+
+extern char **environ;
+
+/*
+  Compile time and peak memory of the compiler against the size of its
+  input. One dimension of a generated program doubles at every step, the
+  subroutines per class unless --axis says otherwise, and each program is
+  compiled by a separate process so its peak RSS is its own.
+
+  The table plots both against the bytes of source. The slope of a log-log
+  fit tells how they grow: 1 is linear, and a slope past --limit, 1.15 by
+  default, is reported as super-linear and fails the run. Memory is fitted
+  above the peak of compiling an empty program.
+
+  Usage: ScalingBench [--axis subroutines|classes|statements|expression|depth|locals]
+                      [--start N] [--steps N] [--runs N] [--limit SLOPE]
+                      [--compiler PATH] [--json]
+*/
+
+struct Sample {
+  uint32_t value;
+  uint64_t bytes = 0;
+  uint64_t lines = 0;
+  double seconds = 0;       // median
+  double peak = 0;          // bytes of RSS, the largest of the runs
+};
+
+void removeDirectory(const std::string &directory) {
+  if (DIR *dir = opendir(directory.c_str())) {
+    while (struct dirent *entry = readdir(dir))
+      if (entry->d_name[0] != '.')
+        unlink((directory + "/" + entry->d_name).c_str());
+    closedir(dir);
+  }
+  rmdir(directory.c_str());
+}
+
+// Runs compiler on directory, the wall time and peak RSS in bytes
+bool run(const std::string &compiler, const std::string &directory, double &seconds,
+         double &peak) {
+  std::string program = compiler, path = directory;
+  char *argv[] = {&program[0], &path[0], nullptr};
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+  auto begin = std::chrono::steady_clock::now();
+  pid_t pid;
+  int status = -1;
+  struct rusage usage;
+  bool spawned = posix_spawn(&pid, compiler.c_str(), &actions, nullptr, argv, environ) == 0;
+  posix_spawn_file_actions_destroy(&actions);
+  if (!spawned || wait4(pid, &status, 0, &usage) < 0)
+    return false;
+  seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+#ifdef __APPLE__
+  peak = usage.ru_maxrss;
+#else
+  peak = usage.ru_maxrss * 1024.0;
+#endif
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+Sample measure(const Shape &shape, uint32_t value, const std::string &compiler,
+               const std::string &directory, int runs) {
+  Sample sample;
+  sample.value = value;
+  mkdir(directory.c_str(), 0777);
+  for (auto &c: Generator(shape).program()) {
+    std::ofstream(directory + "/" + c.first + ".jack", std::ios::binary) << c.second;
+    sample.bytes += c.second.size();
+    sample.lines += std::count(c.second.begin(), c.second.end(), '\n');
+  }
+  std::vector<double> times;
+  for (int i = 0; i < runs; ++i) {
+    double seconds, peak;
+    if (!run(compiler, directory, seconds, peak)) {
+      std::cerr << "Compiler failed on " << directory << std::endl;
+      exit(1);
+    }
+    times.push_back(seconds);
+    sample.peak = std::max(sample.peak, peak);
+  }
+  std::sort(times.begin(), times.end());
+  sample.seconds = times[times.size() / 2];
+  removeDirectory(directory);
+  return sample;
+}
+
+// Least squares slope of log y against log x
+double slope(const std::vector<double> &x, const std::vector<double> &y) {
+  double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+  for (size_t i = 0; i < x.size(); ++i) {
+    if (x[i] <= 0 || y[i] <= 0)
+      continue;
+    double lx = std::log(x[i]), ly = std::log(y[i]);
+    n += 1;
+    sx += lx;
+    sy += ly;
+    sxx += lx * lx;
+    sxy += lx * ly;
+  }
+  return n < 2 ? 0 : (n * sxy - sx * sy) / (n * sxx - sx * sx);
+}
+
+std::string bar(double value, double largest) {
+  return std::string(largest > 0 ? (size_t)std::lround(30 * value / largest) : 0, '#');
+}
+
+void usage() {
+  std::cerr << "Usage: ScalingBench [--axis subroutines|classes|statements|expression|depth"
+            << "|locals] [--start N] [--steps N] [--runs N] [--limit SLOPE]"
+            << " [--compiler PATH] [--json]" << std::endl;
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  std::string axis = "subroutines", compiler = "./JackCompiler";
+  uint32_t start = 0;
+  int steps = 7, runs = 3;
+  double limit = 1.15;
+  bool json = false;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--json")
+      json = true;
+    else if (i + 1 >= argc)
+      usage();
+    else if (arg == "--axis")
+      axis = argv[++i];
+    else if (arg == "--start")
+      start = std::stoul(argv[++i]);
+    else if (arg == "--steps")
+      steps = std::max(2, std::stoi(argv[++i]));
+    else if (arg == "--runs")
+      runs = std::max(1, std::stoi(argv[++i]));
+    else if (arg == "--limit")
+      limit = std::stod(argv[++i]);
+    else if (arg == "--compiler")
+      compiler = argv[++i];
+    else
+      usage();
+  }
+
+  Shape base;
+  uint32_t *dimension = axis == "subroutines" ? &base.subroutines
+                        : axis == "classes" ? &base.classes
+                        : axis == "statements" ? &base.statements
+                        : axis == "expression" ? &base.expression
+                        : axis == "depth" ? &base.depth
+                        : axis == "locals" ? &base.locals : nullptr;
+  if (!dimension)
+    usage();
+  if (start == 0)
+    start = axis == "subroutines" ? 16 : axis == "statements" ? 4 : 2;
+
+  char scratch[] = "/tmp/JackScalingXXXXXX";
+  if (!mkdtemp(scratch)) {
+    std::cerr << "Failed to create a scratch directory" << std::endl;
+    exit(1);
+  }
+  std::string directory = std::string(scratch) + "/program";
+
+  // What the process takes for nothing, memory is fitted above it
+  Shape empty;
+  empty.classes = 1;
+  empty.subroutines = 0;
+  Sample idle = measure(empty, 0, compiler, directory, runs);
+
+  std::vector<Sample> samples;
+  for (int i = 0; i < steps; ++i) {
+    Shape shape = base;
+    uint32_t *value = (uint32_t *)((char *)&shape + ((char *)dimension - (char *)&base));
+    *value = start << i;
+    samples.push_back(measure(shape, *value, compiler, directory, runs));
+  }
+  rmdir(scratch);
+
+  std::vector<double> bytes, times, peaks;
+  double slowest = 0, largest = 0;
+  for (const Sample &s: samples) {
+    bytes.push_back(s.bytes);
+    times.push_back(s.seconds);
+    peaks.push_back(std::max(0.0, s.peak - idle.peak));
+    slowest = std::max(slowest, s.seconds);
+    largest = std::max(largest, s.peak);
+  }
+  double timeSlope = slope(bytes, times), memorySlope = slope(bytes, peaks);
+
+  if (json) {
+    std::cout << "{\"axis\":\"" << axis << "\",\"idlePeakBytes\":" << idle.peak
+              << ",\"samples\":[";
+    for (size_t i = 0; i < samples.size(); ++i)
+      std::cout << (i ? ",\n" : "\n") << "{\"" << axis << "\":" << samples[i].value
+                << ",\"bytes\":" << samples[i].bytes << ",\"lines\":" << samples[i].lines
+                << ",\"seconds\":" << samples[i].seconds
+                << ",\"peakBytes\":" << samples[i].peak << "}";
+    std::cout << "],\n\"timeSlope\":" << timeSlope << ",\"memorySlope\":" << memorySlope
+              << "}" << std::endl;
+  }
+  else {
+    std::cout << "ScalingBench: " << axis << " doubling from " << start << ", "
+              << runs << " runs each" << std::endl;
+    std::cout << std::setw(8) << axis.substr(0, 8) << std::setw(12) << "bytes"
+              << std::setw(10) << "ms" << std::setw(10) << "ns/byte" << std::setw(10)
+              << "peak MB" << "  time" << std::endl;
+    for (const Sample &s: samples)
+      std::cout << std::setw(8) << s.value << std::setw(12) << s.bytes << std::fixed
+                << std::setprecision(1) << std::setw(10) << s.seconds * 1000
+                << std::setw(10) << s.seconds * 1e9 / s.bytes << std::setw(10)
+                << s.peak / (1 << 20) << "  " << bar(s.seconds, slowest) << std::endl;
+    std::cout << std::setw(8) << "" << std::setw(42) << "peak MB" << "  memory" << std::endl;
+    for (const Sample &s: samples)
+      std::cout << std::setw(8) << s.value << std::setw(12) << s.bytes << std::setw(30)
+                << s.peak / (1 << 20) << "  " << bar(s.peak, largest) << std::endl;
+    std::cout << std::setprecision(2) << "log-log slope against bytes: time " << timeSlope
+              << ", memory " << memorySlope << " (above " << idle.peak / (1 << 20)
+              << " MB idle)" << std::endl;
+  }
+  bool superLinear = false;
+  if (timeSlope > limit) {
+    std::cerr << "Time grows super-linearly, slope " << timeSlope << std::endl;
+    superLinear = true;
+  }
+  if (memorySlope > limit) {
+    std::cerr << "Memory grows super-linearly, slope " << memorySlope << std::endl;
+    superLinear = true;
+  }
+  return superLinear ? 1 : 0;
+}
@@ -0,0 +1,263 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+  Compiles one synthetic class of several gigabytes with --stream under a
+  fixed memory cap. The compiler runs with its data segment limited to the
+  cap, so a heap that grows past it fails the run, and its peak RSS, the
+  mapped source included, has to stay under the cap too.
+
+  The class Big has a few statics and fields and then functions of about
+  --subroutine-bytes each, so the class level tables stay small and the
+  length of the file is all that grows. It is compiled at a sixteenth of
+  --gigabytes and then whole, and the two peaks have to be within --slack
+  of each other. First a class of --check-bytes is compiled with and
+  without --stream and the .vm files have to be the same. make stream-test
+  runs it on a compiler built with BENCHFLAGS, the -O0 build takes four
+  times as long.
+
+  Usage: StreamTest [--gigabytes N] [--subroutine-bytes N] [--cap MB]
+                    [--slack MB] [--check-bytes N] [--compiler PATH]
+*/
+
+struct Run {
+  uint64_t bytes = 0;       // of source
+  double seconds = 0;
+  double peak = 0;          // bytes of RSS
+};
+
+// One function of Big, name is spliced in between head and tail
+struct Function {
+  std::string head = "  function int f";
+  std::string tail;
+
+  Function(uint64_t bytes) {
+    tail = "(int a, int b) {\n"
+           "    var int x, y, i;\n"
+           "    var Array t;\n"
+           "    var String s;\n"
+           "    let x = a;\n"
+           "    let y = b;\n"
+           "    let t = Array.new(8);\n";
+    const std::string block =
+      "    let i = 0;\n"
+      "    while (i < 8) {\n"
+      "      let t[i] = (x * i) + (y / (i + 1));\n"
+      "      if ((t[i] > 100) & ~(x = y)) {\n"
+      "        let x = x - t[i];\n"
+      "      }\n"
+      "      else {\n"
+      "        let y = y + (t[i] * 2) - total;\n"
+      "      }\n"
+      "      let i = i + 1;\n"
+      "    }\n"
+      "    let s = \"a string constant\";\n"
+      "    do s.dispose();\n"
+      "    let total = total + Big.twice(x, -y);\n";
+    do
+      tail += block;
+    while (tail.size() + block.size() < bytes);
+    tail += "    do t.dispose();\n"
+            "    return x + y;\n"
+            "  }\n\n";
+  }
+};
+
+// Big.jack in directory, about bytes long, the bytes written
+uint64_t writeClass(const std::string &directory, uint64_t bytes, uint64_t subroutineBytes) {
+  mkdir(directory.c_str(), 0777);
+  std::string path = directory + "/Big.jack";
+  std::ofstream out(path, std::ios::binary);
+  if (!out) {
+    std::cerr << "Failed to open file: " << path << std::endl;
+    exit(1);
+  }
+  std::string header = "// Generated by StreamTest\n"
+                       "class Big {\n"
+                       "  static int total, count;\n"
+                       "  field int width, height;\n\n"
+                       "  function int twice(int a, int b) {\n"
+                       "    let count = count + 1;\n"
+                       "    return (a + b) * 2;\n"
+                       "  }\n\n";
+  Function function(subroutineBytes);
+  out << header;
+  uint64_t written = header.size();
+  for (uint64_t n = 0; written < bytes; ++n) {
+    std::string name = std::to_string(n);
+    out << function.head << name << function.tail;
+    written += function.head.size() + name.size() + function.tail.size();
+  }
+  out << "}\n";
+  written += 2;
+  if (!out) {
+    std::cerr << "Failed to write " << path << std::endl;
+    exit(1);
+  }
+  return written;
+}
+
+void removeClass(const std::string &directory) {
+  unlink((directory + "/Big.jack").c_str());
+  unlink((directory + "/Big.vm").c_str());
+  rmdir(directory.c_str());
+}
+
+// Runs compiler on directory with its data segment limited to cap bytes
+Run compile(const std::string &compiler, const std::string &directory, bool stream,
+            uint64_t cap) {
+  Run run;
+  auto begin = std::chrono::steady_clock::now();
+  pid_t pid = fork();
+  if (pid == 0) {
+    struct rlimit limit = {cap, cap};
+    if (cap)
+      setrlimit(RLIMIT_DATA, &limit);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    if (stream)
+      execl(compiler.c_str(), compiler.c_str(), "--stream", directory.c_str(), (char *)nullptr);
+    else
+      execl(compiler.c_str(), compiler.c_str(), directory.c_str(), (char *)nullptr);
+    _exit(127);
+  }
+  int status = -1;
+  struct rusage usage;
+  if (pid < 0 || wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status)
+      || WEXITSTATUS(status) != 0) {
+    std::cerr << "Compiler failed on " << directory
+              << (cap ? ", it may have gone over the cap" : "") << std::endl;
+    exit(1);
+  }
+  run.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+#ifdef __APPLE__
+  run.peak = usage.ru_maxrss;
+#else
+  run.peak = usage.ru_maxrss * 1024.0;
+#endif
+  return run;
+}
+
+// Writes and compiles a class of about bytes with --stream, then removes it
+Run streamClass(const std::string &compiler, const std::string &directory, uint64_t bytes,
+                uint64_t subroutineBytes, uint64_t cap) {
+  uint64_t written = writeClass(directory, bytes, subroutineBytes);
+  Run run = compile(compiler, directory, true, cap);
+  run.bytes = written;
+  removeClass(directory);
+  return run;
+}
+
+bool sameFile(const std::string &a, const std::string &b) {
+  std::ifstream x(a, std::ios::binary), y(b, std::ios::binary);
+  std::vector<char> p(1 << 20), q(1 << 20);
+  while (x && y) {
+    x.read(p.data(), p.size());
+    y.read(q.data(), q.size());
+    if (x.gcount() != y.gcount() || !std::equal(p.begin(), p.begin() + x.gcount(), q.begin()))
+      return false;
+  }
+  return x.eof() && y.eof();
+}
+
+void print(const char *name, const Run &run) {
+  std::cout << std::left << std::setw(10) << name << std::right << std::setw(14) << run.bytes
+            << std::fixed << std::setprecision(1) << std::setw(10) << run.seconds
+            << std::setw(10) << run.bytes / run.seconds / (1 << 20) << std::setw(10)
+            << run.peak / (1 << 20) << std::endl;
+}
+
+void usage() {
+  std::cerr << "Usage: StreamTest [--gigabytes N] [--subroutine-bytes N] [--cap MB]"
+            << " [--slack MB] [--check-bytes N] [--compiler PATH]" << std::endl;
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  std::string compiler = "./JackCompiler";
+  double gigabytes = 2;
+  uint64_t subroutineBytes = 256 * 1024, cap = 64, slack = 8, checkBytes = 16 << 20;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc)
+      usage();
+    else if (arg == "--gigabytes")
+      gigabytes = std::stod(argv[++i]);
+    else if (arg == "--subroutine-bytes")
+      subroutineBytes = std::stoull(argv[++i]);
+    else if (arg == "--cap")
+      cap = std::stoull(argv[++i]);
+    else if (arg == "--slack")
+      slack = std::stoull(argv[++i]);
+    else if (arg == "--check-bytes")
+      checkBytes = std::stoull(argv[++i]);
+    else if (arg == "--compiler")
+      compiler = argv[++i];
+    else
+      usage();
+  }
+  cap <<= 20;
+  slack <<= 20;
+  uint64_t bytes = gigabytes * (1 << 30);
+
+  char scratch[] = "/tmp/JackStreamXXXXXX";
+  if (!mkdtemp(scratch)) {
+    std::cerr << "Failed to create a scratch directory" << std::endl;
+    exit(1);
+  }
+  std::string plain = std::string(scratch) + "/plain", streamed = std::string(scratch) + "/stream";
+
+  std::cout << "StreamTest: " << gigabytes << " GB class, functions of "
+            << subroutineBytes << " bytes, " << cap / (1 << 20) << " MB cap" << std::endl;
+  std::cout << std::left << std::setw(10) << "run" << std::right << std::setw(14) << "bytes"
+            << std::setw(10) << "s" << std::setw(10) << "MB/s" << std::setw(10) << "peak MB"
+            << std::endl;
+
+  // The same code as without --stream, which has no cap
+  writeClass(plain, checkBytes, subroutineBytes);
+  Run whole = compile(compiler, plain, false, 0);
+  whole.bytes = writeClass(streamed, checkBytes, subroutineBytes);
+  Run check = compile(compiler, streamed, true, cap);
+  check.bytes = whole.bytes;
+  print("whole", whole);
+  print("stream", check);
+  bool failed = false;
+  if (!sameFile(plain + "/Big.vm", streamed + "/Big.vm")) {
+    std::cerr << "The code of --stream differs from the code without it" << std::endl;
+    failed = true;
+  }
+  removeClass(plain);
+  removeClass(streamed);
+
+  Run small = streamClass(compiler, streamed, bytes / 16, subroutineBytes, cap);
+  print("stream", small);
+  Run large = streamClass(compiler, streamed, bytes, subroutineBytes, cap);
+  print("stream", large);
+  rmdir(scratch);
+
+  for (const Run *run: {&check, &small, &large})
+    if (run->peak > cap) {
+      std::cerr << "Peak RSS " << run->peak / (1 << 20) << " MB is over the cap" << std::endl;
+      failed = true;
+    }
+  if (large.peak > small.peak + slack) {
+    std::cerr << "Peak RSS grows with the file, " << small.peak / (1 << 20) << " MB to "
+              << large.peak / (1 << 20) << " MB" << std::endl;
+    failed = true;
+  }
+  if (!failed)
+    std::cout << "Peak RSS stays under " << cap / (1 << 20) << " MB" << std::endl;
+  return failed ? 1 : 0;
+}